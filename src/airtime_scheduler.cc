@@ -0,0 +1,111 @@
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include "airtime_scheduler.h"
+
+AirtimeScheduler::AirtimeScheduler(const std::vector<int> &client_ids, uint32_t quantum_us)
+    : quantum_us_(quantum_us), curr_(0), holder_(-1), pause_until_us_(0) {
+  assert(quantum_us > 0);
+  for (size_t i = 0; i < client_ids.size(); i++) {
+    Flow flow = {client_ids[i], false, 0, 0, 0};
+    flows_.push_back(flow);
+  }
+  Pthread_mutex_init(&lock_, NULL);
+  /** The timed wait in Acquire is on NowUs() time. */
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  Pthread_cond_init(&grant_cond_, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+AirtimeScheduler::~AirtimeScheduler() {
+  Pthread_mutex_destroy(&lock_);
+  Pthread_cond_destroy(&grant_cond_);
+}
+
+uint64_t AirtimeScheduler::NowUs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+int AirtimeScheduler::FindFlow(int client_id) const {
+  for (size_t i = 0; i < flows_.size(); i++) {
+    if (flows_[i].client_id == client_id)
+      return i;
+  }
+  assert(false);
+  return -1;
+}
+
+void AirtimeScheduler::Acquire(int client_id, uint32_t airtime_us) {
+  Pthread_mutex_lock(&lock_);
+  int ind = FindFlow(client_id);
+  flows_[ind].is_waiting = true;
+  flows_[ind].cost = airtime_us;
+  Schedule();
+  while (holder_ != ind) {
+    if (pause_until_us_) {
+      struct timespec time_to_wait;
+      time_to_wait.tv_sec = pause_until_us_ / 1000000;
+      time_to_wait.tv_nsec = (pause_until_us_ % 1000000) * 1000;
+      int err = pthread_cond_timedwait(&grant_cond_, &lock_, &time_to_wait);
+      assert(err == 0 || err == ETIMEDOUT);
+    }
+    else {
+      Pthread_cond_wait(&grant_cond_, &lock_);
+    }
+    Schedule();
+  }
+  Pthread_mutex_unlock(&lock_);
+}
+
+void AirtimeScheduler::Release(int client_id) {
+  Pthread_mutex_lock(&lock_);
+  int ind = FindFlow(client_id);
+  assert(holder_ == ind);
+  holder_ = -1;
+  flows_[ind].release_us = NowUs();
+  Schedule();
+  Pthread_mutex_unlock(&lock_);
+}
+
+void AirtimeScheduler::Schedule() {
+  if (holder_ >= 0)
+    return;
+  bool is_any_waiting = false;
+  for (size_t i = 0; i < flows_.size(); i++)
+    is_any_waiting |= flows_[i].is_waiting;
+  if (!is_any_waiting)
+    return;
+
+  /** Every pass adds a quantum to the waiting flows, so this ends. */
+  uint64_t now = NowUs();
+  while (1) {
+    Flow &flow = flows_[curr_];
+    if (flow.is_waiting) {
+      if (flow.deficit >= flow.cost) {
+        flow.deficit -= flow.cost;
+        flow.is_waiting = false;
+        holder_ = curr_;   /** Stay, the flow may go on with what is left. */
+        pause_until_us_ = 0;
+        pthread_cond_broadcast(&grant_cond_);
+        return;
+      }
+      flow.deficit += quantum_us_;
+    }
+    else if (flow.release_us) {
+      if (now < flow.release_us + kIdleUs) {  /** Likely back with its next batch. */
+        if (pause_until_us_ != flow.release_us + kIdleUs) {
+          pause_until_us_ = flow.release_us + kIdleUs;
+          pthread_cond_broadcast(&grant_cond_);
+        }
+        return;
+      }
+      flow.release_us = 0;  /** Idle, out of the round. */
+      flow.deficit = 0;
+    }
+    curr_ = (curr_ + 1) % flows_.size();
+  }
+}
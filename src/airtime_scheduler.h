@@ -0,0 +1,69 @@
+#ifndef AIRTIME_SCHEDULER_H_
+#define AIRTIME_SCHEDULER_H_
+
+#include <stdint.h>
+#include <vector>
+#include "pthread_wrapper.h"
+
+/**
+ * Deficit round robin over the clients sharing the whitespace channel, by
+ * airtime rather than bytes. The TxSendAth threads of all clients ask for
+ * their turn before each coded batch, with the batch's airtime as its cost,
+ * and hold the channel while they queue it. A client at a low rate or with
+ * heavy redundancy then waits more rounds for each batch instead of taking
+ * the airtime of the others. A client stays backlogged for kIdleUs after each
+ * batch, the time to build the next one: its turn is held that long instead
+ * of going to the others, and then it is dropped from the round with its
+ * deficit. All times in us, CLOCK_MONOTONIC.
+ */
+class AirtimeScheduler {
+ public:
+  static const uint32_t kDefaultQuantumUs = 2000;
+  static const uint32_t kIdleUs = 1000;
+
+  /** @param client_ids: the clients to schedule, in round robin order. */
+  AirtimeScheduler(const std::vector<int> &client_ids, uint32_t quantum_us);
+  ~AirtimeScheduler();
+
+  /** Airtime of one packet, the model of ScoutRateAdaptation::ApplyFECForData. */
+  static uint32_t PktDuration(uint16_t pkt_size, uint16_t rate, uint32_t extra_time) {
+    return pkt_size * 8.0 / (rate / 10.) + extra_time;
+  }
+
+  /** Wait for the client's turn to send a batch of the given airtime. */
+  void Acquire(int client_id, uint32_t airtime_us);
+
+  /** The batch is queued, pass the channel on. */
+  void Release(int client_id);
+
+  uint32_t quantum_us() const { return quantum_us_; }
+
+ private:
+  struct Flow {
+    int client_id;
+    bool is_waiting;
+    uint32_t cost;      /** Airtime of the batch waiting. */
+    uint32_t deficit;
+    uint64_t release_us;  /** End of its last batch, 0 if idle. */
+  };
+
+  int FindFlow(int client_id) const;
+
+  static uint64_t NowUs();
+
+  /** 
+   * Grant the channel to the next waiting flow with enough deficit, if it is 
+   * free, or hold it for a flow just done with a batch until pause_until_us_.
+   */
+  void Schedule();
+
+  std::vector<Flow> flows_;
+  uint32_t quantum_us_;
+  int curr_;        /** Flow the round robin is at. */
+  int holder_;      /** Flow granted the channel, -1 if free. */
+  uint64_t pause_until_us_;  /** 0 unless the turn is held for a flow. */
+  pthread_mutex_t lock_;
+  pthread_cond_t grant_cond_;
+};
+
+#endif
@@ -0,0 +1,76 @@
+#include <math.h>
+#include <time.h>
+#include "bs_reporter.h"
+
+BSReporter::BSReporter(int bs_id, const std::vector<int> &client_ids, uint32_t interval_ms)
+    : bs_id_(bs_id), interval_ms_(interval_ms), seq_(0), is_urgent_(false) {
+  assert(interval_ms > 0);
+  if (client_ids.size() > BSReportPkt::kMaxClients)
+    Perror("BSReporter: %d clients don't fit into one report, at most %d\n", (int)client_ids.size(), BSReportPkt::kMaxClients);
+  for (size_t i = 0; i < client_ids.size(); i++) {
+    ClientSlot slot;
+    bzero(&slot, sizeof(slot));
+    slot.report.client_id_ = client_ids[i];
+    slot.reported_throughput = -1;
+    slots_.push_back(slot);
+  }
+  Pthread_mutex_init(&lock_, NULL);
+  /** The timed wait in WaitReport is on CLOCK_MONOTONIC. */
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  Pthread_cond_init(&urgent_cond_, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+BSReporter::~BSReporter() {
+  Pthread_mutex_destroy(&lock_);
+  Pthread_cond_destroy(&urgent_cond_);
+}
+
+int BSReporter::FindSlot(int client_id) const {
+  for (size_t i = 0; i < slots_.size(); i++) {
+    if (slots_[i].report.client_id_ == client_id)
+      return i;
+  }
+  assert(false);
+  return -1;
+}
+
+void BSReporter::Update(const BSClientReport &report) {
+  Lock();
+  ClientSlot &slot = slots_[FindSlot(report.client_id_)];
+  slot.report = report;
+  slot.has_report = true;
+  double reported = slot.reported_throughput;
+  if (!is_urgent_ && (reported < 0 || fabs(report.throughput_ - reported) > kReportChangeThresh * reported)) {
+    is_urgent_ = true;
+    Pthread_cond_signal(&urgent_cond_);
+  }
+  UnLock();
+}
+
+void BSReporter::WaitReport(BSReportPkt *pkt) {
+  struct timespec now, time_to_wait;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t due_us = now.tv_sec * 1000000ULL + now.tv_nsec / 1000 + interval_ms_ * 1000ULL;
+  time_to_wait.tv_sec = due_us / 1000000;
+  time_to_wait.tv_nsec = (due_us % 1000000) * 1000;
+
+  Lock();
+  while (!is_urgent_) {
+    int err = pthread_cond_timedwait(&urgent_cond_, &lock_, &time_to_wait);
+    assert(err == 0 || err == ETIMEDOUT);
+    if (err == ETIMEDOUT)
+      break;
+  }
+  is_urgent_ = false;
+  pkt->Init(++seq_, bs_id_);
+  for (size_t i = 0; i < slots_.size(); i++) {
+    if (!slots_[i].has_report)
+      continue;
+    pkt->AddClient(slots_[i].report);
+    slots_[i].reported_throughput = slots_[i].report.throughput_;
+  }
+  UnLock();
+}
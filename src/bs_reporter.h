@@ -0,0 +1,59 @@
+#ifndef BS_REPORTER_H_
+#define BS_REPORTER_H_
+
+#include <vector>
+#include "wspace_asym_util.h"
+
+/** Relative change of a client's throughput reported without waiting for the interval. */
+static const double kReportChangeThresh = 0.2;
+
+/**
+ * Keeps the latest stats of every client of the base station and batches 
+ * them into one BSReportPkt to the controller every interval_ms, or right 
+ * away once a client's throughput moved by kReportChangeThresh from what was
+ * last reported. The feedback threads update the stats, one reporting thread
+ * waits for the reports. Only used with -g: a controller that predates
+ * BS_REPORT takes the per-update BS_STATS the AP sends by default.
+ */
+class BSReporter {
+ public:
+  /** @param client_ids: the clients to report, in report order. */
+  BSReporter(int bs_id, const std::vector<int> &client_ids, uint32_t interval_ms);
+  ~BSReporter();
+
+  /**
+   * Record the latest stats of a client.
+   * Note: Locking is included.
+   */
+  void Update(const BSClientReport &report);
+
+  /**
+   * Block until a report is due and fill it with the clients updated so far.
+   * Note: Locking is included.
+   */
+  void WaitReport(BSReportPkt *pkt);
+
+  uint32_t interval_ms() const { return interval_ms_; }
+
+ private:
+  struct ClientSlot {
+    BSClientReport report;
+    bool has_report;
+    double reported_throughput;  /** In the last report sent, -1 if none. */
+  };
+
+  int FindSlot(int client_id) const;
+
+  void Lock() { Pthread_mutex_lock(&lock_); }
+  void UnLock() { Pthread_mutex_unlock(&lock_); }
+
+  int bs_id_;
+  uint32_t interval_ms_;
+  uint32_t seq_;
+  bool is_urgent_;     /** A significant change waits for the report. */
+  std::vector<ClientSlot> slots_;
+  pthread_mutex_t lock_;
+  pthread_cond_t urgent_cond_;
+};
+
+#endif
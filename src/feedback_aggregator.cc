@@ -0,0 +1,55 @@
+#include <math.h>
+#include "feedback_aggregator.h"
+
+FeedbackAggregator::FeedbackAggregator() 
+    : max_samples_(kDefaultMaxSamples), max_delay_ms_(kDefaultMaxDelayMs), num_pending_(0) {
+  Pthread_mutex_init(&lock_, NULL);
+}
+
+FeedbackAggregator::~FeedbackAggregator() {
+  Pthread_mutex_destroy(&lock_);
+}
+
+bool FeedbackAggregator::Add(const MonotonicTimer &first_sent, const MonotonicTimer &last_sent, uint32_t num_samples) {
+  MonotonicTimer now;
+  Lock();
+  if (num_pending_ == 0) {
+    first_arrival_ = now;
+    start_ = first_sent;
+    end_ = last_sent;
+  }
+  else {
+    if (first_sent < start_)
+      start_ = first_sent;
+    if (last_sent > end_)
+      end_ = last_sent;
+  }
+  num_pending_ += num_samples;
+  bool is_due = num_pending_ >= max_samples_ || (now - first_arrival_).GetMSec() >= max_delay_ms_;
+  UnLock();
+  return is_due;
+}
+
+int FeedbackAggregator::TimeToDueMs() {
+  MonotonicTimer now;
+  int wait_ms = -1;
+  Lock();
+  if (num_pending_ > 0) {
+    double waited_ms = (now - first_arrival_).GetMSec();
+    wait_ms = waited_ms >= max_delay_ms_ ? 0 : int(ceil(max_delay_ms_ - waited_ms));
+  }
+  UnLock();
+  return wait_ms;
+}
+
+bool FeedbackAggregator::Take(MonotonicTimer *start, MonotonicTimer *end) {
+  Lock();
+  bool is_pending = num_pending_ > 0;
+  if (is_pending) {
+    *start = start_;
+    *end = end_;
+    num_pending_ = 0;
+  }
+  UnLock();
+  return is_pending;
+}
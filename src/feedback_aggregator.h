@@ -0,0 +1,62 @@
+#ifndef FEEDBACK_AGGREGATOR_H_
+#define FEEDBACK_AGGREGATOR_H_
+
+#include <stdint.h>
+#include "monotonic_timer.h"
+#include "pthread_wrapper.h"
+
+/**
+ * Collects the raw packet statuses of a client between two loss rate updates.
+ * Statuses are ingested as they come, the loss rates are only recomputed (and
+ * the stats reported) once max_samples of them are pending, or once the oldest 
+ * pending one has waited max_delay_ms. A max_samples of 1 updates on every 
+ * status, as without aggregation.
+ */
+class FeedbackAggregator {
+ public:
+  static const uint32_t kDefaultMaxSamples = 64;
+  static const uint32_t kDefaultMaxDelayMs = 10;
+
+  FeedbackAggregator();
+  ~FeedbackAggregator();
+
+  void set_max_samples(uint32_t max_samples) { max_samples_ = max_samples > 0 ? max_samples : 1; }
+  uint32_t max_samples() const { return max_samples_; }
+
+  void set_max_delay_ms(uint32_t max_delay_ms) { max_delay_ms_ = max_delay_ms; }
+  uint32_t max_delay_ms() const { return max_delay_ms_; }
+
+  /**
+   * Count statuses just ingested.
+   * Note: Locking is included.
+   * @param first_sent, last_sent: send times of the first and last of them.
+   * @return true if the loss rates are due for an update.
+   */
+  bool Add(const MonotonicTimer &first_sent, const MonotonicTimer &last_sent, uint32_t num_samples);
+
+  /** 
+   * @return ms until the pending statuses are due, 0 if they are, -1 if 
+   * none is pending. Note: Locking is included.
+   */
+  int TimeToDueMs();
+
+  /**
+   * Take the send time range of the pending statuses, they are no longer pending.
+   * Note: Locking is included.
+   * @return false if none is pending.
+   */
+  bool Take(MonotonicTimer *start, MonotonicTimer *end);
+
+ private:
+  void Lock() { Pthread_mutex_lock(&lock_); }
+  void UnLock() { Pthread_mutex_unlock(&lock_); }
+
+  uint32_t max_samples_;
+  uint32_t max_delay_ms_;
+  uint32_t num_pending_;
+  MonotonicTimer first_arrival_;  /** When the oldest pending status came in. */
+  MonotonicTimer start_, end_;    /** Send time range of the pending statuses. */
+  pthread_mutex_t lock_;
+};
+
+#endif
@@ -2,11 +2,13 @@
 
 FeedbackRecords::FeedbackRecords(const int32_t *rate_arr, int32_t num_rates, MonotonicTimer t /*=MonotonicTimer(2 , 0)*/) {
   duration_ = t;
-  for(int i = 0; i < num_rates; ++i) {
-    uint16_t rate = (uint16_t)rate_arr[i];
-    struct RateInfo info = {0, 0};
-    rate_table_[rate] = info;
-  }
+  struct RateInfo info = {0, 0};
+  rate_table_.Fill(info);
+  has_rate_.Fill(false);
+  for (int i = 0; i < kNumRateInds; ++i)
+    rate_window_.at_ind(i).base_ = info;
+  for(int i = 0; i < num_rates; ++i)
+    has_rate_[(uint16_t)rate_arr[i]] = true;
   Pthread_mutex_init(&lock_, NULL);
 }
 
@@ -29,12 +31,23 @@ bool FeedbackRecords::InsertPacket(uint32_t seq, PacketStatus status, uint16_t r
   PacketInfo pkt = {now, seq, rate, 0, status};
   Lock();
   records_.push_back(pkt);
+  has_rate_[rate] = true;
+  struct RateWindow &rate_window = rate_window_[rate];
+  RateCount count = {now, rate_window.counts_.empty() ? rate_window.base_ : rate_window.counts_.back().cum_};
+  count.cum_.n_sent_++;
+  if (status == kACKed)
+    count.cum_.n_ack_++;
+  rate_window.counts_.push_back(count);
   /*remove the old packets*/
   bool bb = 0;
   while(!records_.empty()) {
     pkt = records_.front();
     if(pkt.timer + duration_ >= now)
       break;
+    /** The oldest of its rate too, its totals move into the base. */
+    struct RateWindow &window = rate_window_[pkt.rate];
+    window.base_ = window.counts_.front().cum_;
+    window.counts_.pop_front();
     records_.pop_front();
     bb = 1;  
   }
@@ -63,6 +76,30 @@ int32_t FeedbackRecords::BinarySearchRecords(const MonotonicTimer& t) {
   return right;
 }  
 
+struct RateInfo FeedbackRecords::CumulativeBefore(const struct RateWindow& window, const MonotonicTimer& t) {
+  const deque<RateCount> &counts = window.counts_;
+  int32_t left = 0, right = counts.size();  /* first count not before t */
+  while (left < right) {
+    int32_t mid = left + (right - left)/2;
+    if (counts[mid].timer < t)
+      left = mid + 1;
+    else
+      right = mid;
+  }
+  return left == 0 ? window.base_ : counts[left-1].cum_;
+}
+
+void FeedbackRecords::CountRates(const MonotonicTimer& start, const MonotonicTimer& end) {
+  for (int i = 0; i < kNumRateInds; i++) {
+    if (!has_rate_.at_ind(i))
+      continue;
+    struct RateInfo cum_start = CumulativeBefore(rate_window_.at_ind(i), start);
+    struct RateInfo cum_end = CumulativeBefore(rate_window_.at_ind(i), end);
+    rate_table_.at_ind(i).n_sent_ = cum_end.n_sent_ - cum_start.n_sent_;
+    rate_table_.at_ind(i).n_ack_ = cum_end.n_ack_ - cum_start.n_ack_;
+  }
+}
+
 bool FeedbackRecords::CalcLossRates(const MonotonicTimer& start, const MonotonicTimer& end, 
           const vector<uint16_t>& rates, vector<double>& loss_rate, bool is_print) {
   /*ensure legal input*/
@@ -78,16 +115,12 @@ bool FeedbackRecords::CalcLossRates(const MonotonicTimer& start, const Monotonic
   }
 
   ResetRateTable();
-  /*traverse the records_ to get the records in the [start, end] range*/
-  int32_t left = BinarySearchRecords(start);
-  int32_t right = BinarySearchRecords(end);
-  //cout<<left<<"\t"<<right<<endl;
-  for(int i = left; i < right; ++i) {
-    uint16_t rate = records_[i].rate; 
-    rate_table_[rate].n_sent_++;
-    if(records_[i].status==kACKed)
-      rate_table_[rate].n_ack_++;
-    if (is_print) {
+  CountRates(start, end);
+  if (is_print) {
+    /*traverse the records_ in the [start, end] range*/
+    int32_t left = BinarySearchRecords(start);
+    int32_t right = BinarySearchRecords(end);
+    for(int i = left; i < right; ++i) {
       printf("FeedbackRecord::CalcLossRates: time[%.3f] seq_num[%u] rate[%u] length[%u] status[%d]\n", 
       records_[i].timer.GetMSec(), records_[i].seq_num, records_[i].rate, records_[i].length, records_[i].status);
     }
@@ -133,38 +166,32 @@ bool FeedbackRecords::FindSuccessRates(const MonotonicTimer& start, const Monoto
   if (!is_loss_available) {
     /*clear the rate table*/
     ResetRateTable();
-    int32_t left = BinarySearchRecords(start);
-    int32_t right = BinarySearchRecords(end);
-    //cout<<left<<"\t"<<right<<endl;
-    for(int i = left; i < right; ++i) {
-      uint16_t rate = records_[i].rate; 
-      rate_table_[rate].n_sent_++;
-      if(records_[i].status==kACKed)
-        rate_table_[rate].n_ack_++;
-//      printf("FeedbackRecord::FindSuccessRates: time[%.3f] seq_num[%u] rate[%u] length[%u] status[%d]\n", 
-//      records_[i].timer.GetMSec(), records_[i].seq_num, records_[i].rate, records_[i].length, records_[i].status);
-    }
+    CountRates(start, end);
   }
-  map<uint16_t, struct RateInfo>::iterator it_map;
-  for (it_map = rate_table_.begin(); it_map != rate_table_.end(); it_map++) {
-    if (it_map->second.n_ack_ > 0 || it_map->second.n_sent_ < kMinSentCnt)
-      rates.push_back(it_map->first);
+  for (int i = 0; i < kNumRateInds; i++) {
+    if (!has_rate_.at_ind(i))
+      continue;
+    if (rate_table_.at_ind(i).n_ack_ > 0 || rate_table_.at_ind(i).n_sent_ < kMinSentCnt)
+      rates.push_back(kRateTable[i].rate);
   }
   UnLock();
   return true;
 }
 
 void FeedbackRecords::ResetRateTable() {
-  map<uint16_t, struct RateInfo>::iterator it_map;
-  for (it_map = rate_table_.begin(); it_map != rate_table_.end(); it_map++) {
-    it_map->second.n_sent_ = 0;
-    it_map->second.n_ack_ = 0;
-  }
+  struct RateInfo info = {0, 0};
+  rate_table_.Fill(info);
 }
 
 void FeedbackRecords::ClearRecords() {
   Lock();
   records_.clear();
+  for (int i = 0; i < kNumRateInds; i++) {
+    struct RateWindow &window = rate_window_.at_ind(i);
+    if (!window.counts_.empty())
+      window.base_ = window.counts_.back().cum_;  /** Totals only ever grow. */
+    window.counts_.clear();
+  }
   UnLock();
 }
 
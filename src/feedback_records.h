@@ -5,6 +5,7 @@
 #include "cpp_lib.h"
 #include "base_rate.h"
 #include "pthread_wrapper.h"
+#include "rate_table.h"
 
 /** 
  * track the number of ack n_ack_ and number of sent packets
@@ -16,14 +17,40 @@ struct RateInfo {
   uint32_t n_sent_; 
 };
 
+/** 
+ * A packet sent at one rate with the running totals of that rate up to and 
+ * including it, so that the counts of any window are a subtraction.
+ */
+struct RateCount {
+  MonotonicTimer timer;
+  struct RateInfo cum_;
+};
+
+/** The packets of one rate in the tracking window, with the totals of those dropped out of it. */
+struct RateWindow {
+  deque<RateCount> counts_;
+  struct RateInfo base_;
+};
+
 class FeedbackRecords {
  private:
   MonotonicTimer duration_;   /* The tracking time window size */
   deque<PacketInfo> records_; /* tracking each ack and nak of each packet during the time window */
+  RateArray<struct RateWindow> rate_window_;  /* records_ split by rate, with running totals */
+  RateArray<bool> has_rate_;   /* Rates given or sent so far, the ones rate_window_ tracks */
   pthread_mutex_t lock_;   /* Lock the data structure. */
 
   void ResetRateTable();
 
+  /** 
+   * Fill rate_table_ with the counts of each rate in [start, end), two binary 
+   * searches per rate no matter how many packets the window holds.
+   */
+  void CountRates(const MonotonicTimer& start, const MonotonicTimer& end);
+
+  /** Totals of a rate over its packets sent before t. */
+  static struct RateInfo CumulativeBefore(const struct RateWindow& window, const MonotonicTimer& t);
+
   void Lock() { Pthread_mutex_lock(&lock_); }
   void UnLock() { Pthread_mutex_unlock(&lock_); }
 
@@ -31,7 +58,7 @@ class FeedbackRecords {
   /**
   * temporarly store the rate table of each rate's n_ack_ and n_sent_
   */
-  map<uint16_t, struct RateInfo> rate_table_; 
+  RateArray<struct RateInfo> rate_table_; 
 
 //=========================================================================
   /** 
@@ -0,0 +1,115 @@
+#include "harq_cache.h"
+
+HarqCache::HarqCache(int pkt_size) : pkt_size_(pkt_size), next_entry_(0) {
+  for (int i = 0; i < kNumBatches; i++) {
+    entries_[i].batch_id = 0;
+    entries_[i].num_pending = 0;
+    for (int j = 0; j < MAX_BATCH_SIZE; j++)
+      entries_[i].src[j] = new gf[pkt_size];
+  }
+  for (int i = 0; i < kMaxRepairSymbols; i++)
+    repair_buf_[i] = new gf[pkt_size];
+  codes_[0] = NULL;
+  for (int k = 1; k <= MAX_BATCH_SIZE; k++)
+    codes_[k] = fec_new(k, kMaxInd);
+  Pthread_mutex_init(&lock_, NULL);
+}
+
+HarqCache::~HarqCache() {
+  for (int i = 0; i < kNumBatches; i++) {
+    for (int j = 0; j < MAX_BATCH_SIZE; j++)
+      delete[] entries_[i].src[j];
+  }
+  for (int i = 0; i < kMaxRepairSymbols; i++)
+    delete[] repair_buf_[i];
+  for (int k = 1; k <= MAX_BATCH_SIZE; k++)
+    fec_free(codes_[k]);
+  Pthread_mutex_destroy(&lock_);
+}
+
+HarqCache::Entry* HarqCache::Find(uint32 batch_id) {
+  for (int i = 0; i < kNumBatches; i++) {
+    if (entries_[i].batch_id == batch_id)
+      return &entries_[i];
+  }
+  return NULL;
+}
+
+void HarqCache::Store(uint32 batch_id, CodeInfo *encoder) {
+  assert(batch_id > 0 && encoder->k() <= MAX_BATCH_SIZE && encoder->sz() <= pkt_size_);
+  Pthread_mutex_lock(&lock_);
+  Entry &entry = entries_[next_entry_];
+  next_entry_ = (next_entry_ + 1) % kNumBatches;
+  entry.batch_id = batch_id;
+  entry.start_seq = encoder->start_seq();
+  entry.k = encoder->k();
+  entry.next_ind = encoder->n();
+  entry.sz = encoder->sz();
+  entry.num_pending = 0;
+  memcpy(entry.lens, encoder->lens(), entry.k * sizeof(uint16));
+  for (int i = 0; i < entry.k; i++)
+    memcpy(entry.src[i], encoder->original_batch()[i], entry.sz);
+  Pthread_mutex_unlock(&lock_);
+}
+
+bool HarqCache::RequestRepair(uint32 seq) {
+  Entry *latest = NULL;
+  Pthread_mutex_lock(&lock_);
+  /** A retransmitted packet is in more than one batch, repair the latest. */
+  for (int i = 0; i < kNumBatches; i++) {
+    Entry &entry = entries_[i];
+    if (entry.batch_id && seq >= entry.start_seq && seq < entry.start_seq + entry.k &&
+        (latest == NULL || entry.batch_id > latest->batch_id))
+      latest = &entry;
+  }
+  bool is_cached = latest && (latest->next_ind + latest->num_pending < kMaxInd);
+  if (is_cached)
+    latest->num_pending++;
+  Pthread_mutex_unlock(&lock_);
+  return is_cached;
+}
+
+int HarqCache::NextRepair(uint32 *batch_id, uint16 *sz) {
+  int cnt = 0;
+  Pthread_mutex_lock(&lock_);
+  for (int i = 0; i < kNumBatches; i++) {
+    Entry &entry = entries_[(next_entry_ + i) % kNumBatches];  /** Oldest first. */
+    if (entry.batch_id && entry.num_pending > 0) {
+      *batch_id = entry.batch_id;
+      *sz = entry.sz;
+      cnt = entry.num_pending;
+      break;
+    }
+  }
+  Pthread_mutex_unlock(&lock_);
+  return cnt;
+}
+
+bool HarqCache::EncodeRepair(uint32 batch_id, int cnt, HarqRepair *repair) {
+  Pthread_mutex_lock(&lock_);
+  Entry *entry = Find(batch_id);
+  if (entry == NULL) {
+    Pthread_mutex_unlock(&lock_);
+    return false;
+  }
+  if (cnt > kMaxRepairSymbols)
+    cnt = kMaxRepairSymbols;
+  if (cnt > kMaxInd - entry->next_ind)
+    cnt = kMaxInd - entry->next_ind;
+  repair->batch_id = batch_id;
+  repair->start_seq = entry->start_seq;
+  repair->k = entry->k;
+  repair->first_ind = entry->next_ind;
+  repair->cnt = cnt;
+  repair->sz = entry->sz;
+  memcpy(repair->lens, entry->lens, entry->k * sizeof(uint16));
+  entry->next_ind += cnt;
+  entry->num_pending = (entry->num_pending > cnt) ? entry->num_pending - cnt : 0;
+
+  for (int i = 0; i < cnt; i++) {
+    repair->symbols[i] = repair_buf_[i];
+    fec_encode(codes_[entry->k], entry->src, repair_buf_[i], repair->first_ind + i, entry->sz);
+  }
+  Pthread_mutex_unlock(&lock_);
+  return true;
+}
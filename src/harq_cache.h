@@ -0,0 +1,90 @@
+#ifndef HARQ_CACHE_H_
+#define HARQ_CACHE_H_
+
+#include <stdint.h>
+#include "pthread_wrapper.h"
+#include "wspace_asym_util.h"
+#include "fec.h"
+
+/** Repair symbols of one batch generated by HarqCache::EncodeRepair. */
+struct HarqRepair {
+  uint32 batch_id;
+  uint32 start_seq;
+  int k;
+  int first_ind;    /** Coding index of symbols[0], the others follow. */
+  int cnt;
+  uint16 sz;        /** Length of every symbol. */
+  uint16 lens[MAX_BATCH_SIZE];
+  gf *symbols[MAX_BATCH_SIZE * 4];
+};
+
+/**
+ * Incremental redundancy: a bounded cache of the batches sent recently, so
+ * that a lost packet of a batch is repaired with fresh parity symbols of that
+ * batch (coding index n, n+1, ...) instead of retransmitting the packet itself.
+ * The source packets are copied in: their TxDataBuf slots are recycled as
+ * soon as they are acked, while the other packets of the batch may still
+ * need repair. Rows of the systematic code don't depend on n, so a client
+ * decodes with any n above the largest index it got.
+ * Store and EncodeRepair are called by TxSendAth, RequestRepair by TxHandleFeedback.
+ */
+class HarqCache {
+ public:
+  static const int kNumBatches = 16;
+  static const int kMaxRepairSymbols = MAX_BATCH_SIZE * 4;
+  /** Largest coding index, AthCodeHeader carries n in a byte. */
+  static const int kMaxInd = GF_SIZE - 1;
+
+  explicit HarqCache(int pkt_size);
+  ~HarqCache();
+
+  /** Keep a copy of the batch just encoded, evicting the oldest one. */
+  void Store(uint32 batch_id, CodeInfo *encoder);
+
+  /**
+   * Ask for one more repair symbol of the batch holding data packet seq.
+   * @return false if the batch is no longer cached or out of coding indices.
+   */
+  bool RequestRepair(uint32 seq);
+
+  /**
+   * @param [out] batch_id: the oldest batch waiting for repair.
+   * @param [out] sz: the length of its symbols.
+   * @return the number of repair symbols it asked for, 0 if none.
+   */
+  int NextRepair(uint32 *batch_id, uint16 *sz);
+
+  /**
+   * Generate cnt fresh repair symbols of the batch and take them off its
+   * pending count. The symbols stay valid until the next call.
+   * @return false if the batch is no longer cached.
+   */
+  bool EncodeRepair(uint32 batch_id, int cnt, HarqRepair *repair);
+
+ private:
+  struct Entry {
+    uint32 batch_id;    /** 0 if the entry is unused. */
+    uint32 start_seq;
+    int k;
+    int next_ind;       /** Next unused coding index. */
+    uint16 sz;
+    uint16 lens[MAX_BATCH_SIZE];
+    gf *src[MAX_BATCH_SIZE];
+    int num_pending;    /** Repair symbols asked for. */
+  };
+
+  Entry* Find(uint32 batch_id);
+
+  int pkt_size_;
+  /** 
+   * codes_[k] encodes every coding index below kMaxInd of a batch of k, built
+   * once: the rows don't depend on n, so a larger n only adds rows.
+   */
+  struct fec_parms *codes_[MAX_BATCH_SIZE + 1];
+  Entry entries_[kNumBatches];
+  int next_entry_;
+  gf *repair_buf_[kMaxRepairSymbols];
+  pthread_mutex_t lock_;
+};
+
+#endif
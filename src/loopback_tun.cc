@@ -0,0 +1,206 @@
+#include <sched.h>
+#include <time.h>
+#include "loopback_tun.h"
+
+/**
+ * Idle strategy for blocking reads: spin, then yield, then sleep so that idle
+ * threads don't starve the busy ones when there are more threads than cores.
+ */
+static void Backoff(int *spins) {
+  ++*spins;
+  if (*spins < 64)
+    return;
+  else if (*spins < 1024)
+    sched_yield();
+  else
+    usleep(50);
+}
+
+static int64_t NowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+LoopbackQueue::LoopbackQueue(uint32 capacity) : enqueue_pos_(0), dequeue_pos_(0) {
+  size_t size = 2;
+  while (size < capacity)
+    size <<= 1;
+  mask_ = size - 1;
+  cells_ = new Cell[size];
+  for (size_t i = 0; i < size; i++)
+    cells_[i].seq.store(i, std::memory_order_relaxed);
+}
+
+LoopbackQueue::~LoopbackQueue() {
+  delete[] cells_;
+}
+
+bool LoopbackQueue::Push(const char *buf, uint16 len) {
+  assert(len <= PKT_SIZE);
+  Cell *cell;
+  size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+  while (1) {
+    cell = &cells_[pos & mask_];
+    size_t seq = cell->seq.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0) {
+      return false;  /** Full. */
+    }
+    else {
+      pos = enqueue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+  memcpy(cell->data, buf, len);
+  cell->len = len;
+  cell->seq.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool LoopbackQueue::TryPop(char *buf, uint16 *len, uint16 max_len) {
+  Cell *cell;
+  size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+  while (1) {
+    cell = &cells_[pos & mask_];
+    size_t seq = cell->seq.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0) {
+      return false;  /** Empty. */
+    }
+    else {
+      pos = dequeue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+  *len = cell->len < max_len ? cell->len : max_len;
+  if (buf)
+    memcpy(buf, cell->data, *len);
+  cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+  return true;
+}
+
+bool LoopbackQueue::Pop(char *buf, uint16 *len, uint16 max_len, int wait_us) {
+  int spins = 0;
+  int64_t deadline = wait_us > 0 ? NowUs() + wait_us : 0;
+  while (!TryPop(buf, len, max_len)) {
+    if (wait_us == 0 || (wait_us > 0 && NowUs() >= deadline))
+      return false;
+    Backoff(&spins);
+  }
+  return true;
+}
+
+int LoopbackQueue::Peek(char *buf, uint16 len) {
+  int spins = 0;
+  while (1) {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    Cell *cell = &cells_[pos & mask_];
+    if (cell->seq.load(std::memory_order_acquire) == pos + 1) {
+      memcpy(buf, cell->data, cell->len < len ? cell->len : len);
+      return cell->len;
+    }
+    Backoff(&spins);
+  }
+}
+
+LoopbackTun::LoopbackTun(uint32 queue_size) : queue_size_(queue_size), control_queue_(NULL) {
+  for (int i = 0; i < MAX_RCV_SHARDS; i++)
+    uplink_queue_[i] = NULL;
+  for (int i = 0; i < MAX_TUN_QUEUES; i++)
+    tun_queue_[i] = NULL;
+  for (int i = 0; i <= kControl; i++)
+    num_drops_[i] = 0;
+}
+
+LoopbackTun::~LoopbackTun() {
+  for (map<int, LoopbackQueue*>::iterator it = wspace_queue_tbl_.begin(); it != wspace_queue_tbl_.end(); ++it)
+    delete it->second;
+  for (map<int, LoopbackQueue*>::iterator it = cellular_queue_tbl_.begin(); it != cellular_queue_tbl_.end(); ++it)
+    delete it->second;
+  delete control_queue_;
+  for (int i = 0; i < MAX_RCV_SHARDS; i++)
+    delete uplink_queue_[i];
+  for (int i = 0; i < MAX_TUN_QUEUES; i++)
+    delete tun_queue_[i];
+}
+
+void LoopbackTun::Init() {
+  for (map<int, string>::iterator it = client_ip_tbl_.begin(); it != client_ip_tbl_.end(); ++it) {
+    client_id_tbl_[inet_addr(it->second.c_str())] = it->first;
+    wspace_queue_tbl_[it->first] = new LoopbackQueue(queue_size_);
+    cellular_queue_tbl_[it->first] = new LoopbackQueue(queue_size_);
+  }
+  control_queue_ = new LoopbackQueue(queue_size_);
+  for (int i = 0; i < num_rcv_shards_; i++)
+    uplink_queue_[i] = new LoopbackQueue(queue_size_);
+  for (int i = 0; i < num_tun_queues_; i++)
+    tun_queue_[i] = new LoopbackQueue(queue_size_);
+}
+
+int LoopbackTun::Read(const IOType &type, char *buf, uint16_t len, int shard) {
+  assert(type == kCellular);
+  uint16 nread = 0;
+  uplink_queue_[shard]->Pop(buf, &nread, len, -1);
+  return nread > 0 ? nread : -1;
+}
+
+int LoopbackTun::Peek(const IOType &type, char *buf, uint16_t len, int shard) {
+  assert(type == kCellular);
+  int nread = uplink_queue_[shard]->Peek(buf, len);
+  if (nread == 0) {
+    Discard(type, shard);
+    return -1;
+  }
+  return nread;
+}
+
+void LoopbackTun::Discard(const IOType &type, int shard) {
+  assert(type == kCellular);
+  uint16 nread = 0;
+  uplink_queue_[shard]->Pop(NULL, &nread, 0, -1);
+}
+
+uint16_t LoopbackTun::Write(const IOType &type, char *buf, uint16_t len, int client_id, uint32_t) {
+  assert(len > 0);
+  if (type == kWspace) {
+    for (map<int, LoopbackQueue*>::iterator it = wspace_queue_tbl_.begin(); it != wspace_queue_tbl_.end(); ++it) {
+      if (!it->second->Push(buf, len))
+        num_drops_[kWspace]++;
+    }
+  }
+  else if (type == kCellular) {
+    if (!cellular_queue_tbl_[client_id]->Push(buf, len))
+      num_drops_[kCellular]++;
+  }
+  else if (type == kControl) {
+    if (!control_queue_->Push(buf, len))
+      num_drops_[kControl]++;
+  }
+  else {
+    assert(0);
+  }
+  return len;
+}
+
+int LoopbackTun::ReadTunBatch(int queue, char **bufs, uint16_t *lens, int max_cnt, uint16_t len) {
+  assert(queue >= 0 && queue < num_tun_queues_ && max_cnt > 0);
+  tun_queue_[queue]->Pop(bufs[0], &lens[0], len, -1);
+  int cnt = 1;
+  while (cnt < max_cnt && tun_queue_[queue]->Pop(bufs[cnt], &lens[cnt], len))
+    cnt++;
+  return cnt;
+}
+
+bool LoopbackTun::SendToAP(const char *buf, uint16 len, int client_id) {
+  if (uplink_queue_[ShardOf(client_id)]->Push(buf, len))
+    return true;
+  num_drops_[kCellular]++;
+  return false;
+}
@@ -0,0 +1,100 @@
+#ifndef LOOPBACK_TUN_H_
+#define LOOPBACK_TUN_H_
+
+#include <stdint.h>
+#include <atomic>
+#include "wspace_asym_util.h"
+#include "tun.h"
+
+/**
+ * Bounded lock-free multi-producer multi-consumer queue of datagrams,
+ * after Dmitry Vyukov's array based queue. Each cell holds one datagram
+ * of up to PKT_SIZE bytes.
+ */
+class LoopbackQueue {
+ public:
+  /** @param capacity: number of cells, rounded up to a power of 2. */
+  explicit LoopbackQueue(uint32 capacity);
+  ~LoopbackQueue();
+
+  /** @return false if the queue is full, the datagram is dropped then. */
+  bool Push(const char *buf, uint16 len);
+
+  /**
+   * Pop the next datagram, truncated to max_len bytes.
+   * @param wait_us: how long to wait for a datagram, < 0 to wait forever.
+   * @return false if the queue stays empty.
+   */
+  bool Pop(char *buf, uint16 *len, uint16 max_len, int wait_us = 0);
+
+  /**
+   * Copy the first len bytes of the next datagram without consuming it,
+   * waiting until one is available. Only safe with a single consumer.
+   * @return the full length of the datagram.
+   */
+  int Peek(char *buf, uint16 len);
+
+ private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    uint16 len;
+    char data[PKT_SIZE];
+  };
+
+  bool TryPop(char *buf, uint16 *len, uint16 max_len);
+
+  Cell *cells_;
+  size_t mask_;
+  char pad0_[64];
+  std::atomic<size_t> enqueue_pos_;
+  char pad1_[64];
+  std::atomic<size_t> dequeue_pos_;
+  char pad2_[64];
+};
+
+/**
+ * In-process transport for running WspaceAP without a tun device or sockets.
+ * Every channel of Tun is an in-memory queue, the peers (simulated clients and
+ * controller) use the accessors below to sit at the other end:
+ * kWspace   - broadcast, every client gets its own copy in wspace_queue().
+ * kCellular - AP to client in cellular_queue(), anything to AP in uplink_queue().
+ * kControl  - AP to controller in control_queue().
+ * kTun      - local traffic to AP in tun_queue().
+ * Writes never block, a datagram is dropped if its queue is full like a UDP socket does.
+ * kWspace is not paced, the airtime given to Write is ignored.
+ */
+class LoopbackTun : public Tun {
+ public:
+  explicit LoopbackTun(uint32 queue_size = 4096);
+  virtual ~LoopbackTun();
+
+  virtual void Init();
+  virtual int Read(const IOType &type, char *buf, uint16_t len, int shard = 0);
+  virtual int Peek(const IOType &type, char *buf, uint16_t len, int shard = 0);
+  virtual void Discard(const IOType &type, int shard = 0);
+  virtual uint16_t Write(const IOType &type, char *buf, uint16_t len, int client_id = 0, uint32_t airtime_us = 0);
+  virtual int ReadTunBatch(int queue, char **bufs, uint16_t *lens, int max_cnt, uint16_t len);
+
+  /** Send a datagram to the AP's eth port, on the shard of client_id. */
+  bool SendToAP(const char *buf, uint16 len, int client_id);
+
+  LoopbackQueue* wspace_queue(int client_id) { return wspace_queue_tbl_[client_id]; }
+  LoopbackQueue* cellular_queue(int client_id) { return cellular_queue_tbl_[client_id]; }
+  LoopbackQueue* control_queue() { return control_queue_; }
+  LoopbackQueue* uplink_queue(int shard) { return uplink_queue_[shard]; }
+  LoopbackQueue* tun_queue(int queue) { return tun_queue_[queue]; }
+
+  /** Number of datagrams dropped on full queues of the given channel. */
+  uint64_t num_drops(const IOType &type) const { return num_drops_[type]; }
+
+ private:
+  uint32 queue_size_;
+  map<int, LoopbackQueue*> wspace_queue_tbl_;
+  map<int, LoopbackQueue*> cellular_queue_tbl_;
+  LoopbackQueue *control_queue_;
+  LoopbackQueue *uplink_queue_[MAX_RCV_SHARDS];
+  LoopbackQueue *tun_queue_[MAX_TUN_QUEUES];
+  std::atomic<uint64_t> num_drops_[kControl+1];
+};
+
+#endif
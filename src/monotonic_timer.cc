@@ -1,5 +1,7 @@
 #include "monotonic_timer.h"
 
+const struct timespec *MonotonicTimer::virtual_now_ = NULL;
+
 
 time_t MonotonicTimer::GetSec() const {
   return timer.tv_sec;
@@ -14,11 +14,17 @@
 
 class MonotonicTimer {
   struct timespec timer;
+  static const struct timespec *virtual_now_;
  public:
   /**
    * Default Constructor, recording current time
    */
-  MonotonicTimer() {clock_gettime(CLOCK_MONOTONIC, &timer);};
+  MonotonicTimer() {
+    if (virtual_now_)
+      timer = *virtual_now_;
+    else
+      clock_gettime(CLOCK_MONOTONIC, &timer);
+  };
   /**
    * Constructor
    */
@@ -56,6 +62,13 @@ class MonotonicTimer {
   const MonotonicTimer operator/ (const int32_t n) const;
 
   void PrintTimer(bool line = false);
+
+  /**
+   * Make the default constructor read *now instead of CLOCK_MONOTONIC, for
+   * replaying recorded traces under a simulated clock. NULL goes back to 
+   * the real clock. Not thread safe, set it before any timer is read.
+   */
+  static void SetVirtualClock(const struct timespec *now) { virtual_now_ = now; }
 };
 
 #endif
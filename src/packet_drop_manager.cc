@@ -28,6 +28,7 @@ void PacketDropManager::ParseLossRates(const vector<string> &filenames, const ve
 void PacketDropManager::ParseLossRates(const vector<double> &loss_rates, const vector<int> &client_ids) {
   assert(loss_rates.size() == client_ids.size());
   LossTable table;
+  table.Fill(-1.0);
   for (int i = 0; i < client_ids.size(); ++i) {
     for (int j = 0; j < rate_arr_.size(); ++j) {
      table[rate_arr_[j]] = loss_rates[i];
@@ -36,12 +37,13 @@ void PacketDropManager::ParseLossRates(const vector<double> &loss_rates, const v
   }
 }
 
-map<int, double> PacketDropManager::ParseLine(const string line) {
+PacketDropManager::LossTable PacketDropManager::ParseLine(const string line) {
   stringstream ss(line);
   double loss = -1.0;
   int cnt = 0;
   string s;
   LossTable table;
+  table.Fill(-1.0);
   int i = 0;
   while (getline(ss, s, ' ')) {
     if (++cnt <= 3) {
@@ -73,7 +75,7 @@ bool PacketDropManager::GetLossRate(int client_id, int rate, double* loss_rate)
   bool get_loss = false;
   Lock();
   if(loss_queues_.count(client_id) > 0 && !loss_queues_[client_id].empty()) {
-    assert(loss_queues_[client_id].front().count(rate) > 0);
+    assert(loss_queues_[client_id].front()[rate] >= 0);
     *loss_rate = loss_queues_[client_id].front()[rate];
     get_loss = true;
   }
@@ -10,12 +10,13 @@
 
 #include "base_rate.h"
 #include "pthread_wrapper.h"
+#include "rate_table.h"
 
 using namespace std;
 
 class PacketDropManager {
  public:
-  typedef map<int, double> LossTable; // <rate, loss_rate>.
+  typedef RateArray<double> LossTable; // Loss rate of each rate, -1 if not given.
  
   PacketDropManager(int32_t* rates, int size);
   ~PacketDropManager();
@@ -3,6 +3,8 @@
 
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 inline void Pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr) {
   int rc = pthread_mutex_init(mutex, attr);
@@ -47,11 +49,22 @@ inline void Pthread_cond_signal(pthread_cond_t *cond) {
 inline int Pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void*), void *arg) {
   int rc = pthread_create(thread, attr, start_routine, arg);
   assert(rc == 0);
+  return rc;
 }
 
 inline int Pthread_join(pthread_t thread, void **value_ptr) {
   int rc = pthread_join(thread, value_ptr);
   assert(rc == 0);
+  return rc;
+}
+
+/** Pin the thread to a single cpu, wrapping around the online cpus. */
+inline int Pthread_setaffinity(pthread_t thread, int cpu) {
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(cpu % (num_cpus > 0 ? num_cpus : 1), &cpuset);
+  return pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset);
 }
 
 #endif
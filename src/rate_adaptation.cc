@@ -1,13 +1,25 @@
 #include "rate_adaptation.h"
 
-ofstream outFile ("trace.dat");
-ofstream testFile ("statistic.dat");
+FileRateTraceSink::FileRateTraceSink(const char *filename) {
+  file = fopen(filename, "w");
+  assert(file);
+}
+
+FileRateTraceSink::~FileRateTraceSink() {
+  fclose(file);
+}
 
+void FileRateTraceSink::OnRecord(const PacketInfo &pkt) {
+  fprintf(file, "record\t%.3f\t%u\t%u\t%u\t%d\n", pkt.timer.GetMSec(), pkt.seq_num, pkt.rate, pkt.length, pkt.status);
+}
+
+void FileRateTraceSink::OnRate(int32_t rate, int32_t case_num) {
+  MonotonicTimer now;
+  fprintf(file, "rate\t%.3f\t%d\t%d\n", now.GetMSec(), rate, case_num);
+}
 
 RateAdaptation::RateAdaptation(const RateAdaptVersion &version) {
   duration = MonotonicTimer(10, 500*1e6);
-  assert(outFile.is_open());
-  assert(testFile.is_open());
   
   switch (version) {
     case kSampleRate:
@@ -24,24 +36,18 @@ RateAdaptation::RateAdaptation(const RateAdaptVersion &version) {
       assert(0);
   }
 
-  counting = 0;
-  record_start = MonotonicTimer(0,0);
-  record_end = MonotonicTimer(0,0);
-  record_sum = MonotonicTimer(0,0);
-  record_min = MonotonicTimer(10,0);
-  record_max = MonotonicTimer(0 ,0);
+  history_records = new PacketInfo[kHistoryCapacity];
+  history_head = 0;
+  history_size = 0;
+  trace_sink = NULL;
 
   break_number = 0;
   setting = 0;
-
-  packet_sent = new MonotonicTimer[1000];
-  packet_ack = new MonotonicTimer[1000];
 }
 
 
 RateAdaptation::~RateAdaptation() {
-  outFile.close();
-  testFile.close();
+  delete[] history_records;
   delete base_rate;
 }
 
@@ -52,30 +58,6 @@ we do not know whether this nak is for the first transmission or the second
 */
 ////////////public entrance, only insert NAK/ACK/TIMEOUT///////////////////
 void RateAdaptation::InsertRecord(uint32_t seq, PacketStatus status, uint16_t rate, uint16_t len) {
-/*
-  MonotonicTimer tt;
-  cout<<tt.GetSec()<<":"<<tt.GetNSec()<<","<<seq<<","<<status<<endl;
-*/
-/*  ////////////////////////////////////////////
-//  MonotonicTimer tt;
-  //outFile<<seq<<"\t"<<status<<"\t"<<tt.GetSec()<<":"<<tt.GetNSec()<<endl;
-  if(seq<=1000) {
-    MonotonicTimer t;
-    if(status==kSent) packet_sent[seq-1] = t;
-    else packet_ack[seq-1] = t;
-  } else if(seq > 1000) {
-    for(int i = 0;i < 1000; ++i) {
-      MonotonicTimer diff = packet_ack[i] - packet_sent[i];
-      MonotonicTimer zero = MonotonicTimer(0,0);
-      if(diff<zero) diff=zero; 
-       
-      outFile<<i+1<<","<<diff.GetMSec()<<"\t"<<packet_ack[i].GetSec()<<","<<packet_ack[i].GetNSec()<<"\t"<<packet_sent[i].GetSec()<<","<<packet_sent[i].GetNSec()<<endl;
-    }
-    assert(0);
-  }
-  return;
-*/  //////////////////////////////////////////
-
   if(status == kSent)
     return; //reserved for future usage
 #ifdef TEST_RATE
@@ -91,19 +73,27 @@ void RateAdaptation::InsertRecord(uint32_t seq, PacketStatus status, uint16_t ra
 
   MonotonicTimer now;
   PacketInfo pkt = {now, seq, rate, len, status};
-  history_records.push_back(pkt);  
+  if (history_size == kHistoryCapacity)
+    PopRecord();
+  history_records[(history_head + history_size) % kHistoryCapacity] = pkt;
+  history_size++;
   base_rate->InsertIntoRateTable(pkt);
+  if (trace_sink)
+    trace_sink->OnRecord(pkt);
   UpdateRecords(now);
 }
 
+void RateAdaptation::PopRecord() {
+  base_rate->RemoveFromRateTable(history_records[history_head]);
+  history_head = (history_head + 1) % kHistoryCapacity;
+  history_size--;
+}
+
 void RateAdaptation::UpdateRecords(const MonotonicTimer& now) {
-  PacketInfo pkt;
-  while(!history_records.empty()) {
-    pkt = history_records.front();
-    if(pkt.timer + duration > now)
+  while(history_size > 0) {
+    if(history_records[history_head].timer + duration > now)
       break;
-    history_records.pop_front();
-    base_rate->RemoveFromRateTable(pkt);
+    PopRecord();
   }
 }
 
@@ -117,37 +107,7 @@ void RateAdaptation::SetBreakSeqNum(uint32_t seq_num) {
 
 int32_t RateAdaptation::ApplyRate(int32_t& case_num) {
   int32_t rate = base_rate->ApplyRate(case_num);
-////////
-/*
-  if(rate == -1) {
-    counting++;    
-    record_end = MonotonicTimer();
-    MonotonicTimer diff = record_end - record_start;
-    record_start = record_end;
-    if(counting > 1) {  
-      cout<<diff.GetMSec()<<endl;
-      record_sum += diff;
-      if(diff > record_max) record_max = diff;
-      if(diff < record_min) record_min = diff;
-    }
-
-    if(counting >= 20 + 1) {
-      MonotonicTimer avg = record_sum/(counting - 1);
-      cout<<record_sum.GetMSec()<<endl;
-      cout<<"\t"<<avg.GetMSec()<<"\t"<<record_max.GetMSec()<<"\t"<<record_min.GetMSec()<<endl;
-      assert(0);
-    }
-    //base_rate->PrintRateTable();
-    base_rate->InitRateTable();
-    history_records.clear();
-    setting = 1;
-
-    //base_rate->PrintRateTable();
-  }
-
-//////
-*/
+  if (trace_sink)
+    trace_sink->OnRate(rate, case_num);
   return rate;
 }
-
-
@@ -4,10 +4,41 @@
 #include "sample_rate.h"
 #include "robust_rate.h"
 
+/**
+ * Receives the records and rate decisions of RateAdaptation, for offline 
+ * analysis. Optional: nothing is traced unless a sink is set.
+ */
+class RateTraceSink {
+ public:
+  virtual ~RateTraceSink() {}
+  virtual void OnRecord(const PacketInfo &pkt) = 0;
+  virtual void OnRate(int32_t rate, int32_t case_num) = 0;
+};
+
+/** Writes the trace as text lines through a buffered FILE. */
+class FileRateTraceSink : public RateTraceSink {
+ public:
+  explicit FileRateTraceSink(const char *filename);
+  ~FileRateTraceSink();
+
+  void OnRecord(const PacketInfo &pkt);
+  void OnRate(int32_t rate, int32_t case_num);
+
+ private:
+  FILE *file;
+};
+
 class RateAdaptation {
  private:  
-  list<PacketInfo> history_records; //record history packets
-  list<PacketInfo>::iterator it;
+  static const uint32_t kHistoryCapacity = 1 << 16;
+
+  /** 
+   * Record history packets, a ring buffer of kHistoryCapacity allocated once.
+   * The oldest packet leaves early if it is full.
+   */
+  PacketInfo *history_records;
+  uint32_t history_head;  //index of the oldest packet
+  uint32_t history_size;
 
   MonotonicTimer duration;  //the duration that keep the history packets
 
@@ -16,23 +47,14 @@ class RateAdaptation {
   SampleRate* sample_rate;
   RobustRate* robust_rate;
 
-  /**
-   * Debug and test usage
-   */
-  MonotonicTimer* packet_sent;
-  MonotonicTimer* packet_ack;
-
-
-  int32_t counting;
-  MonotonicTimer record_start;
-  MonotonicTimer record_end;
-  MonotonicTimer record_sum;
-  MonotonicTimer record_min;
-  MonotonicTimer record_max;
+  RateTraceSink* trace_sink;  //NULL if not tracing
 
   uint32_t break_number;
   bool setting;
 
+  /** Drop the oldest packet of the record and of the rate table. */
+  void PopRecord();
+
  protected: 
   /**
    * Debug and test usage, the record will no receive any 
@@ -71,5 +93,8 @@ class RateAdaptation {
   */ 
   void UpdateRecords(const MonotonicTimer& now);
 
+  /** Trace to sink from now on, NULL to stop. The sink stays owned by the caller. */
+  void set_trace_sink(RateTraceSink *sink) { trace_sink = sink; }
+
 };
 #endif
@@ -0,0 +1,323 @@
+/**
+ * Offline evaluation of the rate adaptation algorithms: replays a recorded
+ * drive (raw packet outcomes per rate, GPS) through ScoutRateAdaptation under
+ * a virtual clock, much faster than real time, and reports goodput, FEC
+ * redundancy and cellular duplication of each algorithm on the same trace.
+ *
+ * Usage: rate_replay -f trace [-v versions] [-t coherence_time_us] [-l pkt_size]
+ *                    [-d feedback_delay_ms] [-a lookahead_ms] [-r seed]
+ * -v takes a comma separated list of RateAdaptVersion values, by default
+ * SampleRate, RRAA and the four scout variants: -2,-1,3,4,5,6.
+ * @see RateTrace for the trace format.
+ */
+#include <math.h>
+#include "rate_replay.h"
+
+using namespace std;
+
+static int64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+RateTrace::RateTrace() : has_front_(false), duration_ns_(0), num_outcomes_(0) {
+  Rewind();
+}
+
+RateTrace::~RateTrace() {}
+
+static bool IsEarlier(const TraceOutcome &a, const TraceOutcome &b) {
+  return a.time_ns < b.time_ns;
+}
+
+void RateTrace::Load(const char *filename) {
+  FILE *fp = fopen(filename, "r");
+  if (!fp)
+    Perror("RateTrace::Load: can't open %s\n", filename);
+
+  struct Outcome {
+    double time;
+    int laptop;
+    uint16_t rate;
+    bool is_acked;
+  };
+  vector<Outcome> outcomes;
+  vector<pair<double, double> > gps;
+  double start = -1, end = -1;
+  char line[256];
+  int line_num = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    line_num++;
+    double time;
+    char type;
+    int n_read;
+    if (sscanf(line, " %lf %c%n", &time, &type, &n_read) < 2 || line[0] == '#')
+      continue;
+    if (type == 'A') {
+      char antenna;
+      int rate, is_acked;
+      if (sscanf(line + n_read, " %c %d %d", &antenna, &rate, &is_acked) != 3 ||
+          (antenna != 'F' && antenna != 'B') || RateIndex(rate) < 0) {
+        printf("RateTrace::Load: Warning bad outcome at line %d\n", line_num);
+        continue;
+      }
+      Outcome outcome = {time, antenna == 'F' ? ScoutRateAdaptation::kFront : ScoutRateAdaptation::kBack,
+                         (uint16_t)rate, is_acked != 0};
+      outcomes.push_back(outcome);
+    }
+    else if (type == 'G') {
+      double speed;
+      if (sscanf(line + n_read, " %lf", &speed) != 1) {
+        printf("RateTrace::Load: Warning bad GPS reading at line %d\n", line_num);
+        continue;
+      }
+      gps.push_back(make_pair(time, speed));
+    }
+    else {
+      printf("RateTrace::Load: Warning unknown record type[%c] at line %d\n", type, line_num);
+      continue;
+    }
+    if (start < 0 || time < start)
+      start = time;
+    if (time > end)
+      end = time;
+  }
+  fclose(fp);
+
+  size_t num_back = 0;
+  for (size_t i = 0; i < outcomes.size(); i++) {
+    num_back += (outcomes[i].laptop == ScoutRateAdaptation::kBack);
+    TraceOutcome outcome = {(int64_t)llround((outcomes[i].time - start) * 1e9), outcomes[i].is_acked};
+    outcomes_[outcomes[i].laptop - 1][outcomes[i].rate].push_back(outcome);
+    has_front_ |= (outcomes[i].laptop == ScoutRateAdaptation::kFront);
+  }
+  for (size_t i = 0; i < gps.size(); i++) {
+    TraceGPS reading = {(int64_t)llround((gps[i].first - start) * 1e9), gps[i].second};
+    gps_.push_back(reading);
+  }
+  for (int laptop = 0; laptop < 2; laptop++) {
+    for (int i = 0; i < kNumRateInds; i++)
+      stable_sort(outcomes_[laptop].at_ind(i).begin(), outcomes_[laptop].at_ind(i).end(), IsEarlier);
+  }
+  num_outcomes_ = outcomes.size();
+  if (num_back == 0)
+    Perror("RateTrace::Load: no back outcomes in %s\n", filename);
+  duration_ns_ = (int64_t)llround((end - start) * 1e9);
+  Rewind();
+}
+
+void RateTrace::Rewind() {
+  for (int i = 0; i < 2; i++) {
+    cursors_[i].Fill(0);
+    nexts_[i].Fill(0);
+  }
+}
+
+bool RateTrace::Outcome(ScoutRateAdaptation::Laptop laptop, uint16_t rate, int64_t t,
+                        int64_t lookahead_ns, bool *is_acked) {
+  const vector<TraceOutcome> &outcomes = outcomes_[laptop - 1][rate];
+  size_t &cursor = cursors_[laptop - 1][rate];
+  size_t &next = nexts_[laptop - 1][rate];
+  size_t sz = outcomes.size();
+  /** t never goes back, walking on from the last lookup is amortized O(1). */
+  while (next < sz && outcomes[next].time_ns < t)
+    next++;
+  size_t ind = max(next, cursor);
+  if (ind < sz && outcomes[ind].time_ns <= t + lookahead_ns) {
+    cursor = ind + 1;
+    *is_acked = outcomes[ind].is_acked;
+    return true;
+  }
+  /** Fewer recorded than sent around t, reuse the latest before t. */
+  for (ind = next; ind < sz && outcomes[ind].time_ns <= t; ind++) {}
+  if (ind == 0)
+    return false;
+  *is_acked = outcomes[ind - 1].is_acked;
+  return true;
+}
+
+RateReplay::RateReplay(RateTrace *trace, const ReplayConfig &config)
+    : trace_(trace), config_(config), now_ns_(0) {
+  SetNow(0);
+  MonotonicTimer::SetVirtualClock(&now_);
+}
+
+RateReplay::~RateReplay() {
+  MonotonicTimer::SetVirtualClock(NULL);
+}
+
+void RateReplay::SetNow(int64_t t) {
+  now_ns_ = t;
+  now_.tv_sec = (kOriginNs + t) / 1000000000LL;
+  now_.tv_nsec = (kOriginNs + t) % 1000000000LL;
+}
+
+void RateReplay::InsertFeedback(ScoutRateAdaptation *rate_maker, ScoutRateAdaptation::Laptop laptop,
+                                const vector<PacketInfo> &pkts) {
+  /** The baselines only learn from the back antenna. */
+  if (pkts.empty() || (laptop == ScoutRateAdaptation::kFront && rate_maker->combine_mode() == ScoutRateAdaptation::kBackOnly))
+    return;
+  for (size_t i = 0; i < pkts.size(); i++)
+    rate_maker->InsertFeedback(laptop, pkts[i].seq_num, pkts[i].status, pkts[i].rate, pkts[i].length, pkts[i].timer);
+  /** As WspaceAP::UpdateFeedback, over the send times of the batch. */
+  MonotonicTimer start = pkts.front().timer - MonotonicTimer(0, 1);
+  MonotonicTimer end = pkts.back().timer + MonotonicTimer(0, 1);
+  rate_maker->CalcLossRates(laptop, start, end);
+}
+
+void RateReplay::DeliverFeedback(ScoutRateAdaptation *rate_maker) {
+  while (!pending_.empty() && pending_.front().due_ns <= now_ns_) {
+    InsertFeedback(rate_maker, ScoutRateAdaptation::kFront, pending_.front().front);
+    InsertFeedback(rate_maker, ScoutRateAdaptation::kBack, pending_.front().back);
+    pending_.pop_front();
+  }
+}
+
+void RateReplay::Run(RateAdaptVersion version, ReplayStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  trace_->Rewind();
+  pending_.clear();
+  SetNow(0);
+
+  ScoutRateAdaptation rate_maker(mac80211abg_rate, mac80211abg_num_rates, GF_SIZE, MAX_BATCH_SIZE);
+  rate_maker.set_rate_adapt_version(version);
+  srand(config_.seed);  /** After the constructors, which seed with the time. */
+
+  const vector<TraceGPS> &gps = trace_->gps();
+  size_t gps_ind = 0;
+  uint32_t seq = 1;
+  vector<uint16_t> rate_arr;
+  int64_t start_ns = NowNs();
+  while (now_ns_ < trace_->duration_ns()) {
+    for (; gps_ind < gps.size() && gps[gps_ind].time_ns <= now_ns_; gps_ind++)
+      rate_maker.set_speed(gps[gps_ind].speed);
+    DeliverFeedback(&rate_maker);
+
+    int k = 0, n = 0;
+    bool is_duplicate = false;
+    rate_maker.MakeDecision(ScoutRateAdaptation::kData, config_.coherence_time, config_.pkt_size,
+                            config_.extra_time, k, n, rate_arr, is_duplicate);
+    assert(k > 0 && rate_arr.size() >= (size_t)k);
+
+    pending_.push_back(PendingFeedback());
+    PendingFeedback &feedback = pending_.back();
+    int num_acked = 0;
+    for (size_t i = 0; i < rate_arr.size(); i++, seq++) {
+      MonotonicTimer send_time;
+      PacketInfo pkt = {send_time, seq, rate_arr[i], config_.pkt_size, kNAKed};
+      bool is_acked = false;
+      if (trace_->Outcome(ScoutRateAdaptation::kBack, rate_arr[i], now_ns_, config_.lookahead_ns, &is_acked) && is_acked)
+        pkt.status = kACKed;
+      feedback.back.push_back(pkt);
+      num_acked += is_acked;
+      if (trace_->has_front()) {
+        pkt.status = kNAKed;
+        if (trace_->Outcome(ScoutRateAdaptation::kFront, rate_arr[i], now_ns_, config_.lookahead_ns, &is_acked) && is_acked)
+          pkt.status = kACKed;
+        feedback.front.push_back(pkt);
+      }
+      SetNow(now_ns_ + AirtimeScheduler::PktDuration(config_.pkt_size, rate_arr[i], config_.extra_time) * 1000LL);
+    }
+    feedback.due_ns = now_ns_ + config_.feedback_delay_ns;
+
+    stats->num_batches++;
+    stats->num_data_pkts += k;
+    stats->num_coded_pkts += rate_arr.size();
+    stats->num_raw_acked += num_acked;
+    stats->num_duplicated += is_duplicate;
+    if (num_acked >= k)
+      stats->num_decoded++;
+    else if (is_duplicate)
+      stats->num_cellular_only++;
+    else
+      stats->num_lost++;
+    if (num_acked >= k || is_duplicate)
+      stats->bytes_delivered += (uint64_t)k * config_.pkt_size;
+  }
+  stats->wall_s = (NowNs() - start_ns) / 1e9;
+  stats->virtual_s = now_ns_ / 1e9;
+}
+
+static const char* VersionName(RateAdaptVersion version) {
+  switch (version) {
+    case kSampleRate: return "SampleRate";
+    case kRRAA: return "RRAA";
+    case kFixed: return "Fixed";
+    case kBatchSeq: return "BatchSeq";
+    case kBatchRandom: return "BatchRandom";
+    case kScoutSeq: return "ScoutSeq";
+    case kScoutRandom: return "ScoutRandom";
+    case kScoutBoundLossSeq: return "ScoutBoundLossSeq";
+    case kScoutBoundLossRandom: return "ScoutBoundLossRandom";
+  }
+  return "?";
+}
+
+int main(int argc, char **argv) {
+  const char *trace_file = NULL;
+  const char *versions = "-2,-1,3,4,5,6";
+  ReplayConfig config = {20000, PKT_SIZE, DIFS_80211ag + SLOT_TIME * 3, 10000000LL, 5000000LL, 1};
+  int option;
+  while ((option = getopt(argc, argv, "f:v:t:l:d:a:r:")) > 0) {
+    switch(option) {
+      case 'f':
+        trace_file = optarg;
+        break;
+      case 'v':
+        versions = optarg;
+        break;
+      case 't':
+        config.coherence_time = atoi(optarg);
+        break;
+      case 'l':
+        config.pkt_size = atoi(optarg);
+        break;
+      case 'd':
+        config.feedback_delay_ns = (int64_t)(atof(optarg) * 1e6);
+        break;
+      case 'a':
+        config.lookahead_ns = (int64_t)(atof(optarg) * 1e6);
+        break;
+      case 'r':
+        config.seed = atoi(optarg);
+        break;
+      default:
+        Perror("Usage: %s -f trace [-v versions] [-t coherence_time_us] [-l pkt_size] [-d feedback_delay_ms] [-a lookahead_ms] [-r seed]\n", argv[0]);
+    }
+  }
+  if (!trace_file)
+    Perror("Usage: %s -f trace [-v versions] [-t coherence_time_us] [-l pkt_size] [-d feedback_delay_ms] [-a lookahead_ms] [-r seed]\n", argv[0]);
+  assert(config.coherence_time > 0 && config.pkt_size > 0 && config.pkt_size <= PKT_SIZE);
+
+  vector<RateAdaptVersion> version_arr;
+  for (const char *p = versions; *p; ) {
+    char *next;
+    long version = strtol(p, &next, 10);
+    version_arr.push_back((RateAdaptVersion)version);
+    if (next == p || (*next && *next != ',') || version < kSampleRate || version > kScoutBoundLossRandom)
+      Perror("rate_replay: bad version list %s\n", versions);
+    p = *next ? next + 1 : next;
+  }
+
+  RateTrace trace;
+  trace.Load(trace_file);
+  printf("=== rate_replay: %s, %.1fs, %zu outcomes (%s), %zu GPS readings ===\n", trace_file,
+         trace.duration_ns() / 1e9, trace.num_outcomes(), trace.has_front() ? "front and back" : "back only",
+         trace.gps().size());
+  printf("%-22s %10s %10s %10s %10s %8s %10s\n", "algorithm", "goodput", "redundancy", "cellular", "lost", "batches", "speedup");
+
+  RateReplay replay(&trace, config);
+  for (size_t i = 0; i < version_arr.size(); i++) {
+    ReplayStats stats;
+    replay.Run(version_arr[i], &stats);
+    double data_pkts = stats.num_data_pkts ? stats.num_data_pkts : 1;
+    double batches = stats.num_batches ? stats.num_batches : 1;
+    printf("%-22s %6.2fMbps %9.1f%% %9.1f%% %9.1f%% %8lu %9.0fx\n", VersionName(version_arr[i]),
+           stats.bytes_delivered * 8 / stats.virtual_s / 1e6,
+           (stats.num_coded_pkts - stats.num_data_pkts) * 100. / data_pkts,
+           stats.num_duplicated * 100. / batches, stats.num_lost * 100. / batches,
+           (unsigned long)stats.num_batches, stats.virtual_s / stats.wall_s);
+  }
+  return 0;
+}
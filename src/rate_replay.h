@@ -0,0 +1,131 @@
+#ifndef RATE_REPLAY_H_
+#define RATE_REPLAY_H_
+
+#include <deque>
+#include <vector>
+#include "scout_rate.h"
+#include "airtime_scheduler.h"
+#include "fec.h"
+
+/** A raw packet outcome recorded at one antenna. */
+struct TraceOutcome {
+  int64_t time_ns;
+  bool is_acked;
+};
+
+/** A GPS reading, speed in m/s. */
+struct TraceGPS {
+  int64_t time_ns;
+  double speed;
+};
+
+/**
+ * A recorded drive: the ACK outcomes of the raw packets at each rate, at the
+ * front and back antennas, and the GPS readings. Text, one record per line,
+ * time in seconds from any origin, '#' starts a comment:
+ *   <time> A <F|B> <rate in 100kbps> <1 acked|0 lost>
+ *   <time> G <speed in m/s>
+ * Times are kept relative to the first record.
+ */
+class RateTrace {
+ public:
+  RateTrace();
+  ~RateTrace();
+
+  /** Perror if the file can't be read or has no back outcomes. */
+  void Load(const char *filename);
+
+  /** Forget which outcomes were used and go back to the start, for the next replay. */
+  void Rewind();
+
+  /**
+   * Outcome of a packet sent at rate at time t: the next unused outcome
+   * recorded within lookahead_ns after t, or else the last one recorded before
+   * t, so both dense and sparse traces are followed. t must not go back
+   * until the next Rewind().
+   * @return false if the rate has no outcome around t at that antenna.
+   */
+  bool Outcome(ScoutRateAdaptation::Laptop laptop, uint16_t rate, int64_t t, int64_t lookahead_ns, bool *is_acked);
+
+  bool has_front() const { return has_front_; }
+  int64_t duration_ns() const { return duration_ns_; }
+  const std::vector<TraceGPS>& gps() const { return gps_; }
+  size_t num_outcomes() const { return num_outcomes_; }
+
+ private:
+  /** Index by laptop, kFront or kBack. */
+  RateArray<std::vector<TraceOutcome> > outcomes_[2];
+  RateArray<size_t> cursors_[2];   /** First unused outcome. */
+  RateArray<size_t> nexts_[2];     /** First outcome at or after the last lookup. */
+  std::vector<TraceGPS> gps_;
+  bool has_front_;
+  int64_t duration_ns_;
+  size_t num_outcomes_;
+};
+
+/** Settings of the simulated AP, the same for every algorithm replayed. */
+struct ReplayConfig {
+  uint32_t coherence_time;   /** us */
+  uint16_t pkt_size;
+  uint32_t extra_time;       /** us, per packet. */
+  int64_t feedback_delay_ns; /** From the end of a batch to its raw ACKs. */
+  int64_t lookahead_ns;      /** @see RateTrace::Outcome() */
+  unsigned int seed;
+};
+
+struct ReplayStats {
+  uint64_t num_batches;
+  uint64_t num_data_pkts;      /** Sum of k. */
+  uint64_t num_coded_pkts;     /** Sum of n, sent over wspace. */
+  uint64_t num_raw_acked;
+  uint64_t num_decoded;        /** Batches with k coded packets through. */
+  uint64_t num_duplicated;     /** Batches also sent over cellular. */
+  uint64_t num_cellular_only;  /** Duplicated batches that only the cellular delivered. */
+  uint64_t num_lost;           /** Batches neither path delivered. */
+  uint64_t bytes_delivered;
+  double virtual_s;
+  double wall_s;
+};
+
+/**
+ * Replays a RateTrace through ScoutRateAdaptation the way WspaceAP drives it,
+ * with a MonotonicTimer virtual clock that only moves by the airtime of the
+ * packets sent, so a trace runs as fast as the decisions are made. Every
+ * batch is decided with MakeDecision(kData), its coded packets take the
+ * outcome the trace recorded for their rate around their send time, and the
+ * raw ACKs come back feedback_delay_ns after the batch. Retransmissions are
+ * not simulated: a batch is delivered if k of its packets got through or it
+ * was duplicated over cellular.
+ */
+class RateReplay {
+ public:
+  RateReplay(RateTrace *trace, const ReplayConfig &config);
+  ~RateReplay();
+
+  void Run(RateAdaptVersion version, ReplayStats *stats);
+
+ private:
+  /** Raw ACKs of one batch waiting for their delivery time. */
+  struct PendingFeedback {
+    int64_t due_ns;
+    std::vector<PacketInfo> front, back;
+  };
+
+  void SetNow(int64_t t);
+
+  void DeliverFeedback(ScoutRateAdaptation *rate_maker);
+
+  static void InsertFeedback(ScoutRateAdaptation *rate_maker, ScoutRateAdaptation::Laptop laptop,
+                             const std::vector<PacketInfo> &pkts);
+
+  /** The virtual clock starts here rather than at 0, lookups before the first record stay positive. */
+  static const int64_t kOriginNs = 1000000000000LL;
+
+  RateTrace *trace_;
+  ReplayConfig config_;
+  struct timespec now_;
+  int64_t now_ns_;
+  std::deque<PendingFeedback> pending_;
+};
+
+#endif
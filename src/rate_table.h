@@ -0,0 +1,97 @@
+#ifndef RATE_TABLE_H_
+#define RATE_TABLE_H_
+
+#include <assert.h>
+#include <stdint.h>
+
+#define ATH5K_RATE_CODE_1M  0x1B
+#define ATH5K_RATE_CODE_2M  0x1A
+#define ATH5K_RATE_CODE_5_5M  0x19
+#define ATH5K_RATE_CODE_11M  0x18
+/* A and G */
+#define ATH5K_RATE_CODE_6M  0x0B
+#define ATH5K_RATE_CODE_9M  0x0F
+#define ATH5K_RATE_CODE_12M  0x0A
+#define ATH5K_RATE_CODE_18M  0x0E
+#define ATH5K_RATE_CODE_24M  0x09
+#define ATH5K_RATE_CODE_36M  0x0D
+#define ATH5K_RATE_CODE_48M  0x08
+#define ATH5K_RATE_CODE_54M  0x0C
+
+/** A data rate in 100kbps and the ath5k code that selects it. */
+struct RateEntry {
+  uint16_t rate;
+  uint8_t code;
+};
+
+/** Every rate the radio supports, ascending, the rate index is the position here. */
+static constexpr RateEntry kRateTable[] = {
+  {10, ATH5K_RATE_CODE_1M}, {20, ATH5K_RATE_CODE_2M}, {55, ATH5K_RATE_CODE_5_5M},
+  {60, ATH5K_RATE_CODE_6M}, {90, ATH5K_RATE_CODE_9M}, {110, ATH5K_RATE_CODE_11M},
+  {120, ATH5K_RATE_CODE_12M}, {180, ATH5K_RATE_CODE_18M}, {240, ATH5K_RATE_CODE_24M},
+  {360, ATH5K_RATE_CODE_36M}, {480, ATH5K_RATE_CODE_48M}, {540, ATH5K_RATE_CODE_54M},
+};
+static constexpr int kNumRateInds = sizeof(kRateTable) / sizeof(kRateTable[0]);
+static constexpr uint16_t kMaxRate = 540;
+
+/** Reverse lookups of kRateTable, built at compile time: value -> rate index or -1. */
+struct RateIndexTable {
+  int8_t by_rate[kMaxRate + 1];
+  int8_t by_code[256];
+
+  constexpr RateIndexTable() : by_rate(), by_code() {
+    for (int i = 0; i <= kMaxRate; i++)
+      by_rate[i] = -1;
+    for (int i = 0; i < 256; i++)
+      by_code[i] = -1;
+    for (int i = 0; i < kNumRateInds; i++) {
+      by_rate[kRateTable[i].rate] = i;
+      by_code[kRateTable[i].code] = i;
+    }
+  }
+};
+static constexpr RateIndexTable kRateIndexTable;
+
+/** @return the rate index of a rate in 100kbps, -1 if the radio doesn't support it. */
+inline int RateIndex(uint16_t rate) {
+  return rate <= kMaxRate ? kRateIndexTable.by_rate[rate] : -1;
+}
+
+/** @return the rate index of an ath5k rate code, -1 if invalid. */
+inline int RateCodeIndex(uint16_t code) {
+  return code < 256 ? kRateIndexTable.by_code[code] : -1;
+}
+
+/**
+ * A value per supported rate, a dense array indexed through RateIndex in
+ * place of a std::map keyed by rate.
+ */
+template <typename T>
+class RateArray {
+ public:
+  T& operator[](uint16_t rate) {
+    int ind = RateIndex(rate);
+    assert(ind >= 0);
+    return arr_[ind];
+  }
+
+  const T& operator[](uint16_t rate) const {
+    int ind = RateIndex(rate);
+    assert(ind >= 0);
+    return arr_[ind];
+  }
+
+  /** By rate index, for walking all the rates in ascending order. */
+  T& at_ind(int ind) { return arr_[ind]; }
+  const T& at_ind(int ind) const { return arr_[ind]; }
+
+  void Fill(const T &val) {
+    for (int i = 0; i < kNumRateInds; i++)
+      arr_[i] = val;
+  }
+
+ private:
+  T arr_[kNumRateInds];
+};
+
+#endif
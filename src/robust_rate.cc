@@ -25,8 +25,10 @@ void RobustRate::InitRateTable() {
   int32_t num_rates = sizeof(rate)/sizeof(rate[0]);
 
   rraa_rate_table.clear();
+  rate_pos.Fill(-1);
   RRAARateInfo rate_info;
   for(int i = 0; i < num_rates; ++i) {
+    rate_pos[rate[i]] = i;
     rate_info.rate = rate[i];
     rate_info.wnd_size = window_size[i];
     if(i)
@@ -49,11 +51,6 @@ void RobustRate::InitRateTable() {
 
 
 int32_t RobustRate::ApplyRate(int32_t& case_num) {
-  if(update_rraa_rate_table) {
-    update_rraa_rate_table = 0;
-    UpdateRateTable();
-  }
-
   int32_t new_pos = cur_rate_pos;
   --wnd_counter;
   int32_t sz = rraa_rate_table.size();
@@ -73,8 +70,8 @@ int32_t RobustRate::ApplyRate(int32_t& case_num) {
 
   if(cur_rate_pos!=new_pos) {
     cur_rate_pos = new_pos;
-    PrintRateTable(); 
-    cout<<"Update Rate to:"<<rraa_rate_table[new_pos].rate/10.0<<"Mbps"<<endl;
+    //PrintRateTable(); 
+    //cout<<"Update Rate to:"<<rraa_rate_table[new_pos].rate/10.0<<"Mbps"<<endl;
   }
   /**
   if(new_pos == 0) {
@@ -97,60 +94,59 @@ void RobustRate::InsertIntoRateTable(const PacketInfo& pkt) {
   int32_t rate = pkt.rate;
   int32_t len = pkt.length;
 
-  for(int32_t i = 0, sz = rraa_rate_table.size(); i < sz; ++i) {
-    if(rraa_rate_table[i].rate!=rate)
-      continue;
-    rraa_rate_table[i].num_sent++;
-    rraa_rate_table[i].len_sent+=len;
+  int32_t i = RateIndex(rate) < 0 ? -1 : rate_pos[rate];
+  if(i < 0)
+    return;
+  rraa_rate_table[i].num_sent++;
+  rraa_rate_table[i].len_sent+=len;
 
-    if(status==kACKed) {
-      rraa_rate_table[i].num_acked++;
-      rraa_rate_table[i].len_acked+=len;
-    }
-    else {
-      /*num_sent == num_acked + "rest"*/
-    }
-    break;
+  if(status==kACKed) {
+    rraa_rate_table[i].num_acked++;
+    rraa_rate_table[i].len_acked+=len;
+  }
+  else {
+    /*num_sent == num_acked + "rest"*/
   }
-  update_rraa_rate_table = 1;
+  UpdateLossRatio(i);
 }
 
 void RobustRate::RemoveFromRateTable(const PacketInfo& pkt) {
   PacketStatus status = pkt.status;
   int32_t len = pkt.length;
-  int32_t sz = rraa_rate_table.size();
-  for(int32_t i = 0; i < sz; ++i) {
-    if(rraa_rate_table[i].rate!=pkt.rate)
-      continue;
-    rraa_rate_table[i].num_sent--;      
-    rraa_rate_table[i].len_sent-=len;
-    if(status==kACKed) {
-      rraa_rate_table[i].num_acked--;
-      rraa_rate_table[i].len_acked-=len;
-    }
-    else {
-      /* */
-    }
-    break;
+  int32_t i = RateIndex(pkt.rate) < 0 ? -1 : rate_pos[pkt.rate];
+  if(i < 0)
+    return;
+  rraa_rate_table[i].num_sent--;      
+  rraa_rate_table[i].len_sent-=len;
+  if(status==kACKed) {
+    rraa_rate_table[i].num_acked--;
+    rraa_rate_table[i].len_acked-=len;
   }
-  update_rraa_rate_table = 1;
+  else {
+    /* */
+  }
+  UpdateLossRatio(i);
 }
 
 void RobustRate::UpdateRateTable() {
   int32_t sz = rraa_rate_table.size();
-  for(int32_t i = 0; i < sz; ++i) { 
-    if(abs(rraa_rate_table[i].len_sent) < 1e-9)
-      rraa_rate_table[i].len_sent = 0;
-    if(abs(rraa_rate_table[i].len_acked) < 1e-9)
-      rraa_rate_table[i].len_acked = 0;
-
-    double len_sent = rraa_rate_table[i].len_sent;
-    double len_loss = rraa_rate_table[i].len_sent - rraa_rate_table[i].len_acked;
-    if(len_sent > 0)
-      rraa_rate_table[i].loss_ratio = len_loss/len_sent;
-    else
-      rraa_rate_table[i].loss_ratio = 1;
-  }
+  for(int32_t i = 0; i < sz; ++i)
+    UpdateLossRatio(i);
+}
+
+void RobustRate::UpdateLossRatio(int32_t pos) {
+  RRAARateInfo &info = rraa_rate_table[pos];
+  if(abs(info.len_sent) < 1e-9)
+    info.len_sent = 0;
+  if(abs(info.len_acked) < 1e-9)
+    info.len_acked = 0;
+
+  double len_sent = info.len_sent;
+  double len_loss = info.len_sent - info.len_acked;
+  if(len_sent > 0)
+    info.loss_ratio = len_loss/len_sent;
+  else
+    info.loss_ratio = 1;
 }
 
 
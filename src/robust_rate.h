@@ -2,6 +2,7 @@
 #define ROBUST_RATE_
 
 #include "base_rate.h"
+#include "rate_table.h"
 
 
 struct RRAARateInfo {
@@ -27,6 +28,8 @@ struct RRAARateInfo {
 class RobustRate : public BaseRate {
  private:
   vector<RRAARateInfo> rraa_rate_table;
+  /** Position of each rate in rraa_rate_table, -1 if it is not there. */
+  RateArray<int8_t> rate_pos;
   int32_t wnd_counter;
   int32_t cur_rate_pos;
 
@@ -60,13 +63,15 @@ class RobustRate : public BaseRate {
    */
   void RemoveFromRateTable(const PacketInfo& pkt);
 
-  //update means calculate the corresponding avg_tx_time etc.
-  bool update_rraa_rate_table;
   /**
    * Do the rate table calculations
    * inherit from BaseRate, please refer to BaseRate interface
+   * Insert and remove already keep loss_ratio current, one rate at a time.
    */
   void UpdateRateTable();
+
+  /** Recompute the loss_ratio of the rate at pos from its window sums. */
+  void UpdateLossRatio(int32_t pos);
   /**
    * return the rate decision based on current rate table
    * inherit from BaseRate
@@ -0,0 +1,42 @@
+#include "rtt_estimator.h"
+
+void RttEstimator::Reset(int init_rtt_us) {
+  srtt_us_ = init_rtt_us;
+  rttvar_us_ = init_rtt_us / 2;
+  num_samples_ = 0;
+  /** Same margin as the static rtt used to get. */
+  rto_us_ = init_rtt_us + init_rtt_us / 5;
+  if (rto_us_ < kMinRtoUs)
+    rto_us_ = kMinRtoUs;
+  else if (rto_us_ > kMaxRtoUs)
+    rto_us_ = kMaxRtoUs;
+}
+
+void RttEstimator::AddSample(int rtt_us) {
+  if (rtt_us < 0)
+    return;
+  if (num_samples_ == 0) {
+    srtt_us_ = rtt_us;
+    rttvar_us_ = rtt_us / 2;
+  }
+  else {  /** alpha = 1/8, beta = 1/4. */
+    int err = rtt_us - srtt_us_;
+    rttvar_us_ += ((err < 0 ? -err : err) - rttvar_us_) / 4;
+    srtt_us_ += err / 8;
+  }
+  num_samples_++;
+  UpdateRto();
+}
+
+void RttEstimator::Backoff() {
+  rto_us_ = rto_us_ > kMaxRtoUs / 2 ? kMaxRtoUs : rto_us_ * 2;
+}
+
+void RttEstimator::UpdateRto() {
+  int var = 4 * rttvar_us_;
+  rto_us_ = srtt_us_ + (var > kGranularityUs ? var : kGranularityUs);
+  if (rto_us_ < kMinRtoUs)
+    rto_us_ = kMinRtoUs;
+  else if (rto_us_ > kMaxRtoUs)
+    rto_us_ = kMaxRtoUs;
+}
@@ -0,0 +1,44 @@
+#ifndef RTT_ESTIMATOR_H_
+#define RTT_ESTIMATOR_H_
+
+#include <stdint.h>
+
+/**
+ * Smoothed RTT and RTT variance of one client's feedback path, with the
+ * retransmission timeout derived from them after RFC 6298:
+ * rto = srtt + max(G, 4 * rttvar), clamped to [kMinRtoUs, kMaxRtoUs].
+ * Only packets sent once may be sampled (Karn's algorithm). All times in us.
+ */
+class RttEstimator {
+ public:
+  static const int kMinRtoUs = 5000;
+  static const int kMaxRtoUs = 2000000;
+  static const int kGranularityUs = 1000;  // Resolution of the retransmission timers.
+
+  RttEstimator() { Reset(100000); }
+  ~RttEstimator() {}
+
+  /** Forget the samples and start over with rto = 1.2 * init_rtt_us. */
+  void Reset(int init_rtt_us);
+
+  /** Feed one RTT measurement. */
+  void AddSample(int rtt_us);
+
+  /** Exponential backoff after a retransmission timeout, undone by the next sample. */
+  void Backoff();
+
+  int srtt_us() const { return srtt_us_; }
+  int rttvar_us() const { return rttvar_us_; }
+  int rto_us() const { return rto_us_; }
+  uint32_t num_samples() const { return num_samples_; }
+
+ private:
+  void UpdateRto();
+
+  int srtt_us_;
+  int rttvar_us_;
+  int rto_us_;
+  uint32_t num_samples_;
+};
+
+#endif
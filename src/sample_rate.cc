@@ -7,12 +7,6 @@ SampleRate::SampleRate() {
   update_interval = MonotonicTimer(10, 0);
 
   InitRateTable();
-  update_rate_table = 1; 
-  /* if there is insert or delete in the rate table, update_rate_table will be set to 1
-  and to be updated only when calculating the sending rate(this will cause extra running time, 
-  but prevent calculating the rate when inserting or deleting)
-  */
-
 }
 
 
@@ -25,9 +19,13 @@ void SampleRate::InitRateTable() {
 
   PacketStat hs; 
   rate_table.clear();
+  rate_pos.Fill(-1);
   for(int i = 0; i < mac80211abg_num_rates; ++i) {
     rate_table.push_back(RateHistory(mac80211abg_rate[i], hs));
+    rate_pos[mac80211abg_rate[i]] = i;
   }
+  best_pos = -1;
+  FindUsablePos();
 }
 
 SampleRate::~SampleRate() {
@@ -49,11 +47,6 @@ int32_t SampleRate::ApplyRate(int32_t& case_num) {
   • Otherwise, send the packet at the bit-rate that has the lowest average transmission
   time.
   */
-  if(update_rate_table) {
-    update_rate_table = 0;
-    UpdateRateTable();
-  }
-
   //int32_t case_num = 0;
   uint32_t new_pos = cur_rate_pos;
 
@@ -61,23 +54,7 @@ int32_t SampleRate::ApplyRate(int32_t& case_num) {
   ++pkt_count; 
 
   if(0==statistic.num_acked) {
-#ifdef UP_TO_DOWN
-    new_pos = sz - 1;
-    for(int32_t i = sz - 1; i >= 0; --i) {
-      if(rate_table[i].history.num_conti_loss < 4) {
-        new_pos = i;
-        break;
-      }
-    }
-#else if DOWN_TO_UP
-    new_pos = 0;
-    for(int32_t i = 0; i < sz; ++i) {
-      if(rate_table[i].history.num_conti_loss < 4) {
-        new_pos = i;
-        break;
-      }
-    }
-#endif
+    new_pos = usable_pos;
     case_num = 1;
   }
   else if(0==pkt_count%10) {
@@ -102,13 +79,8 @@ int32_t SampleRate::ApplyRate(int32_t& case_num) {
     case_num = 2;
   }
   else {
-    double min_tx_time = 1e10;
-    for(int32_t i = 0; i < sz; ++i) {
-      if(min_tx_time > rate_table[i].history.avg_tx_time) {
-        min_tx_time = rate_table[i].history.avg_tx_time;
-        new_pos = i;
-      }
-    }
+    if(best_pos >= 0)
+      new_pos = best_pos;
     case_num = 3;
   }
     
@@ -144,110 +116,150 @@ void SampleRate::InsertIntoRateTable(const PacketInfo& pkt) {
   int32_t rate = pkt.rate;
   int32_t len = pkt.length;
 
+  int32_t i = RateIndex(rate) < 0 ? -1 : rate_pos[rate];
+  if(i < 0)
+    return;
+  UpdateRateTable();
+
   double difs;
-  int32_t sz = rate_table.size();
   if(Is80211b(rate))
     difs = DIFS_80211b;
   else
     difs = DIFS_80211ag;
 
-  for(int32_t i = 0; i < sz; ++i) {
-    if(rate_table[i].rate!=rate)
-      continue;
-    rate_table[i].history.num_sent++;
-    rate_table[i].history.len_sent+=len;
-    rate_table[i].history.total_tx_time += (((len*80.0)/rate) + difs);
-
-    if(status==kACKed) {
-      statistic.num_acked++;
-      rate_table[i].history.num_acked++;
-      rate_table[i].history.len_acked+=len;
-      rate_table[i].history.num_conti_loss = 0;
-    }
-    else if(status==kNAKed) {
-      rate_table[i].history.num_naked++;
-      rate_table[i].history.len_naked+=len;
-      rate_table[i].history.num_conti_loss++;
-    }
-    else if(status==kTimeOut) {
-      rate_table[i].history.num_timeout++;
-      rate_table[i].history.len_timeout+=len;
-      rate_table[i].history.num_conti_loss++;
-    }
-    else {}
-    break;
+  bool was_usable = rate_table[i].history.num_conti_loss < 4;
+  rate_table[i].history.num_sent++;
+  rate_table[i].history.len_sent+=len;
+  rate_table[i].history.total_tx_time += (((len*80.0)/rate) + difs);
+
+  if(status==kACKed) {
+    statistic.num_acked++;
+    rate_table[i].history.num_acked++;
+    rate_table[i].history.len_acked+=len;
+    rate_table[i].history.num_conti_loss = 0;
   }
-  update_rate_table = 1;
+  else if(status==kNAKed) {
+    rate_table[i].history.num_naked++;
+    rate_table[i].history.len_naked+=len;
+    rate_table[i].history.num_conti_loss++;
+  }
+  else if(status==kTimeOut) {
+    rate_table[i].history.num_timeout++;
+    rate_table[i].history.len_timeout+=len;
+    rate_table[i].history.num_conti_loss++;
+  }
+  else {}
+  UpdateRateStat(i);
+  if(was_usable != (rate_table[i].history.num_conti_loss < 4))
+    FindUsablePos();
 }
 
 void SampleRate::RemoveFromRateTable(const PacketInfo& pkt) {
   PacketStatus status = pkt.status;
   int32_t len = pkt.length;
-  int32_t sz = rate_table.size();
-  for(int32_t i = 0; i < sz; ++i) {
-    if(rate_table[i].rate!=pkt.rate)
-      continue;
-
-    double difs;
-    if(Is80211b(pkt.rate))
-      difs = DIFS_80211b;
-    else
-      difs = DIFS_80211ag;
-
-    rate_table[i].history.num_sent--;      
-    rate_table[i].history.len_sent-=len;
-    rate_table[i].history.total_tx_time -= (((len*80.0)/pkt.rate) + difs);
-    if(status==kACKed) {
-      statistic.num_acked--;
-      rate_table[i].history.num_acked--;
-      rate_table[i].history.len_acked-=len;
-    }
-    else if(status==kNAKed) {
-      rate_table[i].history.num_naked--;
-      rate_table[i].history.len_naked-=len;
-    }
-    else if(status==kTimeOut) {
-      rate_table[i].history.len_timeout-=len;
-      rate_table[i].history.num_timeout--;
-    }
-    else {}
+  int32_t i = RateIndex(pkt.rate) < 0 ? -1 : rate_pos[pkt.rate];
+  if(i < 0)
+    return;
 
-    break;
+  double difs;
+  if(Is80211b(pkt.rate))
+    difs = DIFS_80211b;
+  else
+    difs = DIFS_80211ag;
+
+  rate_table[i].history.num_sent--;      
+  rate_table[i].history.len_sent-=len;
+  rate_table[i].history.total_tx_time -= (((len*80.0)/pkt.rate) + difs);
+  if(status==kACKed) {
+    statistic.num_acked--;
+    rate_table[i].history.num_acked--;
+    rate_table[i].history.len_acked-=len;
+  }
+  else if(status==kNAKed) {
+    rate_table[i].history.num_naked--;
+    rate_table[i].history.len_naked-=len;
   }
-  update_rate_table = 1;
+  else if(status==kTimeOut) {
+    rate_table[i].history.len_timeout-=len;
+    rate_table[i].history.num_timeout--;
+  }
+  else {}
+  UpdateRateStat(i);
 }
 
 void SampleRate::UpdateRateTable() {
-
   MonotonicTimer now = MonotonicTimer();
   if(now > last_update + update_interval) {
     last_update = now;
     int32_t sz = rate_table.size();
     for(int32_t i = 0; i < sz; ++i)
       rate_table[i].history.num_conti_loss = 0;
+    FindUsablePos();
+  }
+}
+
+void SampleRate::UpdateRateStat(int32_t pos) {
+  PacketStat &hs = rate_table[pos].history;
+  double old_avg_tx_time = hs.avg_tx_time;
+
+  double len_sent = hs.len_sent;
+  if(abs(hs.len_sent) < 1e-9)
+    len_sent = 0, hs.len_sent = 0;
+  if(abs(hs.total_tx_time) < 1e-9)
+    hs.total_tx_time = 0;
+  else if (len_sent > 0)
+    hs.min_avg_tx_time = hs.total_tx_time/len_sent;
+  double len_acked = hs.len_acked;
+  if(abs(hs.len_acked) < 1e-9)
+    len_acked = 0, hs.len_acked = 0;
+  if(0==len_acked)
+    hs.avg_tx_time = 1e10;
+  if(len_acked > 0 && hs.total_tx_time >= hs.min_avg_tx_time) {
+    hs.avg_tx_time = hs.total_tx_time/len_acked;
   }
 
+  /** Ties go to the lower position, as in a scan. */
+  if(pos == best_pos) {
+    if(hs.avg_tx_time > old_avg_tx_time)
+      FindBestPos();
+  }
+  else if(hs.avg_tx_time < 1e10) {
+    double best = best_pos < 0 ? 1e10 : rate_table[best_pos].history.avg_tx_time;
+    if(hs.avg_tx_time < best || (hs.avg_tx_time == best && pos < best_pos))
+      best_pos = pos;
+  }
+}
+
+void SampleRate::FindBestPos() {
+  double min_tx_time = 1e10;
+  best_pos = -1;
+  for(int32_t i = 0, sz = rate_table.size(); i < sz; ++i) {
+    if(min_tx_time > rate_table[i].history.avg_tx_time) {
+      min_tx_time = rate_table[i].history.avg_tx_time;
+      best_pos = i;
+    }
+  }
+}
+
+void SampleRate::FindUsablePos() {
   int32_t sz = rate_table.size();
-  int32_t sent, acked;
-  for(int32_t i = 0; i < sz; ++i) { 
-    //sent = rate_table[i].history.num_sent;
-    double len_sent = rate_table[i].history.len_sent;
-    if(abs(rate_table[i].history.len_sent) < 1e-9)
-      len_sent = 0, rate_table[i].history.len_sent = 0;
-    if(abs(rate_table[i].history.total_tx_time) < 1e-9)
-      rate_table[i].history.total_tx_time = 0;
-    else if (len_sent > 0)
-      rate_table[i].history.min_avg_tx_time = rate_table[i].history.total_tx_time/len_sent;
-    //acked = rate_table[i].history.num_acked;
-    double len_acked = rate_table[i].history.len_acked;
-    if(abs(rate_table[i].history.len_acked) < 1e-9)
-      len_acked = 0, rate_table[i].history.len_acked = 0;
-    if(0==len_acked)
-      rate_table[i].history.avg_tx_time = 1e10;
-    if(len_acked > 0 && rate_table[i].history.total_tx_time >= rate_table[i].history.min_avg_tx_time) {
-      rate_table[i].history.avg_tx_time = rate_table[i].history.total_tx_time/len_acked;
+#ifdef UP_TO_DOWN
+  usable_pos = sz - 1;
+  for(int32_t i = sz - 1; i >= 0; --i) {
+    if(rate_table[i].history.num_conti_loss < 4) {
+      usable_pos = i;
+      break;
+    }
+  }
+#else /* DOWN_TO_UP */
+  usable_pos = 0;
+  for(int32_t i = 0; i < sz; ++i) {
+    if(rate_table[i].history.num_conti_loss < 4) {
+      usable_pos = i;
+      break;
     }
   }
+#endif
 }
 
 
@@ -2,6 +2,7 @@
 #define SAMPLE_RATE_
 
 #include "base_rate.h"
+#include "rate_table.h"
 
 
 //#define UP_TO_DOWN
@@ -78,9 +79,25 @@ class SampleRate : public BaseRate {
 
 
   vector<RateHistory> rate_table;
+  /** Position of each rate in rate_table, -1 if it is not there. */
+  RateArray<int8_t> rate_pos;
+  /** Position with the lowest avg_tx_time, -1 if no rate has an ACK. */
+  int32_t best_pos;
+  /** Position to use while nothing is ACKed, see FindUsablePos(). */
+  int32_t usable_pos;
 
   PacketStat statistic;
 
+  /**
+   * Recompute avg_tx_time and min_avg_tx_time of one rate after its sums
+   * changed, and move best_pos if needed, so ApplyRate reads the table as is.
+   */
+  void UpdateRateStat(int32_t pos);
+  /** Rescan for best_pos, only when the best rate got slower. */
+  void FindBestPos();
+  /** Rescan for the first rate without 4 successive losses. */
+  void FindUsablePos();
+
  public:
   SampleRate();
   ~SampleRate();
@@ -99,12 +116,11 @@ class SampleRate : public BaseRate {
   */  
   void RemoveFromRateTable(const PacketInfo& pkt);
 
-  //update means calculate the corresponding avg_tx_time etc.
-  bool update_rate_table;
   /**
   * inherit from BaseRate, refer to BaseRate interface
+  * The per rate statistics are kept up to date on insert and remove, this
+  * only clears num_conti_loss every update_interval.
   */  
-  
   void UpdateRateTable();
 
   /**
@@ -3,10 +3,12 @@
 using namespace std;
 
 /** LossMap */
-LossMap::LossMap(const int *rate_arr, int num_rates) {
+LossMap::LossMap(const int *rate_arr, int num_rates) : seq_(0) {
   LossInfo info = {0, 0, INVALID_LOSS_RATE};
+  loss_map_.Fill(info);
+  has_rate_.Fill(false);
   for (int i = 0; i < num_rates; i++)
-    loss_map_[rate_arr[i]] = info;
+    has_rate_[rate_arr[i]] = true;
   Pthread_mutex_init(&lock_, NULL);
 }
 
@@ -14,65 +16,98 @@ LossMap::~LossMap() {
   Pthread_mutex_destroy(&lock_);
 }
 
-void LossMap::UpdateLoss(uint16_t rate, double loss, double previous_weight) {
-  Lock();
-  assert(loss_map_.count(rate) > 0);  /** Ensure rate is in the map. */
+void LossMap::Publish(const Table &table) {
+  uint32_t seq = seq_.load(std::memory_order_relaxed);
+  seq_.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  loss_map_ = table;
+  seq_.store(seq + 2, std::memory_order_release);
+}
+
+void LossMap::GetSnapshot(Table *table) const {
+  uint32_t seq_start, seq_end;
+  do {
+    seq_start = seq_.load(std::memory_order_acquire);
+    *table = loss_map_;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    seq_end = seq_.load(std::memory_order_relaxed);
+  } while ((seq_start & 1) || seq_start != seq_end);
+}
+
+void LossMap::UpdateInfo(LossInfo &info, double loss, double previous_weight) {
   assert(loss == INVALID_LOSS_RATE || (loss >= 0 && loss <= 1));
   assert(previous_weight <= 1);
-  if (previous_weight > 0 && loss != INVALID_LOSS_RATE && loss_map_[rate].loss != INVALID_LOSS_RATE) {
-    loss_map_[rate].loss = loss_map_[rate].loss * previous_weight + loss * (1 - previous_weight);
+  if (previous_weight > 0 && loss != INVALID_LOSS_RATE && info.loss != INVALID_LOSS_RATE) {
+    info.loss = info.loss * previous_weight + loss * (1 - previous_weight);
   }
-  else if (previous_weight <= 0 || loss_map_[rate].loss == INVALID_LOSS_RATE/** initial phase */) {
-    loss_map_[rate].loss = loss;
+  else if (previous_weight <= 0 || info.loss == INVALID_LOSS_RATE/** initial phase */) {
+    info.loss = loss;
   }
   else { // if loss == -1, don't update and use the previous loss rate.
   }
-//  if (loss_map_[rate].loss != INVALID_LOSS_RATE)
-//    loss_map_[rate].loss = loss_map_[rate].loss / 2.;
-  UnLock();
+//  if (info.loss != INVALID_LOSS_RATE)
+//    info.loss = info.loss / 2.;
 }
 
-void LossMap::UpdateSendCnt(uint16_t rate, uint32_t n_sent, uint32_t n_ack) {
+void LossMap::UpdateLosses(const vector<uint16_t> &rates, const vector<double> &losses, double previous_weight) {
+  assert(rates.size() == losses.size());
+  bool is_changed = false;
   Lock();
-  assert(loss_map_.count(rate) > 0);  /** Ensure rate is in the map. */
-  loss_map_[rate].n_sent = n_sent;
-  loss_map_[rate].n_ack = n_ack;
+  Table table = loss_map_;  /** Only writers change it, and they hold the lock. */
+  for (size_t i = 0; i < rates.size(); i++) {
+    assert(has_rate_[rates[i]]);  /** Ensure rate is in the map. */
+    LossInfo &info = table[rates[i]];
+    double prev_loss = info.loss;
+    UpdateInfo(info, losses[i], previous_weight);
+    is_changed |= (info.loss != prev_loss);
+  }
+  if (is_changed)  /** Leave the version alone if nothing changed. */
+    Publish(table);
   UnLock();
 }
 
-double LossMap::GetLossRate(uint16_t rate) {
-  double loss;
-  Lock();
-  assert(loss_map_.count(rate) > 0);  
-  loss = loss_map_[rate].loss;
-  UnLock();
-  return loss;
+void LossMap::UpdateLoss(uint16_t rate, double loss, double previous_weight) {
+  UpdateLosses(vector<uint16_t>(1, rate), vector<double>(1, loss), previous_weight);
 }
 
-uint32_t LossMap::GetNSent(uint16_t rate) {
-  uint32_t n_sent;  
+void LossMap::UpdateSendCnt(uint16_t rate, uint32_t n_sent, uint32_t n_ack) {
   Lock();
-  assert(loss_map_.count(rate) > 0);  
-  n_sent = loss_map_[rate].n_sent;
+  assert(has_rate_[rate]);  /** Ensure rate is in the map. */
+  Table table = loss_map_;
+  table[rate].n_sent = n_sent;
+  table[rate].n_ack = n_ack;
+  Publish(table);
   UnLock();
-  return n_sent;
 }
 
-uint32_t LossMap::GetNAck(uint16_t rate) {
-  uint32_t n_ack;  
-  Lock();
-  assert(loss_map_.count(rate) > 0);  
-  n_ack = loss_map_[rate].n_ack;
-  UnLock();
-  return n_ack;
+double LossMap::GetLossRate(uint16_t rate) const {
+  assert(has_rate_[rate]);  
+  Table table;
+  GetSnapshot(&table);
+  return table[rate].loss;
 }
 
-void LossMap::Print() {
-  Lock();
-  map<uint16_t, LossInfo>::const_iterator it_map;
-  for (it_map = loss_map_.begin(); it_map != loss_map_.end(); it_map++)
-    printf("%u\t%.3f\n", it_map->first, it_map->second.loss);
-  UnLock();
+uint32_t LossMap::GetNSent(uint16_t rate) const {
+  assert(has_rate_[rate]);  
+  Table table;
+  GetSnapshot(&table);
+  return table[rate].n_sent;
+}
+
+uint32_t LossMap::GetNAck(uint16_t rate) const {
+  assert(has_rate_[rate]);  
+  Table table;
+  GetSnapshot(&table);
+  return table[rate].n_ack;
+}
+
+void LossMap::Print() const {
+  Table table;
+  GetSnapshot(&table);
+  for (int i = 0; i < kNumRateInds; i++) {
+    if (has_rate_.at_ind(i))
+      printf("%u\t%.3f\n", kRateTable[i].rate, table.at_ind(i).loss);
+  }
 }
 
 ScoutRateAdaptation::ScoutRateAdaptation(const int32_t *rate_arr, int32_t num_rates, 
@@ -81,20 +116,24 @@ ScoutRateAdaptation::ScoutRateAdaptation(const int32_t *rate_arr, int32_t num_ra
             const MonotonicTimer &front_window, 
             const MonotonicTimer &back_window, 
             const MonotonicTimer &total_window)
-    : feedback_rec_front_(rate_arr, num_rates, total_window), 
+    : kAntennaDist(antenna_dist), kGFSize(gf_size - kNumSampleRates), kMaxK(max_k), 
+    rate_(rate_arr[0]), rate_adapt_version_(kScoutSeq), 
+    variant_(NULL), decide_(NULL), calc_loss_after_combine_(NULL), use_baseline_(false), use_fec_(true), 
+    feedback_rec_front_(rate_arr, num_rates, total_window), 
     feedback_rec_back_(rate_arr, num_rates, total_window), 
     loss_map_front_(rate_arr, num_rates), loss_map_back_(rate_arr, num_rates), 
     loss_map_scout_(rate_arr, num_rates), loss_map_combine_(rate_arr, num_rates), 
-    kGFSize(gf_size - kNumSampleRates), kMaxK(max_k), 
-    rate_(rate_arr[0]), rate_adapt_version_(kScoutSeq), use_fec_(true), 
-    rate_adapt_baseline_(NULL), speed_(-1.0), loss_bound_(loss_bound), 
-    kAntennaDist(antenna_dist), duplicate_thresh_(duplicate_thresh), 
-    front_window_(front_window), back_window_(back_window), enable_duplicate_(true) {
+    rate_adapt_baseline_(NULL), speed_(-1.0), 
+    front_window_(front_window), back_window_(back_window), 
+    duplicate_thresh_(duplicate_thresh), loss_bound_(loss_bound), enable_duplicate_(true), 
+    num_decisions_(0), next_decision_(0), decision_version_(0), feasible_version_(0), config_version_(0) {
+  rate_ind_tbl_.Fill(-1);
   for (int i = 0; i < num_rates; i++) {
     rate_arr_.push_back(rate_arr[i]);
-    rate_ind_map_[rate_arr[i]] = i;
+    rate_ind_tbl_[rate_arr[i]] = i;
   }
   
+  set_rate_adapt_version(rate_adapt_version_);
   srand(time(NULL));  
 }
 
@@ -117,19 +156,13 @@ LossMap* ScoutRateAdaptation::GetLossMap(Laptop laptop) {
 }
 
 
-void ScoutRateAdaptation::set_rate_adapt_version(const RateAdaptVersion &version) { 
-  rate_adapt_version_ = version; 
-  if ((version == kSampleRate || version == kRRAA) && !rate_adapt_baseline_)
-    rate_adapt_baseline_ = new RateAdaptation(version);
-}
-
 void ScoutRateAdaptation::InsertFeedback(Laptop laptop, uint32_t seq, PacketStatus status, 
           uint16_t rate, uint16_t len, const MonotonicTimer &time) {
   if (laptop == kFront)
     feedback_rec_front_.InsertPacket(seq, status, rate, time);
   else if (laptop == kBack) {
     feedback_rec_back_.InsertPacket(seq, status, rate, time);
-    if (rate_adapt_version_ == kSampleRate || rate_adapt_version_ == kRRAA) {
+    if (use_baseline_) {
       //printf("Baseline InsertRecord raw_seq[%u] status[%d] rate[%u] len[%u]\n", seq, status, rate, len);
       rate_adapt_baseline_->InsertRecord(seq, status, rate, len);  /** Baseline alg selects rate based on the back feedback.*/
     }
@@ -141,49 +174,12 @@ void ScoutRateAdaptation::InsertFeedback(Laptop laptop, uint32_t seq, PacketStat
 void ScoutRateAdaptation::MakeDecision(TransmitMode transmit_mode, uint32_t coherence_time, 
             uint16_t pkt_size, uint32_t extra_time, 
           int &k, int &n, vector<uint16_t> &rate_arr, bool &is_duplicate) {
-  int n_no_sampling = -1;
-
-  if (transmit_mode != kTimeOut) {
-    /** Figure out the effective loss rates after packet combining.*/
-    CalcLossRatesAfterCombine();  
-    //PrintLossRatesAfterCombine();
-
-    /** Make rate decision for the first packet in the batch.*/
-    //if (transmit_mode == kRetrans) set_rate(rate_arr_[0]);
-    //else ApplyRate();  
-    ApplyRate();
-  }
-
-  /** Apply FEC. */
-  ApplyFEC(transmit_mode, coherence_time, pkt_size, extra_time, k, n_no_sampling);
-  
-  /** Decide whether to offload to cellular. */
-  if (enable_duplicate() && (IsHighLoss() || transmit_mode == kRetrans || IsBootstrapping()))
-    is_duplicate = true;
-  else
-    is_duplicate = false;
-
-  //printf("MakeDecision: is_duplicate %d, IsHighLoss:%d, transmit_mode:%d, IsBootstrapping():%d\n", (int)is_duplicate, (int)IsHighLoss(), (int)transmit_mode, (int)IsBootstrapping());
-
-  //printf("MakeDecision: enable_duplicate[%d] high_loss[%d] transmit_mode[%d]\n", 
-  //enable_duplicate(), IsHighLoss(), transmit_mode);
-
-  if (is_duplicate) {
-    n_no_sampling = k; /** Don't slow down the cellular link.*/
-    SampleRates(1, kSampleBound);  /** Don't waste time to sample higher data rates.*/
-  }
-  else {
-    SampleRates(kNumSampleRates, kSampleBound);
-  }
-
-  /** Construct rates for the rest of the packets in the batch. */
-  FindRatesForBatch(n_no_sampling, rate_arr, n);
+  (this->*decide_)(transmit_mode, coherence_time, pkt_size, extra_time, k, n, rate_arr, is_duplicate);
 }
 
 void ScoutRateAdaptation::SetLossRates(Laptop laptop, const vector<uint16_t> &rate_arr, const vector<double> &loss_arr) {
   LossMap *loss_map;
   assert(rate_arr.size() == loss_arr.size());
-  size_t sz = rate_arr.size();
 
   switch (laptop) {
     case kFront:
@@ -202,10 +198,7 @@ void ScoutRateAdaptation::SetLossRates(Laptop laptop, const vector<uint16_t> &ra
       assert(0);
   }
 
-  for (size_t i = 0; i < sz; i++) {
-    //printf("Insert rate[%u] loss[%g]\n", rate_arr[i], loss_arr[i]);
-    loss_map->UpdateLoss(rate_arr[i], loss_arr[i]);
-  }
+  loss_map->UpdateLosses(rate_arr, loss_arr);
 }
 
 void ScoutRateAdaptation::SetHighLoss() {
@@ -237,11 +230,9 @@ void ScoutRateAdaptation::CalcLossRates(Laptop laptop, const MonotonicTimer &sta
     Perror("ScoutRateAdaptation::CalcLossRates: invalid laptop type[%d]\n", laptop);
 
   bool is_available = feedback_rec->CalcLossRates(start, end, rate_arr_, loss_arr);
-  size_t sz = rate_arr_.size();
-  for (size_t i = 0; i < sz; i++) {
-    double loss = is_available ? loss_arr[i] : INVALID_LOSS_RATE;
-    loss_map->UpdateLoss(rate_arr_[i], loss, kPrevWeight);
-  }
+  if (!is_available)
+    loss_arr.assign(rate_arr_.size(), INVALID_LOSS_RATE);
+  loss_map->UpdateLosses(rate_arr_, loss_arr, kPrevWeight);
 }
 
 void ScoutRateAdaptation::CalcLossRates(const MonotonicTimer &front_window, const MonotonicTimer &back_window) {
@@ -256,65 +247,61 @@ void ScoutRateAdaptation::CalcLossRates(const MonotonicTimer &front_window, cons
     MonotonicTimer time_same_loc = now - MonotonicTimer((long long)(lookup_duration * 1e9));
     MonotonicTimer start = time_same_loc - front_window/2;
     MonotonicTimer end = time_same_loc + front_window/2;
-    printf("CalcLossRates: dist[%.3f] speed[%.3f] lookup[%.3fs] now[%.3f] time_same_loc[%.3f] start[%.3f] end[%.3f]\n", 
-    kAntennaDist, speed_, lookup_duration, now.GetMSec(), time_same_loc.GetMSec(), start.GetMSec(), end.GetMSec());
+    /*printf("CalcLossRates: dist[%.3f] speed[%.3f] lookup[%.3fs] now[%.3f] time_same_loc[%.3f] start[%.3f] end[%.3f]\n", 
+    kAntennaDist, speed_, lookup_duration, now.GetMSec(), time_same_loc.GetMSec(), start.GetMSec(), end.GetMSec());*/
     is_available = feedback_rec_front_.CalcLossRates(start, end, rate_arr_, loss_arr, is_print);
   }
-  size_t sz = rate_arr_.size();
-  for (size_t i = 0; i < sz; i++) {
-    double loss = is_available ? loss_arr[i] : INVALID_LOSS_RATE;
-    loss_map_scout_.UpdateLoss(rate_arr_[i], loss, kPrevWeight);
-  }
+  if (!is_available)
+    loss_arr.assign(rate_arr_.size(), INVALID_LOSS_RATE);
+  loss_map_scout_.UpdateLosses(rate_arr_, loss_arr, kPrevWeight);
 
-  is_available = feedback_rec_back_.FindSuccessRates(now - back_window, now, feasible_rates_);
+  vector<uint16_t> feasible_rates;
+  is_available = feedback_rec_back_.FindSuccessRates(now - back_window, now, feasible_rates);
   if (!is_available)
-    feasible_rates_ = rate_arr_;  /** No stats available so we can try all the data rates.*/
+    feasible_rates = rate_arr_;  /** No stats available so we can try all the data rates.*/
+  if (feasible_rates != feasible_rates_) {
+    feasible_rates_.swap(feasible_rates);
+    feasible_version_++;
+  }
 }
 
-void ScoutRateAdaptation::CalcLossRatesAfterCombine() {
-  double loss = INVALID_LOSS_RATE;
-  double loss_front = INVALID_LOSS_RATE;
-  double loss_front_delay = INVALID_LOSS_RATE;
-  double loss_back = INVALID_LOSS_RATE;
-  double kWeightCombine = -1.0;
-
-  ConfigLossLookUp();
-
-  //printf("front_window[%.3fms] back_window[%.3fms]\n", front_window().GetMSec(), back_window().GetMSec());
-  if (combine_mode() == kScoutCombine)
-    CalcLossRates(front_window(), back_window());  /** For location-based lookup.*/
+uint64_t ScoutRateAdaptation::DecisionVersion() const {
+  /** All the counters only grow, so does their sum. */
+  return (uint64_t)loss_map_front_.version() + loss_map_back_.version() + loss_map_scout_.version() + 
+         feasible_version_ + config_version_;
+}
 
-  for (size_t i = 0; i < rate_arr_.size(); i++) {
-    uint16_t rate = rate_arr_[i];
-    switch(combine_mode()) {
-      case kFrontOnly:
-        loss = loss_map_front_.GetLossRate(rate);
-        break;
-
-      case kBackOnly:
-        loss = loss_map_back_.GetLossRate(rate);
-        break;
-
-      case kDelayCombine:
-        loss_front = loss_map_front_.GetLossRate(rate);
-        loss_back = loss_map_back_.GetLossRate(rate);
-        loss = CalcLossRatesFrontBack(loss_front, loss_back);
-        break;
-
-      case kScoutCombine:
-        loss_front = loss_map_scout_.GetLossRate(rate);
-        loss_front_delay = loss_map_front_.GetLossRate(rate);
-        loss_back = loss_map_back_.GetLossRate(rate);
-        loss = CalcLossRatesFrontBack(max(loss_front, loss_front_delay), loss_back);
-        break;
-
-      default: 
-        assert(0);
-    }
+const ScoutRateAdaptation::Decision* ScoutRateAdaptation::FindDecision(const DecisionKey &key) {
+  uint64_t version = DecisionVersion();
+  if (version != decision_version_) {
+    num_decisions_ = next_decision_ = 0;
+    decision_version_ = version;
+    return NULL;
+  }
+  for (int i = 0; i < num_decisions_; i++) {
+    const DecisionKey &cached = decisions_[i].key;
+    if (cached.mode == key.mode && cached.coherence_time == key.coherence_time && 
+        cached.pkt_size == key.pkt_size && cached.extra_time == key.extra_time && 
+        cached.k == key.k && cached.rate == key.rate)
+      return &decisions_[i];
+  }
+  return NULL;
+}
 
-    //printf("UpdateLoss: rate[%u] loss_front[%g] loss_back[%g] loss[%g]\n", rate, loss_front, loss_back, loss);
-    loss_map_combine_.UpdateLoss(rate, loss, kWeightCombine);
+void ScoutRateAdaptation::SaveDecision(const Decision &decision) {
+  /** The decision read the maps of decision_version_, unless feedback came in meanwhile. */
+  if (DecisionVersion() != decision_version_) {
+    num_decisions_ = next_decision_ = 0;
+    return;
   }
+  decisions_[next_decision_] = decision;
+  next_decision_ = (next_decision_ + 1) % kNumCachedDecisions;
+  if (num_decisions_ < kNumCachedDecisions)
+    num_decisions_++;
+}
+
+void ScoutRateAdaptation::CalcLossRatesAfterCombine() {
+  (this->*calc_loss_after_combine_)();
 }
 
 bool ScoutRateAdaptation::IsHighLoss() {
@@ -353,63 +340,6 @@ void ScoutRateAdaptation::PrintLossRatesAfterCombine() {
   PrintLossRates(kAfterCombine);
 }
 
-void ScoutRateAdaptation::ConfigLossLookUp() {
-  switch(rate_adapt_version()) {
-    case kSampleRate:
-
-    case kRRAA:
-
-    case kFixed:
-      set_combine_mode(kBackOnly);
-      break;
-
-    case kBatchSeq:
-
-    case kBatchRandom:
-      set_combine_mode(kDelayCombine);
-      //set_combine_mode(kBackOnly);
-      break;
-
-    case kScoutSeq:
-    
-    case kScoutRandom:
-
-    case kScoutBoundLossSeq:
-
-    case kScoutBoundLossRandom:
-      set_combine_mode(kScoutCombine);
-      break;
-      
-    default: 
-      assert(0);
-  }
-
-  //PrintCombineMode();
-}
-
-void ScoutRateAdaptation::ConfigSampleMode() {
-  switch(rate_adapt_version()) {
-    case kBatchSeq:
-
-    case kScoutSeq:
-
-    case kScoutBoundLossSeq:
-      set_sample_mode(kSequential);
-      break;
-
-    case kBatchRandom:
-
-    case kScoutRandom:
-
-    case kScoutBoundLossRandom:
-      set_sample_mode(kRandom);
-      break;
-
-    default: 
-      set_sample_mode(kNoSample);
-  }
-}
-
 void ScoutRateAdaptation::PrintLossRates(Laptop laptop) {
   LossMap *loss_map;
   if (laptop == kFront) {
@@ -446,90 +376,15 @@ void ScoutRateAdaptation::PrintFeedbackRecords(Laptop laptop) {
   feedback_rec->PrintRecords();
 }
 
-void ScoutRateAdaptation::ApplyRate() {
-  int case_num;
-  switch (rate_adapt_version_) {
-    case kSampleRate:
-
-    case kRRAA:
-      rate_ = rate_adapt_baseline_->ApplyRate(case_num);
-      break;
-
-    case kFixed:  /** Use the rate set initially. */
-      break;
-
-    case kBatchSeq:
-
-    case kBatchRandom:
-
-    case kScoutSeq:
-
-    case kScoutRandom:
-      ApplyRateScout();
-      break;
-
-    case kScoutBoundLossSeq:
-
-    case kScoutBoundLossRandom:
-      ApplyRateScout(loss_bound());
-      break;
-
-    default:
-      Perror("ScoutRateAdaptation::ApplyRate invalid version number!\n");
-  }
-}
-
-void ScoutRateAdaptation::FindRatesForBatch(int num_data_pkts, vector<uint16_t> &rate_arr, int &num_coded_pkts) {
-  uint16_t rate = 10;
-  int case_num;
-  rate_arr.clear();
-  switch (rate_adapt_version()) {
-    case kSampleRate:
-
-    case kRRAA:
-      rate_arr.push_back(rate_);
-      for (int i = 1; i < num_data_pkts; i++) {
-        rate = rate_adapt_baseline_->ApplyRate(case_num);
-        rate_arr.push_back(rate);
-      }
-      break;
-
-    case kFixed:
-      for (int i = 0; i < num_data_pkts; i++)
-        rate_arr.push_back(rate_);
-      break;
-
-    case kBatchSeq:
-
-    case kBatchRandom:
-
-    case kScoutSeq:
-
-    case kScoutRandom:
-
-    case kScoutBoundLossSeq:
-
-    case kScoutBoundLossRandom:
-      for (int i = 0; i < num_data_pkts; i++)
-        rate_arr.push_back(rate_);
-      for (size_t i = 0; i < sample_rates_.size(); i++) 
-        rate_arr.push_back(sample_rates_[i]);
-      sort(rate_arr.begin(), rate_arr.end());
-      break;
-      
-    default: 
-      assert(0);
-  }
-  num_coded_pkts = rate_arr.size();
-}
-
 void ScoutRateAdaptation::ApplyRateScout(double loss_thresh) {
   vector<double> throughput_arr;
   size_t sz = rate_arr_.size();
+  LossMap::Table combine;
+  loss_map_combine_.GetSnapshot(&combine);
 
   for (size_t i = 0; i < sz; i++) {
     uint16_t rate_tmp = rate_arr_[i];
-    double loss = loss_map_combine_.GetLossRate(rate_tmp);
+    double loss = combine[rate_tmp].loss;
     double throughput = -1.0;
     if (loss == -1.0) {
       if (rate_tmp > rate_)
@@ -557,40 +412,6 @@ void ScoutRateAdaptation::ApplyRateScout(double loss_thresh) {
   rate_ = rate_arr_[max_ind];
 }
 
-void ScoutRateAdaptation::SampleRates(int num_sample_rates, int bound) {
-  sample_rates_.clear();
-  if (num_sample_rates == 0)
-    return;
-
-  ConfigSampleMode();
-  
-  int start_ind = rate_ind() + 1; /** Sample data rates higher than the current rate.*/
-
-  switch(sample_mode()) {
-    case kNoSample:
-      return;
-
-    case kSequential:
-      SampleRatesSequential(start_ind, num_sample_rates);
-      break;
-
-    case kRandom:
-      SampleRatesRandom(start_ind, num_sample_rates, bound);
-      break;
-
-    default:
-      assert(0);
-  }
-
-  /** Make sure we have enough protection for the highest data rates.*/
-  int sample_left = num_sample_rates - sample_rates_.size();
-  if (sample_left) {
-    int sample_ind = max(start_ind - 2, 0);  /** Rate lower than the current selected rate.*/
-    for (int i = 0; i < sample_left; i++) 
-      sample_rates_.push_back(rate_arr_[sample_ind]);
-  }
-}
-
 void ScoutRateAdaptation::SampleRatesSequential(int start_ind, int num_sample_rates) {
   size_t sz = rate_arr_.size();
   sample_rates_.clear();
@@ -759,7 +580,7 @@ void ScoutRateAdaptation::ApplyFECForTimeOut(int k, int &n) {
 }
 
 void ScoutRateAdaptation::ApplyFECForRetransmission(uint32_t coherence_time/*us*/, uint16_t pkt_size,
-              uint32_t extra_time, int k, int &n) {
+              uint32_t extra_time, int &k, int &n) {
   /** If loss = -1 (no information) for this data rate.*/
   static const double kStartRedundancy = 0.8;    
   /** Extra redundancy to handle bursty loss.*/
@@ -771,7 +592,12 @@ void ScoutRateAdaptation::ApplyFECForRetransmission(uint32_t coherence_time/*us*
   int n_no_extra_redundancy = -1;
   uint32_t pkt_duration = pkt_size * 8.0 / (rate_/10.) + extra_time;
   const int kMaxN = min(int(coherence_time/pkt_duration), kGFSize);
-  assert(k > 0 && k <= kMaxN && k <= kMaxK);  /** Actually k should be 1 for retransmission case only.*/
+  /** Code as many of the lost packets together as fit in the coherence time. */
+  if (k > kMaxN)
+    k = kMaxN;
+  if (k > kMaxK)
+    k = kMaxK;
+  assert(k > 0 && k <= kMaxN && k <= kMaxK);
   if (!use_fec()) {
     n = k;
     //printf("ApplyFEC[Retrans] k[%d] n[%d] kMaxK[%d] kMaxN[%d]\n", k, n, kMaxK, kMaxN);
@@ -801,50 +627,6 @@ void ScoutRateAdaptation::ApplyFECForRetransmission(uint32_t coherence_time/*us*
   assert(n >= k && n <= kMaxN);
 }
   
-void ScoutRateAdaptation::PrintRateAdaptVersion() const {
-  printf("Rate adaptation version: ");
-  switch(rate_adapt_version()) {
-    case kSampleRate:
-      printf("Sample Rate\n");
-      break;
-
-    case kRRAA:
-      printf("RRAA\n");
-      break;
-
-    case kFixed:
-      printf("Fix rate\n");
-      break;
-
-    case kBatchSeq:
-      printf("Batch sequential\n");
-      break;
-
-    case kBatchRandom:
-      printf("Batch random\n");
-      break;
-
-    case kScoutSeq:
-      printf("Scout sequential\n");
-      break;
-
-    case kScoutRandom:
-      printf("Scout random\n");
-      break;
-
-    case kScoutBoundLossSeq:
-      printf("Scout bound loss sequential\n");
-      break;
-      
-    case kScoutBoundLossRandom:
-      printf("Scout bound loss random\n");
-      break;
-
-    default: 
-      assert(0);
-  }
-}
-
 void ScoutRateAdaptation::PrintCombineMode() const {
   printf("Combine mode: ");
   switch(combine_mode()) {
@@ -896,3 +678,240 @@ int ScoutRateAdaptation::GetRateInd(uint16_t rate) {
   else
     return int(it - rate_arr_.begin());
 }
+
+/** Rate adaptation variants, @see ScoutRateAdaptation::kVariants */
+
+/** Combine policies: the effective loss of a rate at the back antenna. */
+struct ScoutRateAdaptation::BackOnlyCombine {
+  static const CombineMode kMode = kBackOnly;
+  static const bool kLooksUpScout = false;
+  static double Loss(double loss_scout, double loss_front, double loss_back) { return loss_back; }
+};
+
+struct ScoutRateAdaptation::DelayCombine {
+  static const CombineMode kMode = kDelayCombine;
+  static const bool kLooksUpScout = false;
+  static double Loss(double loss_scout, double loss_front, double loss_back) { 
+    return CalcLossRatesFrontBack(loss_front, loss_back); 
+  }
+};
+
+struct ScoutRateAdaptation::ScoutCombine {
+  static const CombineMode kMode = kScoutCombine;
+  static const bool kLooksUpScout = true;  /** Location-based lookup of the front records. */
+  static double Loss(double loss_scout, double loss_front, double loss_back) { 
+    return CalcLossRatesFrontBack(max(loss_scout, loss_front), loss_back); 
+  }
+};
+
+/** Sample policies: which rates above the current one to probe in a batch. */
+struct ScoutRateAdaptation::NoSample {
+  static const SampleMode kMode = kNoSample;
+  static void Sample(ScoutRateAdaptation *rate_maker, int start_ind, int num_sample_rates, int bound) {}
+};
+
+struct ScoutRateAdaptation::SequentialSample {
+  static const SampleMode kMode = kSequential;
+  static void Sample(ScoutRateAdaptation *rate_maker, int start_ind, int num_sample_rates, int bound) {
+    rate_maker->SampleRatesSequential(start_ind, num_sample_rates);
+  }
+};
+
+struct ScoutRateAdaptation::RandomSample {
+  static const SampleMode kMode = kRandom;
+  static void Sample(ScoutRateAdaptation *rate_maker, int start_ind, int num_sample_rates, int bound) {
+    rate_maker->SampleRatesRandom(start_ind, num_sample_rates, bound);
+  }
+};
+
+/** 
+ * Rate policies: Apply() makes the rate decision for the first packet in the 
+ * batch, FindRatesForBatch() the rates of all of them.
+ */
+struct ScoutRateAdaptation::BaselineRate {
+  static const bool kUsesBaseline = true;  /** Its state moves with every decision, not cacheable. */
+  static void Apply(ScoutRateAdaptation *rate_maker) {
+    int case_num;
+    rate_maker->rate_ = rate_maker->rate_adapt_baseline_->ApplyRate(case_num);
+  }
+  static void FindRatesForBatch(ScoutRateAdaptation *rate_maker, int num_data_pkts, vector<uint16_t> &rate_arr) {
+    int case_num;
+    rate_arr.push_back(rate_maker->rate_);
+    for (int i = 1; i < num_data_pkts; i++)
+      rate_arr.push_back(rate_maker->rate_adapt_baseline_->ApplyRate(case_num));
+  }
+};
+
+struct ScoutRateAdaptation::FixedRate {
+  static const bool kUsesBaseline = false;
+  static void Apply(ScoutRateAdaptation *rate_maker) {}  /** Use the rate set initially. */
+  static void FindRatesForBatch(ScoutRateAdaptation *rate_maker, int num_data_pkts, vector<uint16_t> &rate_arr) {
+    rate_arr.assign(num_data_pkts, rate_maker->rate_);
+  }
+};
+
+struct ScoutRateAdaptation::ScoutRate {
+  static const bool kUsesBaseline = false;
+  static void Apply(ScoutRateAdaptation *rate_maker) { rate_maker->ApplyRateScout(); }
+  static void FindRatesForBatch(ScoutRateAdaptation *rate_maker, int num_data_pkts, vector<uint16_t> &rate_arr) {
+    rate_arr.assign(num_data_pkts, rate_maker->rate_);
+    rate_arr.insert(rate_arr.end(), rate_maker->sample_rates_.begin(), rate_maker->sample_rates_.end());
+    sort(rate_arr.begin(), rate_arr.end());
+  }
+};
+
+struct ScoutRateAdaptation::ScoutBoundLossRate : public ScoutRateAdaptation::ScoutRate {
+  static void Apply(ScoutRateAdaptation *rate_maker) { rate_maker->ApplyRateScout(rate_maker->loss_bound()); }
+};
+
+const ScoutRateAdaptation::Variant ScoutRateAdaptation::kVariants[] = {
+  {kSampleRate, "Sample Rate", &ScoutRateAdaptation::UseVariant<BackOnlyCombine, NoSample, BaselineRate>},
+  {kRRAA, "RRAA", &ScoutRateAdaptation::UseVariant<BackOnlyCombine, NoSample, BaselineRate>},
+  {kFixed, "Fix rate", &ScoutRateAdaptation::UseVariant<BackOnlyCombine, NoSample, FixedRate>},
+  {kBatchSeq, "Batch sequential", &ScoutRateAdaptation::UseVariant<DelayCombine, SequentialSample, ScoutRate>},
+  {kBatchRandom, "Batch random", &ScoutRateAdaptation::UseVariant<DelayCombine, RandomSample, ScoutRate>},
+  {kScoutSeq, "Scout sequential", &ScoutRateAdaptation::UseVariant<ScoutCombine, SequentialSample, ScoutRate>},
+  {kScoutRandom, "Scout random", &ScoutRateAdaptation::UseVariant<ScoutCombine, RandomSample, ScoutRate>},
+  {kScoutBoundLossSeq, "Scout bound loss sequential", 
+      &ScoutRateAdaptation::UseVariant<ScoutCombine, SequentialSample, ScoutBoundLossRate>},
+  {kScoutBoundLossRandom, "Scout bound loss random", 
+      &ScoutRateAdaptation::UseVariant<ScoutCombine, RandomSample, ScoutBoundLossRate>},
+};
+
+void ScoutRateAdaptation::set_rate_adapt_version(const RateAdaptVersion &version) { 
+  const Variant *variant = NULL;
+  for (size_t i = 0; i < sizeof(kVariants) / sizeof(kVariants[0]); i++) {
+    if (kVariants[i].version == version)
+      variant = &kVariants[i];
+  }
+  if (!variant)
+    Perror("ScoutRateAdaptation::set_rate_adapt_version invalid version number[%d]!\n", version);
+  rate_adapt_version_ = version; 
+  variant_ = variant;
+  (this->*variant->use)();
+  config_version_++;
+}
+
+void ScoutRateAdaptation::PrintRateAdaptVersion() const {
+  printf("Rate adaptation version: %s\n", variant_->name);
+}
+
+template <class Combine, class Sample, class Rate>
+void ScoutRateAdaptation::UseVariant() {
+  combine_mode_ = Combine::kMode;
+  sample_mode_ = Sample::kMode;
+  use_baseline_ = Rate::kUsesBaseline;
+  if (use_baseline_ && !rate_adapt_baseline_)
+    rate_adapt_baseline_ = new RateAdaptation(rate_adapt_version_);
+  decide_ = &ScoutRateAdaptation::MakeDecisionWith<Combine, Sample, Rate>;
+  calc_loss_after_combine_ = &ScoutRateAdaptation::CalcLossRatesAfterCombineWith<Combine>;
+}
+
+template <class Combine, class Sample, class Rate>
+void ScoutRateAdaptation::MakeDecisionWith(TransmitMode transmit_mode, uint32_t coherence_time, 
+            uint16_t pkt_size, uint32_t extra_time, 
+          int &k, int &n, vector<uint16_t> &rate_arr, bool &is_duplicate) {
+  int n_no_sampling = -1;
+  bool is_high_loss = false;
+
+  if (transmit_mode != kTimeOut) {
+    if (Combine::kLooksUpScout)
+      CalcLossRates(front_window(), back_window());  /** For location-based lookup.*/
+
+    /** 
+     * Reuse the last decision for the same batch if no feedback or setting 
+     * changed since, only the sampling below is drawn again.
+     */
+    DecisionKey key = {transmit_mode, coherence_time, pkt_size, extra_time, k, rate_};
+    const Decision *decision = Rate::kUsesBaseline ? NULL : FindDecision(key);
+    if (decision) {
+      rate_ = decision->rate;
+      k = decision->k;
+      n_no_sampling = decision->n_no_sampling;
+      is_high_loss = decision->is_high_loss;
+    }
+    else {
+      /** Figure out the effective loss rates after packet combining.*/
+      CombineLossRatesWith<Combine>();
+      //PrintLossRatesAfterCombine();
+
+      /** Make rate decision for the first packet in the batch.*/
+      Rate::Apply(this);
+
+      /** Apply FEC. */
+      ApplyFEC(transmit_mode, coherence_time, pkt_size, extra_time, k, n_no_sampling);
+      is_high_loss = IsHighLoss();
+      if (!Rate::kUsesBaseline) {
+        Decision new_decision = {key, rate_, k, n_no_sampling, is_high_loss};
+        SaveDecision(new_decision);
+      }
+    }
+  }
+  else {
+    /** Apply FEC. */
+    ApplyFEC(transmit_mode, coherence_time, pkt_size, extra_time, k, n_no_sampling);
+    is_high_loss = IsHighLoss();
+  }
+  
+  /** Decide whether to offload to cellular. */
+  if (enable_duplicate() && (is_high_loss || transmit_mode == kRetrans || IsBootstrapping()))
+    is_duplicate = true;
+  else
+    is_duplicate = false;
+
+  if (is_duplicate) {
+    n_no_sampling = k; /** Don't slow down the cellular link.*/
+    SampleRatesWith<Sample>(1, kSampleBound);  /** Don't waste time to sample higher data rates.*/
+  }
+  else {
+    SampleRatesWith<Sample>(kNumSampleRates, kSampleBound);
+  }
+
+  /** Construct rates for the rest of the packets in the batch. */
+  rate_arr.clear();
+  Rate::FindRatesForBatch(this, n_no_sampling, rate_arr);
+  n = rate_arr.size();
+}
+
+template <class Combine>
+void ScoutRateAdaptation::CalcLossRatesAfterCombineWith() {
+  if (Combine::kLooksUpScout)
+    CalcLossRates(front_window(), back_window());  /** For location-based lookup.*/
+  CombineLossRatesWith<Combine>();
+}
+
+template <class Combine>
+void ScoutRateAdaptation::CombineLossRatesWith() {
+  double kWeightCombine = -1.0;
+
+  /** One snapshot of each map, so all the rates combine the same updates. */
+  LossMap::Table front, back, scout;
+  loss_map_front_.GetSnapshot(&front);
+  loss_map_back_.GetSnapshot(&back);
+  loss_map_scout_.GetSnapshot(&scout);
+  vector<double> loss_arr(rate_arr_.size());
+  for (size_t i = 0; i < rate_arr_.size(); i++) {
+    uint16_t rate = rate_arr_[i];
+    loss_arr[i] = Combine::Loss(scout[rate].loss, front[rate].loss, back[rate].loss);
+    //printf("UpdateLoss: rate[%u] loss_front[%g] loss_back[%g] loss[%g]\n", rate, front[rate].loss, back[rate].loss, loss_arr[i]);
+  }
+  loss_map_combine_.UpdateLosses(rate_arr_, loss_arr, kWeightCombine);
+}
+
+template <class Sample>
+void ScoutRateAdaptation::SampleRatesWith(int num_sample_rates, int bound) {
+  sample_rates_.clear();
+  if (num_sample_rates == 0 || Sample::kMode == kNoSample)
+    return;
+
+  int start_ind = rate_ind() + 1; /** Sample data rates higher than the current rate.*/
+  Sample::Sample(this, start_ind, num_sample_rates, bound);
+
+  /** Make sure we have enough protection for the highest data rates.*/
+  int sample_left = num_sample_rates - sample_rates_.size();
+  if (sample_left) {
+    int sample_ind = max(start_ind - 2, 0);  /** Rate lower than the current selected rate.*/
+    for (int i = 0; i < sample_left; i++) 
+      sample_rates_.push_back(rate_arr_[sample_ind]);
+  }
+}
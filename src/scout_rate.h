@@ -2,6 +2,7 @@
 #define SCOUT_RATE_H_
 
 #include <map>
+#include <atomic>
 #include <algorithm>
 #include <iostream>
 
@@ -25,39 +26,64 @@ struct LossInfo {
   double loss;
 };
 
+/**
+ * Loss rate of each data rate, published as a whole under a seqlock: writers
+ * build the next table from the current one and publish every rate of an 
+ * update at once, readers copy a consistent table without taking any lock
+ * and retry if a writer got in between.
+ */
 class LossMap {
  public:
+  typedef RateArray<LossInfo> Table;
+
   LossMap(const int *rate_arr, int num_rates);
   ~LossMap();
 
   /**
-   * Update the key of the map.
+   * Update the loss rates of the given data rates, published together.
    * Note: Locking is included.
    * @previous_weight: the weight for the history.
    */
+  void UpdateLosses(const std::vector<uint16_t> &rates, const std::vector<double> &losses, 
+                    double previous_weight = -1);
+
+  /** Update one data rate, @see UpdateLosses(). */
   void UpdateLoss(uint16_t rate, double loss, double previous_weight = -1);
 
   void UpdateSendCnt(uint16_t rate, uint32_t n_sent, uint32_t n_ack);
+
+  /** Copy the latest published table, lock-free. */
+  void GetSnapshot(Table *table) const;
   
   /**
    * Return the loss rate of a given data rate.
-   * Note: Locking is included.
+   * Lock-free, read from the latest snapshot.
    */
-  double GetLossRate(uint16_t rate);
+  double GetLossRate(uint16_t rate) const;
+
+  uint32_t GetNSent(uint16_t rate) const;
 
-  uint32_t GetNSent(uint16_t rate);
+  uint32_t GetNAck(uint16_t rate) const;
 
-  uint32_t GetNAck(uint16_t rate);
+  void Print() const;
 
-  void Print();
+  /** Bumped by every update that changes the table. */
+  uint32_t version() const { return seq_.load(std::memory_order_acquire); }
 
  private:
   void Lock() { Pthread_mutex_lock(&lock_); }
 
   void UnLock() { Pthread_mutex_unlock(&lock_); }
 
-  std::map<uint16_t, LossInfo> loss_map_; // Store the loss rate of each data rate.
-  pthread_mutex_t lock_;
+  /** Publish the next table, with the writer lock held. */
+  void Publish(const Table &table);
+
+  static void UpdateInfo(LossInfo &info, double loss, double previous_weight);
+
+  Table loss_map_; // Store the loss rate of each data rate.
+  RateArray<bool> has_rate_;     // Rates the map was built with.
+  std::atomic<uint32_t> seq_;    // Odd while a table is being published.
+  pthread_mutex_t lock_;         // Serializes the writers only.
 };
 
 class ScoutRateAdaptation {
@@ -101,17 +127,12 @@ class ScoutRateAdaptation {
 
   /**
    * Both coherence_time and extra_time are in us.
+   * For kRetrans, k is the number of retransmissions available on input and
+   * how many of them fit into one batch on output.
    */
   void MakeDecision(TransmitMode mode, uint32_t coherence_time, uint16_t pkt_size, uint32_t extra_time, 
       int &k, int &n, vector<uint16_t> &rate_arr, bool &is_duplicate);
 
-  /**
-   * Determine what loss rates to be used to determine FEC.
-   */
-  void ConfigLossLookUp();
-
-  void ConfigSampleMode();
-
   void SetLossRates(Laptop laptop, const vector<uint16_t> &rate_arr, const vector<double> &loss_arr);
 
   void SetHighLoss();
@@ -128,7 +149,7 @@ class ScoutRateAdaptation {
 
   void CalcLossRatesAfterCombine();
 
-  double CalcLossRatesFrontBack(double loss_front, double loss_back);
+  static double CalcLossRatesFrontBack(double loss_front, double loss_back);
 
   bool IsHighLoss();
 
@@ -138,22 +159,13 @@ class ScoutRateAdaptation {
 
   void PrintFeedbackRecords(Laptop laptop);
 
-  void ApplyRate();
-
-  /**
-   * Figure out what rates to sample next.
-   */
-  void SampleRates(int num_sample_rates, int bound);
-
-  void FindRatesForBatch(int num_data_pkts, vector<uint16_t> &rate_arr, int &num_coded_pkts);
-
   void ApplyFEC(const TransmitMode &mode, uint32_t coherence_time/*us*/, uint16_t pkt_size, uint32_t extra_time, int &k, int &n);
 
   void ApplyFECForData(uint32_t coherence_time/*us*/, uint16_t pkt_size, uint32_t extra_time, int &k, int &n);
 
   void ApplyFECForTimeOut(int k, int &n);
 
-  void ApplyFECForRetransmission(uint32_t coherence_time/*us*/, uint16_t pkt_size, uint32_t extra_time, int k, int &n);
+  void ApplyFECForRetransmission(uint32_t coherence_time/*us*/, uint16_t pkt_size, uint32_t extra_time, int &k, int &n);
 
   bool IsFeasible(uint16_t rate);
 
@@ -169,29 +181,28 @@ class ScoutRateAdaptation {
   void PrintCombineMode() const;
   void PrintSampleMode() const;
 
-  void set_use_fec(bool use_fec) { use_fec_ = use_fec; }
+  void set_use_fec(bool use_fec) { use_fec_ = use_fec; config_version_++; }
   bool use_fec() const { return use_fec_; }
 
   void set_speed(double speed) { speed_ = speed; }
   double speed() { return speed_; }
 
-  void set_combine_mode(const CombineMode &mode) { combine_mode_ = mode; }
+  /** Both set by the rate adaptation version. */
   CombineMode combine_mode() const { return combine_mode_; }
-
-  void set_sample_mode(const SampleMode &mode) { sample_mode_ = mode; }
   SampleMode sample_mode() const { return sample_mode_; }
 
   void set_rate(uint16_t rate) { rate_ = rate; }
   uint16_t rate() const { return rate_; }
-  int rate_ind() { return rate_ind_map_[rate_]; }
+  int rate_ind() { return rate_ind_tbl_[rate_]; }
 
+  /** Perror if the version has no row in kVariants. */
   void set_rate_adapt_version(const RateAdaptVersion &version);
   RateAdaptVersion rate_adapt_version() const { return rate_adapt_version_; }
 
-  void set_duplicate_thresh(double duplicate_thresh) { duplicate_thresh_ = duplicate_thresh; }
+  void set_duplicate_thresh(double duplicate_thresh) { duplicate_thresh_ = duplicate_thresh; config_version_++; }
   double duplicate_thresh() const { return duplicate_thresh_; }
 
-  void set_loss_bound(double loss_bound) { loss_bound_ = loss_bound; }
+  void set_loss_bound(double loss_bound) { loss_bound_ = loss_bound; config_version_++; }
   double loss_bound() const { return loss_bound_; }
 
   void set_enable_duplicate(bool enable_duplicate) { enable_duplicate_ = enable_duplicate; }
@@ -207,6 +218,60 @@ class ScoutRateAdaptation {
 
 
  private:
+  /**
+   * A rate adaptation variant is put together from three policies, stateless
+   * structs of static members defined in scout_rate.cc: a combine policy for
+   * the loss rates of the front and back antennas, a sample policy for the 
+   * higher rates probed along a batch and a rate policy for the rates of the 
+   * batch. The decision path is a template instantiated once per variant and
+   * picked by set_rate_adapt_version(), so a batch goes through no switch on 
+   * the version. A new variant is a new row in kVariants, plus policies of 
+   * its own if none of these fit.
+   */
+  struct BackOnlyCombine;
+  struct DelayCombine;
+  struct ScoutCombine;
+  struct NoSample;
+  struct SequentialSample;
+  struct RandomSample;
+  struct BaselineRate;
+  struct FixedRate;
+  struct ScoutRate;
+  struct ScoutBoundLossRate;
+
+  typedef void (ScoutRateAdaptation::*DecideFn)(TransmitMode mode, uint32_t coherence_time, uint16_t pkt_size, 
+      uint32_t extra_time, int &k, int &n, vector<uint16_t> &rate_arr, bool &is_duplicate);
+  typedef void (ScoutRateAdaptation::*CalcLossFn)();
+
+  struct Variant {
+    RateAdaptVersion version;
+    const char *name;
+    void (ScoutRateAdaptation::*use)();  /** Switches this instance over to the variant. */
+  };
+  static const Variant kVariants[];
+
+  template <class Combine, class Sample, class Rate> 
+  void UseVariant();
+
+  /** @see MakeDecision() */
+  template <class Combine, class Sample, class Rate> 
+  void MakeDecisionWith(TransmitMode mode, uint32_t coherence_time, uint16_t pkt_size, uint32_t extra_time, 
+      int &k, int &n, vector<uint16_t> &rate_arr, bool &is_duplicate);
+
+  /** @see CalcLossRatesAfterCombine() */
+  template <class Combine> 
+  void CalcLossRatesAfterCombineWith();
+
+  /** Fill loss_map_combine_ from the front, back and scout loss maps. */
+  template <class Combine> 
+  void CombineLossRatesWith();
+
+  /**
+   * Figure out what rates to sample next.
+   */
+  template <class Sample> 
+  void SampleRatesWith(int num_sample_rates, int bound);
+
   const MonotonicTimer & front_window() const { return front_window_; }
   const MonotonicTimer & back_window() const { return back_window_; }
 
@@ -220,6 +285,36 @@ class ScoutRateAdaptation {
    */
   void ApplyRateScout(double loss_thresh=1.5);
 
+  /** Inputs of a batch decision other than the loss state. */
+  struct DecisionKey {
+    TransmitMode mode;
+    uint32_t coherence_time;
+    uint16_t pkt_size;
+    uint32_t extra_time;
+    int k;          /** Retransmissions available for kRetrans. */
+    uint16_t rate;  /** The rate before the decision. */
+  };
+
+  /** A batch decision before the rates to sample are drawn. */
+  struct Decision {
+    DecisionKey key;
+    uint16_t rate;
+    int k;
+    int n_no_sampling;
+    bool is_high_loss;
+  };
+
+  /** 
+   * Changes with anything the cached decisions depend on: the loss maps, 
+   * the feasible rates and the settings.
+   */
+  uint64_t DecisionVersion() const;
+
+  /** @return the cached decision for key, NULL if there is none for the current version. */
+  const Decision* FindDecision(const DecisionKey &key);
+
+  void SaveDecision(const Decision &decision);
+
   /**
    * Either sample the sequentially higher data rates or
    * perform random sampling,
@@ -234,6 +329,10 @@ class ScoutRateAdaptation {
   const int kMaxK;    /** Need this parameter to limit the header overhead and set MTU properly. */
   uint16_t rate_;     /** Track the current rate decision.*/
   RateAdaptVersion rate_adapt_version_; 
+  const Variant *variant_;
+  DecideFn decide_;                  /** MakeDecisionWith() of the variant. */
+  CalcLossFn calc_loss_after_combine_;
+  bool use_baseline_;                /** rate_adapt_baseline_ learns from the back feedback. */
   CombineMode combine_mode_;
   SampleMode sample_mode_;
   bool use_fec_;
@@ -247,7 +346,14 @@ class ScoutRateAdaptation {
   double duplicate_thresh_;  /** Threshshold for the loss rate, beyond which the duplicating should happen. */
   double loss_bound_;
   bool enable_duplicate_;   /** Enable duplicating packets over the cellular. */
-  std::map<uint16_t, int> rate_ind_map_;
+  RateArray<int> rate_ind_tbl_;   /** Position of each rate in rate_arr_, -1 if not a candidate. */
+
+  static const int kNumCachedDecisions = 4;
+  Decision decisions_[kNumCachedDecisions];  /** Valid for decision_version_ only. */
+  int num_decisions_, next_decision_;
+  uint64_t decision_version_;
+  uint32_t feasible_version_;  /** Bumped when feasible_rates_ changes. */
+  uint32_t config_version_;    /** Bumped by the setters the decisions depend on. */
 };
 
 template <class T>
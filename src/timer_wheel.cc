@@ -0,0 +1,137 @@
+#include "timer_wheel.h"
+
+TimerWheel::TimerWheel(uint32_t capacity, int tick_us)
+    : capacity_(capacity), tick_us_(tick_us), curr_tick_(NowUs() / tick_us), size_(0) {
+  assert(capacity > 0 && tick_us > 0);
+  for (int i = 0; i < kNumLevels * kNumSlots; i++)
+    heads_[i] = -1;
+  next_ = new int32_t[capacity];
+  prev_ = new int32_t[capacity];
+  bucket_ = new int32_t[capacity];
+  expire_tick_ = new int64_t[capacity];
+  for (uint32_t i = 0; i < capacity; i++) {
+    next_[i] = prev_[i] = bucket_[i] = -1;
+    expire_tick_[i] = 0;
+  }
+}
+
+TimerWheel::~TimerWheel() {
+  delete[] next_;
+  delete[] prev_;
+  delete[] bucket_;
+  delete[] expire_tick_;
+}
+
+void TimerWheel::Schedule(uint32_t id, int64_t expire_us) {
+  assert(id < capacity_);
+  if (IsScheduled(id))
+    Unlink(id);
+  else
+    size_++;
+  /** Round up so that the timer never fires early. */
+  expire_tick_[id] = (expire_us + tick_us_ - 1) / tick_us_;
+  Insert(id);
+}
+
+void TimerWheel::Cancel(uint32_t id) {
+  assert(id < capacity_);
+  if (IsScheduled(id)) {
+    Unlink(id);
+    size_--;
+  }
+}
+
+void TimerWheel::Insert(uint32_t id) {
+  int64_t tick = expire_tick_[id] < curr_tick_ ? curr_tick_ : expire_tick_[id];
+  int64_t delta = tick - curr_tick_;
+  int level = 0;
+  while (level < kNumLevels - 1 && delta >= (1LL << (kSlotBits * (level + 1))))
+    level++;
+  if (delta >= (1LL << (kSlotBits * kNumLevels)))  /** Beyond the wheel, park it in the last bucket. */
+    tick = curr_tick_ + (1LL << (kSlotBits * kNumLevels)) - 1;
+  int b = level * kNumSlots + ((tick >> (kSlotBits * level)) & kSlotMask);
+  bucket_[id] = b;
+  prev_[id] = -1;
+  next_[id] = heads_[b];
+  if (heads_[b] >= 0)
+    prev_[heads_[b]] = id;
+  heads_[b] = id;
+}
+
+void TimerWheel::Unlink(uint32_t id) {
+  int b = bucket_[id];
+  if (prev_[id] >= 0)
+    next_[prev_[id]] = next_[id];
+  else
+    heads_[b] = next_[id];
+  if (next_[id] >= 0)
+    prev_[next_[id]] = prev_[id];
+  bucket_[id] = next_[id] = prev_[id] = -1;
+}
+
+void TimerWheel::Cascade(int level) {
+  int b = level * kNumSlots + ((curr_tick_ >> (kSlotBits * level)) & kSlotMask);
+  int32_t id = heads_[b];
+  heads_[b] = -1;
+  while (id >= 0) {
+    int32_t next = next_[id];
+    Insert(id);
+    id = next;
+  }
+}
+
+void TimerWheel::Expire(int64_t now_us, std::vector<uint32_t> *expired) {
+  int64_t now_tick = now_us / tick_us_;
+  while (curr_tick_ <= now_tick) {
+    if (size_ == 0) {  /** Nothing to fire, skip the idle ticks. */
+      curr_tick_ = now_tick + 1;
+      break;
+    }
+    /** Entering a new turn of a level: pull its next bucket down, the upper levels first. */
+    for (int level = kNumLevels - 1; level > 0; level--) {
+      if ((curr_tick_ & ((1LL << (kSlotBits * level)) - 1)) == 0)
+        Cascade(level);
+    }
+    int b = curr_tick_ & kSlotMask;
+    int32_t id = heads_[b];
+    while (id >= 0) {
+      int32_t next = next_[id];
+      Unlink(id);
+      if (expire_tick_[id] <= curr_tick_) {
+        expired->push_back(id);
+        size_--;
+      }
+      else {  /** Parked beyond the wheel. */
+        Insert(id);
+      }
+      id = next;
+    }
+    curr_tick_++;
+  }
+}
+
+int64_t TimerWheel::NextExpiry() const {
+  if (size_ == 0)
+    return -1;
+  int64_t next_tick = -1;
+  for (int level = 0; level < kNumLevels; level++) {
+    int shift = kSlotBits * level;
+    int64_t base = curr_tick_ >> shift;
+    /**
+     * Unless curr_tick_ starts a new turn of the level, the current bucket of
+     * an upper level was cascaded already and only holds the next turn.
+     */
+    int first = (level > 0 && (curr_tick_ & ((1LL << shift) - 1))) ? 1 : 0;
+    for (int i = first; i < first + kNumSlots; i++) {
+      if (heads_[level * kNumSlots + ((base + i) & kSlotMask)] >= 0) {
+        int64_t tick = (base + i) << shift;
+        if (tick < curr_tick_)
+          tick = curr_tick_;
+        if (next_tick < 0 || tick < next_tick)
+          next_tick = tick;
+        break;
+      }
+    }
+  }
+  return next_tick * tick_us_;
+}
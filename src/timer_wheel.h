@@ -0,0 +1,79 @@
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+#include <vector>
+
+/**
+ * Hierarchical timing wheel over a fixed set of timer ids [0, capacity),
+ * e.g. the slots of a TxDataBuf. Level 0 has kNumSlots buckets of one tick,
+ * each upper level kNumSlots buckets of a whole turn of the level below;
+ * timers cascade down as the wheel turns. Arming and disarming a timer is
+ * O(1), Expire costs O(expired timers + elapsed ticks).
+ * A timer never fires early and at most one tick late.
+ * Not thread safe, the owner serializes the calls.
+ */
+class TimerWheel {
+ public:
+  /**
+   * @param capacity: number of timer ids.
+   * @param tick_us: resolution of the wheel in us.
+   */
+  TimerWheel(uint32_t capacity, int tick_us);
+  ~TimerWheel();
+
+  /** (Re)arm timer id to expire at expire_us, a NowUs() time. */
+  void Schedule(uint32_t id, int64_t expire_us);
+
+  /** Disarm timer id if it is armed. */
+  void Cancel(uint32_t id);
+
+  bool IsScheduled(uint32_t id) const { return bucket_[id] >= 0; }
+
+  /** Number of armed timers. */
+  uint32_t size() const { return size_; }
+
+  /**
+   * Turn the wheel up to now_us and disarm the timers expired by then.
+   * @param [out] expired: the ids of the expired timers are appended to it.
+   */
+  void Expire(int64_t now_us, std::vector<uint32_t> *expired);
+
+  /**
+   * @return a lower bound of the earliest expiry time of the armed timers,
+   * -1 if none is armed.
+   */
+  int64_t NextExpiry() const;
+
+  /** CLOCK_MONOTONIC time in us. */
+  static int64_t NowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+  }
+
+ private:
+  static const int kSlotBits = 6;
+  static const int kNumSlots = 1 << kSlotBits;
+  static const int kSlotMask = kNumSlots - 1;
+  static const int kNumLevels = 3;
+
+  /** Link id into the bucket matching its expire tick. */
+  void Insert(uint32_t id);
+  void Unlink(uint32_t id);
+  /** Re-insert the timers of a bucket of an upper level into the levels below. */
+  void Cascade(int level);
+
+  const uint32_t capacity_;
+  const int tick_us_;
+  int64_t curr_tick_;            // Next tick to be processed by Expire.
+  uint32_t size_;
+  int32_t heads_[kNumLevels * kNumSlots];   // First id of each bucket, -1 if empty.
+  int32_t *next_, *prev_;        // Intrusive bucket lists indexed by id.
+  int32_t *bucket_;              // Bucket holding each id, -1 if not armed.
+  int64_t *expire_tick_;
+};
+
+#endif
@@ -0,0 +1,8 @@
+#include <time.h>
+#include "token_bucket.h"
+
+uint64_t TokenBucket::NowUs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
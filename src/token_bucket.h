@@ -0,0 +1,42 @@
+#ifndef TOKEN_BUCKET_H_
+#define TOKEN_BUCKET_H_
+
+#include <stdint.h>
+
+/**
+ * Token bucket of airtime pacing the datagrams of a channel. Each datagram 
+ * costs its own airtime, so the release rate follows the data rate each one 
+ * is sent at. The bucket holds up to burst_us of airtime: that is how far 
+ * the datagrams released may run ahead of the channel, i.e. the airtime 
+ * budget of the driver queue below. All times in us, CLOCK_MONOTONIC.
+ */
+class TokenBucket {
+ public:
+  TokenBucket() : burst_us_(0), next_us_(0) {}
+  ~TokenBucket() {}
+
+  static uint64_t NowUs();
+
+  /** Pacing is off while the burst is 0. */
+  bool is_enabled() const { return burst_us_ > 0; }
+
+  uint32_t burst_us() const { return burst_us_; }
+
+  void set_burst_us(uint32_t burst_us) { burst_us_ = burst_us; }
+
+  /** @return how long to hold the next datagram from now, 0 if it may go. */
+  uint32_t Delay(uint64_t now_us) const {
+    return next_us_ > now_us + burst_us_ ? next_us_ - now_us - burst_us_ : 0;
+  }
+
+  /** Take the airtime of a datagram released at now_us. */
+  void Consume(uint64_t now_us, uint32_t airtime_us) {
+    next_us_ = (next_us_ > now_us ? next_us_ : now_us) + airtime_us;
+  }
+
+ private:
+  uint32_t burst_us_;
+  uint64_t next_us_;    /** When the channel is done with the datagrams released. */
+};
+
+#endif
@@ -1,5 +1,46 @@
 #include "tun.h"
 
+static void* LaunchTxFlush(void* arg) {
+  return ((Tun*)arg)->TxFlush();
+}
+
+TxQueue::TxQueue() : head_(0), size_(0) {
+  Pthread_mutex_init(&lock_, NULL);
+  Pthread_cond_init(&space_cond_, NULL);
+  bufs_ = new char[TX_QUEUE_SIZE * PKT_SIZE];
+}
+
+TxQueue::~TxQueue() {
+  delete[] bufs_;
+  Pthread_mutex_destroy(&lock_);
+  Pthread_cond_destroy(&space_cond_);
+}
+
+void TxQueue::Push(const char *buf, uint16_t len, int client_id, uint32_t airtime_us) {
+  assert(size_ < TX_QUEUE_SIZE && len <= PKT_SIZE);
+  int ind = (head_ + size_) % TX_QUEUE_SIZE;
+  memcpy(bufs_ + ind * PKT_SIZE, buf, len);
+  lens_[ind] = len;
+  client_ids_[ind] = client_id;
+  airtimes_[ind] = airtime_us;
+  size_++;
+}
+
+char* TxQueue::Front(uint16_t *len, int *client_id, uint32_t *airtime_us) {
+  assert(size_ > 0);
+  *len = lens_[head_];
+  *client_id = client_ids_[head_];
+  if (airtime_us)
+    *airtime_us = airtimes_[head_];
+  return bufs_ + head_ * PKT_SIZE;
+}
+
+void TxQueue::Pop() {
+  assert(size_ > 0);
+  head_ = (head_ + 1) % TX_QUEUE_SIZE;
+  size_--;
+}
+
 int Tun::AllocTun(char *dev, int flags) {
   struct ifreq ifr;
   int fd, err;
@@ -38,6 +79,10 @@ void Tun::CreateAddr(const char *ip, int port, sockaddr_in *addr) {
 void Tun::Init() {
   InitSock();
   ObtainClientAddr();
+  if (wspace_pacer_.is_enabled() && (pace_timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+    perror("timerfd_create");
+  Pthread_create(&p_tx_flush_, NULL, LaunchTxFlush, this);
+  is_flush_running_ = true;
 }
 
 void Tun::BindSocket(int fd, sockaddr_in *addr) {
@@ -47,15 +92,29 @@ void Tun::BindSocket(int fd, sockaddr_in *addr) {
   if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&optval, sizeof(optval)) < 0)  
     perror("setsocketopt()");
 
+  if(fd == sock_fd_eth_ && num_rcv_shards_ > 1 && 
+     setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&optval, sizeof(optval)) < 0)  
+    perror("setsocketopt(SO_REUSEPORT)");
+
   if(bind(fd, (struct sockaddr*)addr, addr_len) < 0)  
     perror("ath bind()");
 }
 
 void Tun::InitSock() {
-  /* initialize tun/tap interface */
-  if ((tun_fd_ = AllocTun(if_name_, tun_type_ | IFF_NO_PI)) < 0 ) {
-    perror("Error connecting to tun/tap interface!");
+  /* initialize tun/tap interface, one fd per queue */
+  assert(num_tun_queues_ > 0 && num_tun_queues_ <= MAX_TUN_QUEUES);
+  int flags = tun_type_ | IFF_NO_PI;
+  if (num_tun_queues_ > 1)
+    flags |= IFF_MULTI_QUEUE;
+  for (int i = 0; i < num_tun_queues_; i++) {
+    if ((tun_fds_[i] = AllocTun(if_name_, flags)) < 0 ) {
+      perror("Error connecting to tun/tap interface!");
+    }
+    else if (fcntl(tun_fds_[i], F_SETFL, fcntl(tun_fds_[i], F_GETFL) | O_NONBLOCK) < 0) {
+      perror("fcntl(O_NONBLOCK) on tun");
+    }
   }
+  tun_fd_ = tun_fds_[0];
 
   // Create sockets
   sock_fd_eth_ = CreateSock();
@@ -68,6 +127,7 @@ void Tun::InitSock() {
   // Create client side address
   for(map<int, string>::iterator it = client_ip_tbl_.begin(); it != client_ip_tbl_.end(); ++it) {
     CreateAddr(it->second.c_str(), PORT_ETH, &client_addr_eth_tbl_[it->first]);
+    client_id_tbl_[inet_addr(it->second.c_str())] = it->first;
   }
 
   CreateAddr(controller_ip_eth_, port_eth_, &controller_addr_eth_); 
@@ -76,11 +136,107 @@ void Tun::InitSock() {
   BindSocket(sock_fd_eth_, &server_addr_eth_);
   BindSocket(sock_fd_ath_, &server_addr_ath_);
 
+  /** Additional receive shards join the reuseport group of sock_fd_eth_, in shard order. */
+  assert(num_rcv_shards_ > 0 && num_rcv_shards_ <= MAX_RCV_SHARDS);
+  sock_fd_rcv_[0] = sock_fd_eth_;
+  for (int i = 1; i < num_rcv_shards_; i++) {
+    int optval = 1;
+    sock_fd_rcv_[i] = CreateSock();
+    if(setsockopt(sock_fd_rcv_[i], SOL_SOCKET, SO_REUSEPORT, (char *)&optval, sizeof(optval)) < 0)  
+      perror("setsocketopt(SO_REUSEPORT)");
+    if(bind(sock_fd_rcv_[i], (struct sockaddr*)&server_addr_eth_, sizeof(struct sockaddr_in)) < 0)  
+      perror("eth shard bind()");
+  }
+  if (num_rcv_shards_ > 1 && !AttachShardProgram())
+    printf("Warning: fall back to the kernel hash for %d receive shards\n", num_rcv_shards_);
+
   int is_broadcast=1;
   if (setsockopt(sock_fd_ath_, SOL_SOCKET, SO_BROADCAST, &is_broadcast, sizeof(is_broadcast)) < 0) 
     perror("Error: InitSock set broadcast option fails!");
 }
 
+/** Number of instructions AppendLoadHostWord appends. */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+static const uint32_t kLoadHostWordLen = 1;
+#else
+static const uint32_t kLoadHostWordLen = 16;
+#endif
+
+/** 
+ * Append instructions leaving the host-order 32-bit word at offset off in A.
+ * BPF word loads are in network order, a little-endian host assembles the
+ * word byte by byte instead.
+ */
+static void AppendLoadHostWord(vector<struct sock_filter> &prog, uint32_t off) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  struct sock_filter ld = BPF_STMT(BPF_LD | BPF_W | BPF_ABS, off);
+  prog.push_back(ld);
+#else
+  for (int i = 3; i >= 0; i--) {
+    struct sock_filter ld = BPF_STMT(BPF_LD | BPF_B | BPF_ABS, off + i);
+    prog.push_back(ld);
+    if (i < 3) {
+      struct sock_filter ldx = BPF_STMT(BPF_LDX | BPF_MEM, 0);
+      struct sock_filter orx = BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0);
+      prog.push_back(ldx);
+      prog.push_back(orx);
+    }
+    if (i > 0) {
+      struct sock_filter lsh = BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8);
+      struct sock_filter st = BPF_STMT(BPF_ST, 0);
+      prog.push_back(lsh);
+      prog.push_back(st);
+    }
+  }
+#endif
+}
+
+bool Tun::AttachShardProgram() {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+  /** 
+   * ldb [0]; jeq type_i -> block_i; ...; ret #0
+   * block_i: A = client_id at offset_i; A %= num_rcv_shards_; ret A
+   * The packet data starts at the UDP payload.
+   */
+  static const uint32_t kBlockLen = kLoadHostWordLen + 2;
+  static const uint32_t kMaxJump = 255;  /** Conditional jump offsets are 8 bits. */
+  vector<struct sock_filter> prog;
+  struct sock_filter ld_type = BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0);
+  prog.push_back(ld_type);
+  uint32_t num_types = shard_key_tbl_.size(), i = 0;
+  if (num_types > 0 && 1 + (num_types - 1) * kBlockLen > kMaxJump) {
+    printf("AttachShardProgram: %u packet types don't fit into the jump offsets\n", num_types);
+    return false;
+  }
+  for (map<char, uint16_t>::iterator it = shard_key_tbl_.begin(); it != shard_key_tbl_.end(); ++it, ++i) {
+    uint32_t jt = (num_types - i - 1) + 1 + i * kBlockLen;
+    struct sock_filter jeq = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint8_t)it->first, (uint8_t)jt, 0);
+    prog.push_back(jeq);
+  }
+  struct sock_filter ret_zero = BPF_STMT(BPF_RET | BPF_K, 0);  /** No client id, e.g., CELL_DATA. */
+  prog.push_back(ret_zero);
+  for (map<char, uint16_t>::iterator it = shard_key_tbl_.begin(); it != shard_key_tbl_.end(); ++it) {
+    AppendLoadHostWord(prog, it->second);
+    struct sock_filter mod = BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)num_rcv_shards_);
+    struct sock_filter ret_a = BPF_STMT(BPF_RET | BPF_A, 0);
+    prog.push_back(mod);
+    prog.push_back(ret_a);
+  }
+  assert(prog.size() == 2 + num_types * (1 + kBlockLen));
+
+  struct sock_fprog fprog;
+  fprog.len = prog.size();
+  fprog.filter = &prog[0];
+  if (setsockopt(sock_fd_eth_, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog, sizeof(fprog)) < 0) {
+    perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
 void Tun::ObtainClientAddr() {
   /** Obtain client's ath address. */
   CreateAddr(broadcast_ip_ath_, port_ath_, &client_addr_ath_);
@@ -114,38 +270,242 @@ int Tun::CreateSock() {
   return sock_fd;
 }
 
-uint16_t Tun::Read(const IOType &type, char *buf, uint16_t len) {
-  uint16_t nread=-1;
+int Tun::Read(const IOType &type, char *buf, uint16_t len, int shard) {
+  int nread=-1;
   if (type == kTun)
     nread = cread(tun_fd_, buf, len);
   else if (type == kCellular)
-    nread = recvfrom(sock_fd_eth_, buf, len, 0, NULL, NULL);
+    nread = recvfrom(sock_fd_rcv_[shard], buf, len, 0, NULL, NULL);
   else if (type == kWspace)  /** All the uplink traffic should send over the cellular.*/
     assert(0);
-  assert(nread > 0);
+  if (nread < 0 && type == kCellular && errno != EINTR)
+    perror("recvfrom cellular");
+  return nread > 0 ? nread : -1;
+}
+
+int Tun::Peek(const IOType &type, char *buf, uint16_t len, int shard) {
+  assert(type == kCellular);
+  int nread = recv(sock_fd_rcv_[shard], buf, len, MSG_PEEK | MSG_TRUNC);
+  if (nread == 0) {
+    Discard(type, shard);
+    return -1;
+  }
+  if (nread < 0 && errno != EINTR)
+    perror("recv peek cellular");
   return nread;
 }
 
-uint16_t Tun::Write(const IOType &type, char *buf, uint16_t len, int client_id) {
-  uint16_t nwrite=-1;
-  assert(len > 0);
+void Tun::Discard(const IOType &type, int shard) {
+  assert(type == kCellular);
+  char dummy;
+  recv(sock_fd_rcv_[shard], &dummy, sizeof(dummy), 0);
+}
+
+int Tun::ReadTunBatch(int queue, char **bufs, uint16_t *lens, int max_cnt, uint16_t len) {
+  assert(queue >= 0 && queue < num_tun_queues_ && max_cnt > 0);
+  struct pollfd pfd;
+  pfd.fd = tun_fds_[queue];
+  pfd.events = POLLIN;
+  int cnt = 0;
+  while (cnt == 0) {
+    if (poll(&pfd, 1, -1) < 0) {
+      if (errno != EINTR)
+        perror("poll tun");
+      continue;
+    }
+    while (cnt < max_cnt) {
+      int nread = read(tun_fds_[queue], bufs[cnt], len);
+      if (nread < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          perror("Reading data");
+        break;
+      }
+      if (nread == 0 || nread >= len) {  /** Larger than the tun MTU we can carry. */
+        printf("Tun::ReadTunBatch: Warning drop pkt of len[%d] queue[%d]\n", nread, queue);
+        continue;
+      }
+      lens[cnt++] = nread;
+    }
+  }
+  return cnt;
+}
+
+int Tun::LookUpClient(const char *ip_pkt, uint16_t len) const {
+  const struct iphdr *hdr = (const struct iphdr*)ip_pkt;
+  if (len < sizeof(struct iphdr) || hdr->version != 4)
+    return -1;
+  map<in_addr_t, int>::const_iterator it = client_id_tbl_.find(hdr->daddr);
+  if (it == client_id_tbl_.end())
+    return -1;
+  return it->second;
+}
+
+int Tun::SendTo(const IOType &type, const char *buf, uint16_t len, int client_id) {
+  int nwrite = -1;
   socklen_t addr_len = sizeof(struct sockaddr_in);
+  if (type == kCellular) {
+    nwrite = sendto(sock_fd_eth_, buf, len, MSG_DONTWAIT, (struct sockaddr*)&client_addr_eth_tbl_[client_id], addr_len);
+  }
+  else if (type == kControl) {
+    nwrite = sendto(sock_fd_eth_, buf, len, MSG_DONTWAIT, (struct sockaddr*)&controller_addr_eth_, addr_len);
+  }
+  else if (type == kWspace) {
+    nwrite = sendto(sock_fd_ath_, buf, len, MSG_DONTWAIT, (struct sockaddr*)&client_addr_ath_, addr_len);
+  }
+  if (nwrite == len)
+    return 1;
+  if (nwrite < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+    return 0;
+  perror("Tun::SendTo");
+  return -1;
+}
+
+uint16_t Tun::Write(const IOType &type, char *buf, uint16_t len, int client_id, uint32_t airtime_us) {
+  uint16_t nwrite=0;
+  assert(len > 0);
   if (type == kTun) {
     nwrite = cwrite(tun_fd_, buf, len);
+    assert(nwrite == len);
+    return nwrite;
   }
-  else if (type == kCellular) {
-    nwrite = sendto(sock_fd_eth_, buf, len, 0, (struct sockaddr*)&client_addr_eth_tbl_[client_id], addr_len);
+
+  TxQueue &queue = tx_queue_tbl_[type];
+  queue.Lock();
+  /** Keep the order: only bypass the queue if nothing is waiting in it. */
+  int ret = 0;
+  if (queue.IsEmpty()) {
+    if (type == kWspace && wspace_pacer_.is_enabled()) {
+      uint64_t now = TokenBucket::NowUs();
+      if (wspace_pacer_.Delay(now) == 0 && (ret = SendTo(type, buf, len, client_id)) > 0)
+        wspace_pacer_.Consume(now, airtime_us);
+    }
+    else {
+      ret = SendTo(type, buf, len, client_id);
+    }
   }
-  else if (type == kControl) {
-    nwrite = sendto(sock_fd_eth_, buf, len, 0, (struct sockaddr*)&controller_addr_eth_, addr_len);
+  if (ret > 0) {
+    nwrite = len;
   }
-  else if (type == kWspace) {
-    nwrite = sendto(sock_fd_ath_, buf, len, 0, (struct sockaddr*)&client_addr_ath_, addr_len);
+  else if (ret == 0 && queue.NumFree() > 0) {
+    queue.Push(buf, len, client_id, airtime_us);
+    nwrite = len;
+    Pthread_mutex_lock(&flush_lock_);
+    is_tx_pending_ = true;
+    Pthread_cond_signal(&flush_cond_);
+    Pthread_mutex_unlock(&flush_lock_);
+  }
+  else {
+    num_tx_drops_[type]++;
   }
-  assert(nwrite == len);
+  queue.UnLock();
   return nwrite;
 }
 
+bool Tun::IsWritable(const IOType &type, int num_pkts) {
+  assert(type != kTun && num_pkts <= TX_QUEUE_SIZE);
+  TxQueue &queue = tx_queue_tbl_[type];
+  queue.Lock();
+  bool is_writable = queue.NumFree() >= num_pkts;
+  queue.UnLock();
+  return is_writable;
+}
+
+void Tun::WaitWritable(const IOType &type, int num_pkts) {
+  assert(type != kTun && num_pkts <= TX_QUEUE_SIZE);
+  TxQueue &queue = tx_queue_tbl_[type];
+  queue.Lock();
+  while (queue.NumFree() < num_pkts)
+    queue.WaitSpace();
+  queue.UnLock();
+}
+
+void* Tun::TxFlush() {
+  static const int kPollTimeOut = 10;  /** in ms. */
+  const IOType types[] = {kWspace, kCellular, kControl};
+  while (1) {
+    Pthread_mutex_lock(&flush_lock_);
+    while (!is_tx_pending_ && !is_flush_stopping_)
+      Pthread_cond_wait(&flush_cond_, &flush_lock_);
+    is_tx_pending_ = false;
+    bool is_stopping = is_flush_stopping_;
+    Pthread_mutex_unlock(&flush_lock_);
+    if (is_stopping)
+      break;
+
+    bool is_blocked = true;
+    uint32_t pace_delay = 0;   /** in us, until the pacer lets the next kWspace datagram go. */
+    while ((is_blocked || pace_delay > 0) && !IsFlushStopping()) {
+      bool is_ath_blocked = false, is_eth_blocked = false;  /** kWspace is on sock_fd_ath_, the others on sock_fd_eth_. */
+      pace_delay = 0;
+      for (int i = 0; i < 3; i++) {
+        TxQueue &queue = tx_queue_tbl_[types[i]];
+        bool is_paced = (types[i] == kWspace && wspace_pacer_.is_enabled());
+        queue.Lock();
+        while (!queue.IsEmpty()) {
+          uint16_t len = 0;
+          int client_id = 0;
+          uint32_t airtime_us = 0;
+          char *buf = queue.Front(&len, &client_id, &airtime_us);
+          uint64_t now = is_paced ? TokenBucket::NowUs() : 0;
+          if (is_paced && (pace_delay = wspace_pacer_.Delay(now)) > 0)
+            break;
+          int ret = SendTo(types[i], buf, len, client_id);
+          if (ret == 0) {
+            if (types[i] == kWspace)
+              is_ath_blocked = true;
+            else
+              is_eth_blocked = true;
+            break;
+          }
+          if (is_paced && ret > 0)
+            wspace_pacer_.Consume(now, airtime_us);
+          queue.Pop();  /** Sent or dropped on error. */
+        }
+        queue.SignalSpace();
+        queue.UnLock();
+      }
+      is_blocked = is_ath_blocked || is_eth_blocked;
+      if (is_blocked || pace_delay > 0) {
+        /** Only wait on the sockets that are backed up, a writable one would wake poll at once. */
+        struct pollfd pfds[3];
+        int nfds = 0;
+        if (is_ath_blocked) {
+          pfds[nfds].fd = sock_fd_ath_;
+          pfds[nfds++].events = POLLOUT;
+        }
+        if (is_eth_blocked) {
+          pfds[nfds].fd = sock_fd_eth_;
+          pfds[nfds++].events = POLLOUT;
+        }
+        if (pace_delay > 0) {
+          struct itimerspec timer = {{0, 0}, {pace_delay / 1000000, (pace_delay % 1000000) * 1000}};
+          timerfd_settime(pace_timer_fd_, 0, &timer, NULL);
+          pfds[nfds].fd = pace_timer_fd_;
+          pfds[nfds++].events = POLLIN;
+        }
+        poll(pfds, nfds, kPollTimeOut);
+        if (pace_delay > 0) {
+          uint64_t num_expirations;
+          if (read(pace_timer_fd_, &num_expirations, sizeof(num_expirations)) < 0 && errno != EAGAIN)
+            perror("read timerfd");
+        }
+      }
+    }
+  }
+  return (void*)NULL;
+}
+
+void Tun::StopTxFlush() {
+  if (!is_flush_running_)
+    return;
+  Pthread_mutex_lock(&flush_lock_);
+  is_flush_stopping_ = true;
+  Pthread_cond_signal(&flush_cond_);
+  Pthread_mutex_unlock(&flush_lock_);
+  Pthread_join(p_tx_flush_, NULL);
+  is_flush_running_ = false;
+}
+
 inline int cread(int fd, char *buf, int n) {
   int nread;
 
@@ -18,14 +18,58 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <netinet/ip.h>
+#include <linux/filter.h>
 #include <map>
 #include <string>
+#include <vector>
+#include "pthread_wrapper.h"
+#include "token_bucket.h"
+#include "wspace_asym_util.h"  /** PKT_SIZE, the one datagram size of every buffer. */
 using namespace std;
-/* buffer for reading from tun/tap interface, must be >= 1500 */
-#define PKT_SIZE 2000   
 #define PORT_ETH 55554
 #define PORT_ATH 55555
 #define MAX_RADIO 3
+#define MAX_TUN_QUEUES 8
+#define MAX_RCV_SHARDS 8
+#define TX_QUEUE_SIZE 256
+
+/**
+ * Bounded FIFO of datagrams waiting for their socket to become writable.
+ * Callers hold the lock around every operation.
+ */
+class TxQueue {
+ public:
+  TxQueue();
+  ~TxQueue();
+
+  void Lock() { Pthread_mutex_lock(&lock_); }
+  void UnLock() { Pthread_mutex_unlock(&lock_); }
+  void WaitSpace() { Pthread_cond_wait(&space_cond_, &lock_); }
+  void SignalSpace() { pthread_cond_broadcast(&space_cond_); }
+
+  int size() const { return size_; }
+  int NumFree() const { return TX_QUEUE_SIZE - size_; }
+  bool IsEmpty() const { return size_ == 0; }
+
+  /** @param airtime_us: what the datagram costs the pacer of the channel, if any. */
+  void Push(const char *buf, uint16_t len, int client_id, uint32_t airtime_us = 0);
+  /** Address, length, destination and airtime of the oldest datagram. */
+  char* Front(uint16_t *len, int *client_id, uint32_t *airtime_us = NULL);
+  void Pop();
+
+ private:
+  pthread_mutex_t lock_;
+  pthread_cond_t space_cond_;
+  char *bufs_;                          // TX_QUEUE_SIZE slots of PKT_SIZE.
+  uint16_t lens_[TX_QUEUE_SIZE];
+  int client_ids_[TX_QUEUE_SIZE];
+  uint32_t airtimes_[TX_QUEUE_SIZE];
+  int head_, size_;
+};
+
 class Tun {
  public:
   enum IOType {
@@ -35,22 +79,41 @@ class Tun {
     kControl,
   };
 
-  Tun(): tun_type_(IFF_TUN), port_eth_(PORT_ETH), port_ath_(PORT_ATH) {
+  Tun(): tun_type_(IFF_TUN), num_tun_queues_(1), port_eth_(PORT_ETH), port_ath_(PORT_ATH), num_rcv_shards_(1), 
+         pace_timer_fd_(-1) {
     if_name_[0] = '\0';
     server_ip_eth_[0] = '\0';
     server_ip_ath_[0] = '\0';
     broadcast_ip_ath_[0] = '\0';
     controller_ip_eth_[0] = '\0';
-
+    sock_fd_eth_ = sock_fd_ath_ = -1;
+    for (int i = 0; i < MAX_TUN_QUEUES; i++)
+      tun_fds_[i] = -1;
+    for (int i = 0; i < MAX_RCV_SHARDS; i++)
+      sock_fd_rcv_[i] = -1;
+    for (int i = 0; i <= kControl; i++)
+      num_tx_drops_[i] = 0;
+    is_tx_pending_ = false;
+    is_flush_running_ = is_flush_stopping_ = false;
+    Pthread_mutex_init(&flush_lock_, NULL);
+    Pthread_cond_init(&flush_cond_, NULL);
   }
 
-  ~Tun() {
-    close(tun_fd_);
-    close(sock_fd_eth_);
+  /** Subclasses replace the device and sockets with another transport, see LoopbackTun. */
+  virtual ~Tun() {
+    StopTxFlush();  /** It sends on the sockets below. */
+    for (int i = 0; i < num_tun_queues_; i++)
+      close(tun_fds_[i]);
+    for (int i = 0; i < num_rcv_shards_; i++)
+      close(sock_fd_rcv_[i]);
     close(sock_fd_ath_);
+    if (pace_timer_fd_ >= 0)
+      close(pace_timer_fd_);
+    Pthread_mutex_destroy(&flush_lock_);
+    Pthread_cond_destroy(&flush_cond_);
   }
   
-  void Init();
+  virtual void Init();
   void InitSock();
   void ObtainClientAddr();
   //int Accept(int listen_fd, sockaddr_in *client_addr);
@@ -58,12 +121,94 @@ class Tun {
   int CreateSock();
   void BindSocket(int fd, sockaddr_in *addr);
   void CreateAddr(const char *ip, int port, sockaddr_in *addr);
-  uint16_t Read(const IOType &type, char *buf, uint16_t len);
-  uint16_t Write(const IOType &type, char *buf, uint16_t len, int client_id = 0);
+
+  /** 
+   * Attach a classic BPF program to the SO_REUSEPORT group of sock_fd_rcv_
+   * that steers each packet by its client id.
+   * @return false if the kernel refuses it, the default 4-tuple hash is used then.
+   */
+  bool AttachShardProgram();
+
+  /**
+   * @param shard: the receive shard to read from, only used by kCellular.
+   * @return the length read, -1 on an error or an empty datagram.
+   */
+  virtual int Read(const IOType &type, char *buf, uint16_t len, int shard = 0);
+
+  /**
+   * Copy the first len bytes of the next datagram into buf without consuming it.
+   * An empty datagram is consumed.
+   * @return the full length of the datagram, -1 on an error or an empty datagram.
+   */
+  virtual int Peek(const IOType &type, char *buf, uint16_t len, int shard = 0);
+
+  /** Consume and discard the next datagram. */
+  virtual void Discard(const IOType &type, int shard = 0);
+
+  /**
+   * Tell the steering program where the client id of a packet type is, so 
+   * that all its packets land on shard (client_id % num_rcv_shards_).
+   * Must be called before Init.
+   */
+  void AddShardKey(char type, uint16_t client_id_offset) { shard_key_tbl_[type] = client_id_offset; }
+
+  int ShardOf(int client_id) const { return (uint32_t)client_id % num_rcv_shards_; }
+
+  /**
+   * Send without blocking. A datagram the socket can't take right now, or 
+   * the whitespace pacer holds back, is kept in the channel's TxQueue and 
+   * sent by TxFlush once the socket is writable and the pacer lets it go.
+   * @param airtime_us: airtime of a kWspace datagram at the rate it is sent at, for the pacer.
+   * @return len if sent or queued, 0 if dropped because the queue is full.
+   */
+  virtual uint16_t Write(const IOType &type, char *buf, uint16_t len, int client_id = 0, uint32_t airtime_us = 0);
+
+  /** @return true if the channel can take num_pkts datagrams without dropping. */
+  bool IsWritable(const IOType &type, int num_pkts = 1);
+
+  /** Backpressure: block until the channel can take num_pkts datagrams. */
+  void WaitWritable(const IOType &type, int num_pkts = 1);
+
+  /** Drain the transmit queues as the sockets become writable, started by Init. */
+  void* TxFlush();
+
+  /** Stop and join the TxFlush thread if it runs. */
+  void StopTxFlush();
+
+  /** is_flush_stopping_ under flush_lock_, StopTxFlush sets it from another thread. */
+  bool IsFlushStopping() {
+    Pthread_mutex_lock(&flush_lock_);
+    bool is_stopping = is_flush_stopping_;
+    Pthread_mutex_unlock(&flush_lock_);
+    return is_stopping;
+  }
+
+  /**
+   * Block until the given tun queue is readable and then drain up to
+   * max_cnt packets from it without blocking again.
+   * @param [out] bufs: each packet is read into bufs[i], at most len bytes.
+   * @param [out] lens: length of each packet read.
+   * @return number of packets read.
+   */
+  virtual int ReadTunBatch(int queue, char **bufs, uint16_t *lens, int max_cnt, uint16_t len);
+
+  /**
+   * Map the destination address of an IPv4 packet to a client id.
+   * @return client id, or -1 if the packet is not destined to any client.
+   */
+  int LookUpClient(const char *ip_pkt, uint16_t len) const;
+
+  /**
+   * sendto() without blocking.
+   * @return 1 if sent, 0 if the socket would block, -1 if the datagram is dropped on error.
+   */
+  int SendTo(const IOType &type, const char *buf, uint16_t len, int client_id);
 
 // Data members:
-  int tun_fd_;
+  int tun_fd_;          // First tun queue.
   int tun_type_;        // TUN or TAP
+  int num_tun_queues_;  // IFF_MULTI_QUEUE if more than one.
+  int tun_fds_[MAX_TUN_QUEUES];
   char if_name_[IFNAMSIZ];
   char server_ip_eth_[16];
   char server_ip_ath_[16];
@@ -71,11 +216,25 @@ class Tun {
   struct sockaddr_in server_addr_eth_, server_addr_ath_, client_addr_ath_; 
   uint16_t port_eth_, port_ath_;
   int sock_fd_eth_, sock_fd_ath_;       // Sockets to handle request at the server side
+  int num_rcv_shards_;                  // SO_REUSEPORT group on the eth port if more than one.
+  int sock_fd_rcv_[MAX_RCV_SHARDS];     // sock_fd_rcv_[0] is sock_fd_eth_.
+  map<char, uint16_t> shard_key_tbl_;   // <pkt type, offset of client_id_>.
 
   map<int, string> client_ip_tbl_; // <client_id, client_ip_eth_>.
   map<int, struct sockaddr_in> client_addr_eth_tbl_;
+  map<in_addr_t, int> client_id_tbl_; // <client_ip_eth_, client_id>.
   char controller_ip_eth_[16];
   struct sockaddr_in controller_addr_eth_;
+
+  TxQueue tx_queue_tbl_[kControl+1];    // Indexed by IOType, kTun is not queued.
+  uint64_t num_tx_drops_[kControl+1];   // Datagrams dropped on full TxQueue.
+  pthread_t p_tx_flush_;
+  pthread_mutex_t flush_lock_;
+  pthread_cond_t flush_cond_;
+  bool is_tx_pending_;                  // Something was queued since TxFlush last looked.
+  bool is_flush_running_, is_flush_stopping_;
+  TokenBucket wspace_pacer_;            // Paces kWspace by airtime if enabled before Init, used under its TxQueue lock.
+  int pace_timer_fd_;                   // timerfd TxFlush waits on for the pacer.
 };
 
 int cread(int fd, char *buf, int n);
@@ -0,0 +1,490 @@
+/**
+ * Hermetic end-to-end benchmark of WspaceAP: the AP runs unmodified on a
+ * LoopbackTun, with simulated clients and a simulated controller in the same
+ * process. Reports packets per second, goodput and one-way latency from
+ * injection at the controller to delivery at the client.
+ *
+ * Usage: wspace_ap_bench [-d duration_s] [-w warmup_s] [-x rate_pps] [-l pkt_len]
+ *                        [-k ack_interval_us] [-u] [-n] [-- wspace_ap options]
+ * -x 0 injects as fast as the AP accepts packets, -u injects through the tun path,
+ * -n makes the clients send the legacy nack lists instead of AckRangePkt.
+ */
+#include <netinet/ip.h>
+#include "wspace_ap_bench.h"
+#include "wspace_ap_scout.h"
+
+using namespace std;
+
+static int64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** Used when no wspace_ap options are given: one client, no tun device needed. */
+static const char* kDefaultAPArgs[] = {
+  "wspace_ap_bench", "-i", "bench0", "-S", "10.0.0.1", "-s", "10.0.1.1", "-C", "10.0.0.254",
+  "-m", "10.0.1.255", "-I", "1", "-c", "2", "-b", "10.0.0.2", "-M", "10000", "-t", "40",
+  "-T", "20", "-B", "10", "-R", "2",
+};
+
+BenchStats::BenchStats() : measuring_(false), num_injected_(0), num_inject_drops_(0),
+    num_delivered_(0), bytes_delivered_(0), num_dups_delivered_(0), num_raw_rcv_(0),
+    num_raw_lost_(0), num_cellular_rcv_(0), num_data_acks_(0), num_raw_acks_(0),
+    feedback_bytes_(0), num_bs_stats_(0), num_bs_reports_(0), latency_sum_ns_(0), latency_max_ns_(0) {
+  latency_hist_ = new std::atomic<uint64_t>[kNumBuckets];
+  for (int i = 0; i < kNumBuckets; i++)
+    latency_hist_[i] = 0;
+}
+
+BenchStats::~BenchStats() {
+  delete[] latency_hist_;
+}
+
+void BenchStats::AddLatency(int64_t latency_ns) {
+  int bucket = latency_ns / 1000 / kBucketUs;
+  if (bucket >= kNumBuckets)
+    bucket = kNumBuckets - 1;
+  latency_hist_[bucket]++;
+  latency_sum_ns_ += latency_ns;
+  int64_t max_ns = latency_max_ns_;
+  while (latency_ns > max_ns && !latency_max_ns_.compare_exchange_weak(max_ns, latency_ns)) {}
+}
+
+double BenchStats::LatencyPercentile(double fraction) const {
+  uint64_t total = 0, cnt = 0;
+  for (int i = 0; i < kNumBuckets; i++)
+    total += latency_hist_[i];
+  for (int i = 0; i < kNumBuckets; i++) {
+    cnt += latency_hist_[i];
+    if (cnt > 0 && cnt >= fraction * total)
+      return (i + 1) * kBucketUs;
+  }
+  return 0;
+}
+
+SimClient::SimClient(LoopbackTun *tun, BenchStats *stats, int client_id, int bs_id, int ack_interval_us, bool is_legacy_ack)
+    : tun_(tun), stats_(stats), client_id_(client_id), bs_id_(bs_id), ack_interval_us_(ack_interval_us), is_legacy_ack_(is_legacy_ack),
+      decoder_(CodeInfo::kDecoder, MAX_BATCH_SIZE, PKT_SIZE), max_seq_(0), data_ack_pending_(false),
+      raw_start_(1), raw_max_(0) {}
+
+SimClient::~SimClient() {}
+
+void* SimClient::Run(void* arg) {
+  static const int kMaxPollBatch = 64;
+  char *buf = new char[PKT_SIZE];
+  uint16 len = 0;
+  int64_t last_ack_ns = NowNs();
+  while (1) {
+    bool is_idle = true;
+    for (int i = 0; i < kMaxPollBatch && tun_->wspace_queue(client_id_)->Pop(buf, &len, PKT_SIZE); i++) {
+      RcvCodedPkt(buf, len, true);
+      is_idle = false;
+    }
+    for (int i = 0; i < kMaxPollBatch && tun_->cellular_queue(client_id_)->Pop(buf, &len, PKT_SIZE); i++) {
+      RcvCodedPkt(buf, len, false);
+      is_idle = false;
+    }
+    int64_t now_ns = NowNs();
+    if (now_ns - last_ack_ns >= ack_interval_us_ * 1000LL) {
+      if (data_ack_pending_)
+        SendDataAck();
+      SendRawAck();
+      last_ack_ns = now_ns;
+    }
+    if (is_idle && tun_->wspace_queue(client_id_)->Pop(buf, &len, PKT_SIZE, ack_interval_us_))
+      RcvCodedPkt(buf, len, true);
+  }
+  delete[] buf;
+  return (void*)NULL;
+}
+
+void SimClient::RcvCodedPkt(const char *buf, uint16 len, bool over_wspace) {
+  const AthCodeHeader *hdr = (const AthCodeHeader*)buf;
+  if (hdr->type() != ATH_CODE || hdr->client_id_ != client_id_)
+    return;
+  if (over_wspace) {
+#ifdef RAND_DROP
+    TrackRawSeq(hdr->raw_seq(), hdr->is_good());
+    if (!hdr->is_good())
+      return;
+#else
+    TrackRawSeq(hdr->raw_seq(), true);
+#endif
+  }
+  else if (stats_->measuring_) {
+    stats_->num_cellular_rcv_++;
+  }
+
+  uint32 batch_id=0, start_seq=0;
+  int ind=0, k=0, n=0, bs_id=0, client_id=0;
+  hdr->ParseHeader(&batch_id, &start_seq, &ind, &k, &n, &bs_id, &client_id);
+  map<uint32, PartialBatch>::iterator it = batch_tbl_.find(batch_id);
+  if (it == batch_tbl_.end()) {
+    PartialBatch batch;
+    batch.start_seq = start_seq;
+    batch.k = k;
+    batch.n = n;
+    batch.is_done = false;
+    hdr->GetLenArr(batch.lens);
+    it = batch_tbl_.insert(make_pair(batch_id, batch)).first;
+    if (batch_tbl_.size() > kMaxPartialBatches)
+      batch_tbl_.erase(batch_tbl_.begin());  /** Oldest batch can't be completed anymore. */
+  }
+  PartialBatch &batch = it->second;
+  if (n > batch.n)  /** Repair symbols widen the batch. */
+    batch.n = n;
+  if (batch.is_done || find(batch.inds.begin(), batch.inds.end(), ind) != batch.inds.end())
+    return;  /** Received over both links. */
+
+  const uint8 *payload = hdr->GetPayloadStart();
+  uint16 payload_len = len - hdr->GetFullHdrLen();
+  if (ind < k)  /** Systematic code: native packets are delivered right away. */
+    Deliver(start_seq + ind, payload, batch.lens[ind]);
+  batch.inds.push_back(ind);
+  batch.payloads.push_back(vector<uint8>(payload, payload + payload_len));
+  if ((int)batch.inds.size() == k) {
+    DecodeBatch(&batch);
+    batch.is_done = true;
+    batch.payloads.clear();
+  }
+}
+
+void SimClient::DecodeBatch(PartialBatch *batch) {
+  bool has_native[MAX_BATCH_SIZE] = {false};
+  bool need_decode = false;
+  for (size_t i = 0; i < batch->inds.size(); i++) {
+    if (batch->inds[i] < batch->k)
+      has_native[batch->inds[i]] = true;
+    else
+      need_decode = true;
+  }
+  if (!need_decode)
+    return;
+
+  decoder_.SetCodeInfo(batch->k, batch->n, batch->start_seq);
+  decoder_.ResetCurInd();
+  decoder_.CopyLens(batch->lens);
+  for (size_t i = 0; i < batch->inds.size(); i++)
+    decoder_.PushPkt(batch->payloads[i].size(), &batch->payloads[i][0], batch->inds[i]);
+  decoder_.DecodeBatch();
+  for (int i = 0; i < batch->k; i++) {
+    uint8 *pkt = NULL;
+    uint16 len = 0;
+    assert(decoder_.PopPkt(&pkt, &len));
+    if (!has_native[i])
+      Deliver(batch->start_seq + i, pkt, len);
+  }
+}
+
+void SimClient::Deliver(uint32 seq, const uint8 *pkt, uint16 len) {
+  if (seq > max_seq_) {
+    for (uint32 s = max_seq_ + 1; s < seq; s++)
+      holes_[s] = 0;
+    max_seq_ = seq;
+  }
+  else {
+    map<uint32, int>::iterator it = holes_.find(seq);
+    if (it == holes_.end()) {
+      if (stats_->measuring_)
+        stats_->num_dups_delivered_++;
+      return;
+    }
+    holes_.erase(it);
+  }
+  /** The AP can't retransmit anything older than its buffer. */
+  while (!holes_.empty() && holes_.begin()->first + BUF_SIZE < max_seq_)
+    holes_.erase(holes_.begin());
+  data_ack_pending_ = true;
+
+  /** Probes are carried as data packets too, only count the injected ones. */
+  const ControllerToClientHeader *hdr = (const ControllerToClientHeader*)pkt;
+  if (!stats_->measuring_ || len < sizeof(ControllerToClientHeader) || hdr->type() != CONTROLLER_TO_CLIENT)
+    return;
+  uint16 offset = sizeof(ControllerToClientHeader) + (hdr->o_seq() == 0 ? sizeof(struct iphdr) : 0);
+  if (len >= offset + sizeof(BenchPayload)) {
+    BenchPayload payload;
+    memcpy(&payload, pkt + offset, sizeof(payload));
+    stats_->AddLatency(NowNs() - payload.send_ns);
+  }
+  stats_->num_delivered_++;
+  stats_->bytes_delivered_ += len;
+}
+
+void SimClient::SendDataAck() {
+  uint32 end_seq = max_seq_;
+  uint16 len = 0;
+  data_ack_.Init(DATA_ACK);
+  data_ack_.set_ids(client_id_, bs_id_);
+  data_range_ack_.Init(DATA_ACK_RANGE);
+  data_range_ack_.set_ids(client_id_, bs_id_);
+  for (map<uint32, int>::iterator it = holes_.begin(); it != holes_.end(); ) {
+    if (is_legacy_ack_ ? data_ack_.IsFull() : !data_range_ack_.CanPush(it->first)) {
+      end_seq = it->first - 1;  /** Don't acknowledge what can't be nacked. */
+      break;
+    }
+    if (is_legacy_ack_)
+      data_ack_.PushNack(it->first);
+    else
+      data_range_ack_.PushNack(it->first);
+    if (++it->second > kMaxNackRounds)
+      holes_.erase(it++);
+    else
+      ++it;
+  }
+  if (is_legacy_ack_) {
+    data_ack_.set_end_seq(end_seq);
+    len = data_ack_.GetLen();
+    tun_->SendToAP((char*)&data_ack_, len, client_id_);
+  }
+  else {
+    data_range_ack_.set_end_seq(end_seq);
+    len = data_range_ack_.Pack();
+    tun_->SendToAP((char*)&data_range_ack_, len, client_id_);
+  }
+  data_ack_pending_ = !holes_.empty();
+  if (stats_->measuring_) {
+    stats_->num_data_acks_++;
+    stats_->feedback_bytes_ += len;
+  }
+}
+
+void SimClient::TrackRawSeq(uint32 raw_seq, bool is_good) {
+  static const uint32 kMaxRawAckPkts = 10000;
+  if (raw_seq <= raw_max_ || raw_seq < raw_start_)
+    return;
+  if (stats_->measuring_) {
+    stats_->num_raw_rcv_++;
+    stats_->num_raw_lost_ += raw_seq - raw_max_ - 1 + (is_good ? 0 : 1);
+  }
+  for (uint32 s = raw_max_ + 1; s < raw_seq; s++) {
+    raw_nacks_.push_back(s);
+    raw_max_ = s;
+    if (raw_nacks_.size() >= ACK_WINDOW)
+      SendRawAck();
+  }
+  if (!is_good)
+    raw_nacks_.push_back(raw_seq);
+  raw_max_ = raw_seq;
+  if (raw_nacks_.size() >= ACK_WINDOW || raw_max_ - raw_start_ + 1 >= kMaxRawAckPkts)
+    SendRawAck();
+}
+
+void SimClient::SendRawAck() {
+  if (raw_max_ < raw_start_)
+    return;
+  uint16 len = 0;
+  if (is_legacy_ack_) {
+    raw_ack_.Init(RAW_ACK);
+    raw_ack_.set_ids(client_id_, bs_id_);
+    for (size_t i = 0; i < raw_nacks_.size(); i++)
+      raw_ack_.PushNack(raw_nacks_[i]);
+    raw_ack_.set_end_seq(raw_max_);
+    raw_ack_.set_num_pkts(raw_max_ - raw_start_ + 1);
+    len = raw_ack_.GetLen();
+    tun_->SendToAP((char*)&raw_ack_, len, client_id_);
+  }
+  else {
+    raw_range_ack_.Init(RAW_ACK_RANGE);
+    raw_range_ack_.set_ids(client_id_, bs_id_);
+    for (size_t i = 0; i < raw_nacks_.size(); i++)
+      raw_range_ack_.PushNack(raw_nacks_[i]);
+    raw_range_ack_.set_end_seq(raw_max_);
+    raw_range_ack_.set_num_pkts(raw_max_ - raw_start_ + 1);
+    len = raw_range_ack_.Pack();
+    tun_->SendToAP((char*)&raw_range_ack_, len, client_id_);
+  }
+  raw_start_ = raw_max_ + 1;
+  raw_nacks_.clear();
+  if (stats_->measuring_) {
+    stats_->num_raw_acks_++;
+    stats_->feedback_bytes_ += len;
+  }
+}
+
+SimController::SimController(LoopbackTun *tun, BenchStats *stats, const vector<int> &client_ids,
+                             int rate_pps, uint16 payload_len, bool use_tun)
+    : tun_(tun), stats_(stats), client_ids_(client_ids), rate_pps_(rate_pps),
+      payload_len_(payload_len), use_tun_(use_tun) {}
+
+void* SimController::Inject(void* arg) {
+  char buf[PKT_SIZE] = {0};
+  ControllerToClientHeader hdr;
+  uint16 offset = sizeof(hdr) + (use_tun_ ? sizeof(struct iphdr) : 0);
+  assert(payload_len_ >= offset + sizeof(BenchPayload) && payload_len_ <= PKT_SIZE);
+  struct iphdr *ip_hdr = (struct iphdr*)(buf + sizeof(hdr));
+  ip_hdr->version = 4;
+  ip_hdr->ihl = 5;
+  ip_hdr->tot_len = htons(payload_len_ - sizeof(hdr));
+
+  map<int, uint32> o_seq_tbl;
+  int64_t interval_ns = rate_pps_ > 0 ? 1000000000LL / rate_pps_ : 0;
+  int64_t next_ns = NowNs();
+  for (uint64_t cnt = 0; ; cnt++) {
+    int client_id = client_ids_[cnt % client_ids_.size()];
+    if (interval_ns > 0) {
+      next_ns += interval_ns;
+      int64_t now_ns = NowNs();
+      if (next_ns > now_ns) {
+        struct timespec ts = {next_ns / 1000000000LL, next_ns % 1000000000LL};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+      }
+    }
+    BenchPayload payload;
+    payload.send_ns = NowNs();
+    memcpy(buf + offset, &payload, sizeof(payload));
+
+    bool is_sent = false;
+    do {
+      if (use_tun_) {
+        ip_hdr->daddr = inet_addr(tun_->client_ip_tbl_[client_id].c_str());
+        is_sent = tun_->tun_queue(cnt % tun_->num_tun_queues_)->Push(buf + sizeof(hdr), payload_len_ - sizeof(hdr));
+      }
+      else {
+        hdr.set_client_id(client_id);
+        hdr.set_o_seq(++o_seq_tbl[client_id]);
+        memcpy(buf, &hdr, sizeof(hdr));
+        is_sent = tun_->SendToAP(buf, payload_len_, client_id);
+      }
+      if (!is_sent && interval_ns == 0)
+        sched_yield();  /** Unpaced: wait for the AP to catch up. */
+    } while (!is_sent && interval_ns == 0);
+
+    if (stats_->measuring_) {
+      if (is_sent)
+        stats_->num_injected_++;
+      else
+        stats_->num_inject_drops_++;
+    }
+  }
+  return (void*)NULL;
+}
+
+void* SimController::Relay(void* arg) {
+  char *buf = new char[PKT_SIZE];
+  uint16 len = 0;
+  while (1) {
+    tun_->control_queue()->Pop(buf, &len, PKT_SIZE, -1);
+    if (*buf == ATH_CODE) {  /** Duplicate to be forwarded over cellular. */
+      const AthCodeHeader *hdr = (const AthCodeHeader*)buf;
+      tun_->cellular_queue(hdr->client_id_)->Push(buf, len);
+    }
+    else if (*buf == BS_STATS && stats_->measuring_) {
+      stats_->num_bs_stats_++;
+    }
+    else if (*buf == BS_REPORT && stats_->measuring_) {
+      stats_->num_bs_reports_++;
+    }
+  }
+  delete[] buf;
+  return (void*)NULL;
+}
+
+void* LaunchSimClient(void* arg) {
+  return ((SimClient*)arg)->Run(NULL);
+}
+
+void* LaunchSimInject(void* arg) {
+  return ((SimController*)arg)->Inject(NULL);
+}
+
+void* LaunchSimRelay(void* arg) {
+  return ((SimController*)arg)->Relay(NULL);
+}
+
+/** Packets the AP dropped on a full TxDataBuf, over all clients. */
+static uint64_t NumDataBufDrops(WspaceAP *ap) {
+  uint64_t num_drops = 0;
+  for (map<int, ClientContext*>::iterator it = ap->client_context_tbl_.begin(); it != ap->client_context_tbl_.end(); ++it)
+    num_drops += it->second->data_pkt_buf()->num_full_drops();
+  return num_drops;
+}
+
+int main(int argc, char **argv) {
+  int duration_s = 10, warmup_s = 1, rate_pps = 0, ack_interval_us = 5000;
+  uint16 pkt_len = 1000;
+  bool use_tun = false, is_legacy_ack = false;
+  int option;
+  while ((option = getopt(argc, argv, "d:w:x:l:k:un")) > 0) {
+    switch(option) {
+      case 'd':
+        duration_s = atoi(optarg);
+        break;
+      case 'w':
+        warmup_s = atoi(optarg);
+        break;
+      case 'x':
+        rate_pps = atoi(optarg);
+        break;
+      case 'l':
+        pkt_len = atoi(optarg);
+        break;
+      case 'k':
+        ack_interval_us = atoi(optarg);
+        break;
+      case 'u':
+        use_tun = true;
+        break;
+      case 'n':
+        is_legacy_ack = true;
+        break;
+      default:
+        Perror("Usage: %s [-d duration_s] [-w warmup_s] [-x rate_pps] [-l pkt_len] [-k ack_interval_us] [-u] [-n] [-- wspace_ap options]\n", argv[0]);
+    }
+  }
+  assert(duration_s > 0 && ack_interval_us > 0);
+
+  /** Remaining arguments after "--" go to WspaceAP. */
+  vector<char*> ap_args;
+  ap_args.push_back(argv[0]);
+  for (int i = optind; i < argc; i++)
+    ap_args.push_back(argv[i]);
+  if (ap_args.size() == 1)
+    ap_args.assign((char**)kDefaultAPArgs, (char**)kDefaultAPArgs + sizeof(kDefaultAPArgs) / sizeof(kDefaultAPArgs[0]));
+  optind = 1;
+
+  BenchStats stats;
+  LoopbackTun *tun = new LoopbackTun;
+  wspace_ap = new WspaceAP(ap_args.size(), &ap_args[0], kWspaceAPOpts, tun);
+  wspace_ap->Init();
+
+  vector<SimClient*> clients;
+  for (vector<int>::iterator it = wspace_ap->client_ids_.begin(); it != wspace_ap->client_ids_.end(); ++it) {
+    clients.push_back(new SimClient(tun, &stats, *it, wspace_ap->bs_id_, ack_interval_us, is_legacy_ack));
+    Pthread_create(clients.back()->p_run(), NULL, LaunchSimClient, clients.back());
+  }
+  SimController controller(tun, &stats, wspace_ap->client_ids_, rate_pps, pkt_len, use_tun);
+  Pthread_create(controller.p_relay(), NULL, LaunchSimRelay, &controller);
+  wspace_ap->StartThreads();
+  Pthread_create(controller.p_inject(), NULL, LaunchSimInject, &controller);
+
+  sleep(warmup_s);
+  uint64_t ap_drops = NumDataBufDrops(wspace_ap);
+  stats.measuring_ = true;
+  int64_t start_ns = NowNs();
+  sleep(duration_s);
+  stats.measuring_ = false;
+  double elapsed = (NowNs() - start_ns) / 1e9;
+  ap_drops = NumDataBufDrops(wspace_ap) - ap_drops;
+
+  uint64_t delivered = stats.num_delivered_;
+  printf("\n=== wspace_ap_bench: %zu client(s), %.2fs, %s ingress ===\n", clients.size(), elapsed, use_tun ? "tun" : "controller");
+  printf("Injected:  %lu pkts (%.0f pps), dropped before the AP: %lu, dropped on a full AP buffer: %lu\n",
+         (unsigned long)stats.num_injected_, stats.num_injected_ / elapsed, (unsigned long)stats.num_inject_drops_,
+         (unsigned long)ap_drops);
+  printf("Delivered: %lu pkts (%.0f pps), goodput %.2f Mbps, duplicates %lu\n",
+         (unsigned long)delivered, delivered / elapsed, stats.bytes_delivered_ * 8 / elapsed / 1e6,
+         (unsigned long)stats.num_dups_delivered_);
+  printf("Latency:   avg %.1fus p50 %.0fus p99 %.0fus max %.1fus\n",
+         delivered ? stats.latency_sum_ns_ / 1000.0 / delivered : 0.0, stats.LatencyPercentile(0.5),
+         stats.LatencyPercentile(0.99), stats.latency_max_ns_ / 1000.0);
+  printf("Wspace:    %lu raw pkts received, %lu lost; %lu cellular duplicates received\n",
+         (unsigned long)stats.num_raw_rcv_, (unsigned long)stats.num_raw_lost_, (unsigned long)stats.num_cellular_rcv_);
+  printf("Feedback:  %lu DATA_ACKs, %lu RAW_ACKs (%lu bytes), %lu BS_STATS, %lu BS_REPORTs\n",
+         (unsigned long)stats.num_data_acks_, (unsigned long)stats.num_raw_acks_, (unsigned long)stats.feedback_bytes_,
+         (unsigned long)stats.num_bs_stats_, (unsigned long)stats.num_bs_reports_);
+  printf("Loopback drops: wspace %lu cellular %lu control %lu\n", (unsigned long)tun->num_drops(Tun::kWspace),
+         (unsigned long)tun->num_drops(Tun::kCellular), (unsigned long)tun->num_drops(Tun::kControl));
+  fflush(stdout);
+  _exit(0);  /** The AP threads never return. */
+}
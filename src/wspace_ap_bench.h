@@ -0,0 +1,139 @@
+#ifndef WSPACE_AP_BENCH_H_
+#define WSPACE_AP_BENCH_H_
+
+#include <set>
+#include <atomic>
+#include "loopback_tun.h"
+#include "fec.h"
+
+/** Header of every injected data packet, behind the ControllerToClientHeader. */
+struct BenchPayload {
+  int64_t send_ns;   /** CLOCK_MONOTONIC time of injection. */
+};
+
+/** Counters shared by the simulated peers, only updated while measuring. */
+class BenchStats {
+ public:
+  /** Latency histogram resolution and range. */
+  static const int kBucketUs = 10;
+  static const int kNumBuckets = 100000;
+
+  BenchStats();
+  ~BenchStats();
+
+  void AddLatency(int64_t latency_ns);
+
+  /** @return the latency in us below which the given fraction of packets fall. */
+  double LatencyPercentile(double fraction) const;
+
+  std::atomic<bool> measuring_;
+  std::atomic<uint64_t> num_injected_;
+  std::atomic<uint64_t> num_inject_drops_;
+  std::atomic<uint64_t> num_delivered_;
+  std::atomic<uint64_t> bytes_delivered_;
+  std::atomic<uint64_t> num_dups_delivered_;
+  std::atomic<uint64_t> num_raw_rcv_;
+  std::atomic<uint64_t> num_raw_lost_;
+  std::atomic<uint64_t> num_cellular_rcv_;
+  std::atomic<uint64_t> num_data_acks_;
+  std::atomic<uint64_t> num_raw_acks_;
+  std::atomic<uint64_t> feedback_bytes_;   /** Of DATA_ACKs and RAW_ACKs. */
+  std::atomic<uint64_t> num_bs_stats_;
+  std::atomic<uint64_t> num_bs_reports_;
+  std::atomic<uint64_t> *latency_hist_;
+  std::atomic<int64_t> latency_sum_ns_;
+  std::atomic<int64_t> latency_max_ns_;
+};
+
+/**
+ * Simulated client: decodes the coded batches sent over wspace (honoring
+ * is_good_ as the channel outcome) and the duplicates relayed over cellular,
+ * and answers with DATA_ACK and RAW_ACK the way a client does.
+ */
+class SimClient {
+ public:
+  /** @param is_legacy_ack: nack every sequence number (AckPkt) instead of AckRangePkt. */
+  SimClient(LoopbackTun *tun, BenchStats *stats, int client_id, int bs_id, int ack_interval_us, bool is_legacy_ack);
+  ~SimClient();
+
+  void* Run(void* arg);
+
+  pthread_t* p_run() { return &p_run_; }
+
+ private:
+  /** A batch being collected until k of its n coded packets arrive. */
+  struct PartialBatch {
+    uint32 start_seq;
+    int k, n;
+    uint16 lens[MAX_BATCH_SIZE];
+    std::vector<int> inds;
+    std::vector<std::vector<uint8> > payloads;
+    bool is_done;
+  };
+
+  static const size_t kMaxPartialBatches = 16;
+  /** Give up asking for a data packet after so many DATA_ACKs. */
+  static const int kMaxNackRounds = 32;
+
+  void RcvCodedPkt(const char *buf, uint16 len, bool over_wspace);
+  void TrackRawSeq(uint32 raw_seq, bool is_good);
+  void DecodeBatch(PartialBatch *batch);
+  void Deliver(uint32 seq, const uint8 *pkt, uint16 len);
+  void SendDataAck();
+  void SendRawAck();
+
+  LoopbackTun *tun_;
+  BenchStats *stats_;
+  int client_id_;
+  int bs_id_;
+  int ack_interval_us_;
+  bool is_legacy_ack_;
+  pthread_t p_run_;
+  CodeInfo decoder_;
+  std::map<uint32, PartialBatch> batch_tbl_;   /** <batch_id, batch>. */
+  /** Data sequence tracking for DATA_ACK. */
+  uint32 max_seq_;
+  std::map<uint32, int> holes_;                /** <missing seq, times nacked>. */
+  bool data_ack_pending_;
+  AckPkt data_ack_;
+  AckRangePkt data_range_ack_;
+  /** Raw sequence tracking for RAW_ACK, covering [raw_start_, raw_max_]. */
+  uint32 raw_start_;
+  uint32 raw_max_;
+  std::vector<uint32> raw_nacks_;
+  AckPkt raw_ack_;
+  AckRangePkt raw_range_ack_;
+};
+
+/**
+ * Simulated controller: injects CONTROLLER_TO_CLIENT traffic (or raw IPv4
+ * packets through the tun path) at a given rate, relays the AP's cellular
+ * duplicates to the clients and consumes the AP's reports.
+ */
+class SimController {
+ public:
+  SimController(LoopbackTun *tun, BenchStats *stats, const std::vector<int> &client_ids,
+                int rate_pps, uint16 payload_len, bool use_tun);
+  ~SimController() {}
+
+  void* Inject(void* arg);
+  void* Relay(void* arg);
+
+  pthread_t* p_inject() { return &p_inject_; }
+  pthread_t* p_relay() { return &p_relay_; }
+
+ private:
+  LoopbackTun *tun_;
+  BenchStats *stats_;
+  std::vector<int> client_ids_;
+  int rate_pps_;          /** 0 to inject as fast as the AP takes them. */
+  uint16 payload_len_;
+  bool use_tun_;
+  pthread_t p_inject_, p_relay_;
+};
+
+void* LaunchSimClient(void* arg);
+void* LaunchSimInject(void* arg);
+void* LaunchSimRelay(void* arg);
+
+#endif
@@ -7,9 +7,13 @@
 using namespace std;
 
 WspaceAP *wspace_ap;
+const char *const kWspaceAPOpts = "r:R:t:T:i:I:S:s:C:c:P:p:r:B:b:d:D:V:v:m:M:O:f:n:o:F:q:e:a:A:L:u:U:g:";
 
 static const uint16 kTunMTU = PKT_SIZE - ATH_CODE_HEADER_SIZE - MAX_BATCH_SIZE * sizeof(uint16);
+static const int kTunReadBatch = 32;  /** Max packets drained from a tun queue per poll. */
+static const int kRcvErrorBackoffUs = 1000;  /** Pause of TxRcvCell after a failed read, not to spin on a broken socket. */
 
+#ifndef WSPACE_AP_NO_MAIN
 int main(int argc, char **argv) {
   printf("PKT_SIZE: %d\n", PKT_SIZE);
   printf("ACK header size: %d\n", ACK_HEADER_SIZE);
@@ -18,44 +22,72 @@ int main(int argc, char **argv) {
   printf("sizeof(CellDataHeader):%d\n", sizeof(CellDataHeader));
   printf("sizeof(double):%d\n",sizeof(double));
   printf("sizeof(int):%d\n",sizeof(int));
-  const char* opts = "r:R:t:T:i:I:S:s:C:c:P:p:r:B:b:d:D:V:v:m:M:O:f:n:o:F:";
-  wspace_ap = new WspaceAP(argc, argv, opts);
+  wspace_ap = new WspaceAP(argc, argv, kWspaceAPOpts);
   wspace_ap->Init();
+  wspace_ap->StartThreads();
+  wspace_ap->JoinThreads();
+  delete wspace_ap;
+  return 0;
+}
+#endif
 
-  Pthread_create(&wspace_ap->p_tx_read_tun_, NULL, LaunchTxReadTun, NULL);
-  Pthread_create(&wspace_ap->p_tx_rcv_cell_, NULL, LaunchTxRcvCell, NULL);
-  Pthread_create(&wspace_ap->p_tx_send_probe_, NULL, LaunchTxSendProbe, NULL);
-  for(vector<int>::iterator it = wspace_ap->client_ids_.begin(); it != wspace_ap->client_ids_.end(); ++it) {
-    Pthread_create(wspace_ap->client_context_tbl_[*it]->p_tx_send_ath(), NULL, LaunchTxSendAth, &(*it));
-    Pthread_create(wspace_ap->client_context_tbl_[*it]->p_tx_handle_raw_ack(), NULL, LaunchTxHandleRawAck, &(*it));
-    Pthread_create(wspace_ap->client_context_tbl_[*it]->p_tx_handle_data_ack(), NULL, LaunchTxHandleDataAck, &(*it));
+void WspaceAP::StartThreads() {
+  for (int i = 0; i < tun_->num_tun_queues_; i++) {
+    tun_queue_ids_[i] = i;
+    Pthread_create(&p_tx_read_tun_[i], NULL, LaunchTxReadTun, &tun_queue_ids_[i]);
+  }
+  /** Each receive shard and the feedback stages of its clients share one cpu. */
+  for (int i = 0; i < tun_->num_rcv_shards_; i++) {
+    rcv_shard_ids_[i] = i;
+    Pthread_create(&p_tx_rcv_cell_[i], NULL, LaunchTxRcvCell, &rcv_shard_ids_[i]);
+    if (tun_->num_rcv_shards_ > 1)
+      Pthread_setaffinity(p_tx_rcv_cell_[i], i);
+  }
+  Pthread_create(&p_tx_send_probe_, NULL, LaunchTxSendProbe, NULL);
+  if (bs_reporter_)
+    Pthread_create(&p_tx_send_report_, NULL, LaunchTxSendReport, NULL);
+  for(vector<int>::iterator it = client_ids_.begin(); it != client_ids_.end(); ++it) {
+    Pthread_create(client_context_tbl_[*it]->p_tx_send_ath(), NULL, LaunchTxSendAth, &(*it));
+    Pthread_create(client_context_tbl_[*it]->p_tx_handle_feedback(), NULL, LaunchTxHandleFeedback, &(*it));
+    if (tun_->num_rcv_shards_ > 1)
+      Pthread_setaffinity(*(client_context_tbl_[*it]->p_tx_handle_feedback()), tun_->ShardOf(*it));
   }
 #ifdef RAND_DROP
-  if (wspace_ap->use_loss_trace_) {
-    Pthread_create(&wspace_ap->p_tx_update_loss_rates_, NULL, LaunchUpdateLossRates, NULL);
+  if (use_loss_trace_) {
+    Pthread_create(&p_tx_update_loss_rates_, NULL, LaunchUpdateLossRates, NULL);
   }
 #endif
+}
 
-  Pthread_join(wspace_ap->p_tx_read_tun_, NULL);
-  Pthread_join(wspace_ap->p_tx_rcv_cell_, NULL);
-  Pthread_join(wspace_ap->p_tx_send_probe_, NULL);
-  for(vector<int>::iterator it = wspace_ap->client_ids_.begin(); it != wspace_ap->client_ids_.end(); ++it) {
-    Pthread_join(*(wspace_ap->client_context_tbl_[*it]->p_tx_send_ath()), NULL);
-    Pthread_join(*(wspace_ap->client_context_tbl_[*it]->p_tx_handle_raw_ack()), NULL);
-    Pthread_join(*(wspace_ap->client_context_tbl_[*it]->p_tx_handle_data_ack()), NULL);
+void WspaceAP::JoinThreads() {
+  for (int i = 0; i < tun_->num_tun_queues_; i++) {
+    Pthread_join(p_tx_read_tun_[i], NULL);
+  }
+  for (int i = 0; i < tun_->num_rcv_shards_; i++) {
+    Pthread_join(p_tx_rcv_cell_[i], NULL);
+  }
+  Pthread_join(p_tx_send_probe_, NULL);
+  if (bs_reporter_)
+    Pthread_join(p_tx_send_report_, NULL);
+  for(vector<int>::iterator it = client_ids_.begin(); it != client_ids_.end(); ++it) {
+    Pthread_join(*(client_context_tbl_[*it]->p_tx_send_ath()), NULL);
+    Pthread_join(*(client_context_tbl_[*it]->p_tx_handle_feedback()), NULL);
   }
 #ifdef RAND_DROP
-  if (wspace_ap->use_loss_trace_) {
-    Pthread_join(wspace_ap->p_tx_update_loss_rates_, NULL);
+  if (use_loss_trace_) {
+    Pthread_join(p_tx_update_loss_rates_, NULL);
   }
 #endif
-  delete wspace_ap;
-  return 0;
 }
 
-WspaceAP::WspaceAP(int argc, char *argv[], const char *optstring) 
-    : num_retrans_(0), coherence_time_(0), max_contiguous_time_out_(5),
-      probe_pkt_size_(10), probing_interval_(1000000) {
+WspaceAP::WspaceAP(int argc, char *argv[], const char *optstring, Tun *tun) 
+    : num_retrans_(0), 
+      airtime_quantum_(AirtimeScheduler::kDefaultQuantumUs), airtime_scheduler_(NULL), 
+      feedback_samples_(FeedbackAggregator::kDefaultMaxSamples), 
+      feedback_delay_ms_(FeedbackAggregator::kDefaultMaxDelayMs), 
+      report_interval_ms_(0), bs_reporter_(NULL), 
+      tun_(tun ? tun : new Tun), coherence_time_(0), max_contiguous_time_out_(5),
+      probing_interval_(1000000), probe_pkt_size_(10) {
 #ifdef RAND_DROP
   use_loss_trace_ = false;
   packet_drop_manager_ = new PacketDropManager(mac80211abg_rate, mac80211abg_num_rates);
@@ -100,42 +132,42 @@ WspaceAP::WspaceAP(int argc, char *argv[], const char *optstring)
         printf("ACK_TIME_OUT: %dms\n", ack_time_out_);
         break;
       case 't':
-        rtt_ = atoi(optarg);
-        printf("RTT: %dms\n", rtt_);
+        rtt_ = atoi(optarg);  /** Until the first RTT sample of each client. */
+        printf("INITIAL RTT: %dms\n", rtt_);
         break;
       case 'i':
-        strncpy(tun_.if_name_, optarg, IFNAMSIZ-1);
-        tun_.tun_type_ = IFF_TUN;
+        strncpy(tun_->if_name_, optarg, IFNAMSIZ-1);
+        tun_->tun_type_ = IFF_TUN;
         break;
       case 'S':
-        strncpy(tun_.server_ip_eth_,optarg,16);
-        printf("server_ip_eth: %s\n", tun_.server_ip_eth_);
+        strncpy(tun_->server_ip_eth_,optarg,16);
+        printf("server_ip_eth: %s\n", tun_->server_ip_eth_);
         break;
       case 'C':
-        strncpy(tun_.controller_ip_eth_,optarg,16);
-        printf("controller_ip_eth: %s\n", tun_.controller_ip_eth_);
+        strncpy(tun_->controller_ip_eth_,optarg,16);
+        printf("controller_ip_eth: %s\n", tun_->controller_ip_eth_);
         break;
       case 'I':
         bs_id_ = atoi(optarg);
         printf("bs_id_: %d\n", bs_id_);
         break;
       case 's':
-        strncpy(tun_.server_ip_ath_,optarg,16);
-        printf("server_ip_ath: %s\n", tun_.server_ip_ath_);
+        strncpy(tun_->server_ip_ath_,optarg,16);
+        printf("server_ip_ath: %s\n", tun_->server_ip_ath_);
         break;
       case 'M':
         coherence_time_ = atoi(optarg);
         printf("coherence_time[%gms]\n", coherence_time_/1000.);
         break;
       case 'm':
-        strncpy(tun_.broadcast_ip_ath_, optarg, 16);
-        printf("broadcast_ip_ath: %s\n", tun_.broadcast_ip_ath_);
+        strncpy(tun_->broadcast_ip_ath_, optarg, 16);
+        printf("broadcast_ip_ath: %s\n", tun_->broadcast_ip_ath_);
         break;
       case 'P':
-        tun_.port_eth_ = atoi(optarg);
+        tun_->port_eth_ = atoi(optarg);
         break;
       case 'p':
-        tun_.port_ath_ = atoi(optarg);
+        tun_->port_ath_ = atoi(optarg);
         break;
       case 'B':
         batch_time_out_ = atoi(optarg);
@@ -227,7 +259,7 @@ WspaceAP::WspaceAP(int argc, char *argv[], const char *optstring)
         break;
       }
       case 'b': {
-        ParseIP(client_ids_, tun_.client_ip_tbl_);
+        ParseIP(client_ids_, tun_->client_ip_tbl_);
         break;
       }
       case 'o': {
@@ -239,16 +271,74 @@ WspaceAP::WspaceAP(int argc, char *argv[], const char *optstring)
         probing_interval_ = atoi(optarg);
         break;
       }
+      case 'q': {
+        tun_->num_tun_queues_ = atoi(optarg);
+        if (tun_->num_tun_queues_ < 1 || tun_->num_tun_queues_ > MAX_TUN_QUEUES)
+          Perror("Invalid number of tun queues[%d], should be in [1, %d]\n", tun_->num_tun_queues_, MAX_TUN_QUEUES);
+        break;
+      }
+      case 'a':  /** Repair lost packets of coded batches with incremental redundancy. */
+        if ( client_ids_.size() == 0 )
+          Perror("Need to set client ids before setting harq_cache_ of client_context_tbl_\n");
+        if (atoi(optarg)) {
+          for (map<int, ClientContext*>::iterator it = client_context_tbl_.begin(); it != client_context_tbl_.end(); ++it) {
+            it->second->EnableHarq();
+          }
+        }
+        printf("HARQ: %d\n", atoi(optarg));
+        break;
+      case 'A':  /** DRR quantum of the airtime scheduler, 0 to disable it. */
+        airtime_quantum_ = atoi(optarg);
+        printf("Airtime quantum: %uus\n", airtime_quantum_);
+        break;
+      case 'L':  /** Pace whitespace by airtime, allowing a burst of this many us. 0 to disable. */
+        tun_->wspace_pacer_.set_burst_us(atoi(optarg));
+        printf("Whitespace pacing burst: %dus\n", atoi(optarg));
+        break;
+      case 'u':  /** Update the loss rates every this many raw packet statuses, 1 for every RAW_ACK. */
+        feedback_samples_ = atoi(optarg);
+        printf("Feedback samples per update: %u\n", feedback_samples_);
+        break;
+      case 'U':  /** Longest a raw packet status waits for the loss rate update, in ms. */
+        feedback_delay_ms_ = atoi(optarg);
+        printf("Feedback staleness: %ums\n", feedback_delay_ms_);
+        break;
+      case 'g':  /** Interval of the BS_REPORTs in ms, e.g., 100, needs a controller that takes them. 0 for a BS_STATS per update. */
+        report_interval_ms_ = atoi(optarg);
+        printf("Report interval: %ums\n", report_interval_ms_);
+        break;
+      case 'e': {
+        tun_->num_rcv_shards_ = atoi(optarg);
+        if (tun_->num_rcv_shards_ < 1 || tun_->num_rcv_shards_ > MAX_RCV_SHARDS)
+          Perror("Invalid number of receive shards[%d], should be in [1, %d]\n", tun_->num_rcv_shards_, MAX_RCV_SHARDS);
+        break;
+      }
       default:
         Perror("Usage: %s -i tun0/tap0 -S server_eth_ip -s server_ath_ip -C client_eth_ip -c client_ath_ip -m tcp/udp\n", argv[0]);
     }
   }
 
-  assert(tun_.if_name_[0] && tun_.broadcast_ip_ath_[0] && tun_.server_ip_eth_[0] && tun_.server_ip_ath_[0] && tun_.controller_ip_eth_[0] && bs_id_ && tun_.client_ip_tbl_.size());
-  for (map<int, string>::iterator it = tun_.client_ip_tbl_.begin(); it != tun_.client_ip_tbl_.end(); ++it) {
+  assert(tun_->if_name_[0] && tun_->broadcast_ip_ath_[0] && tun_->server_ip_eth_[0] && tun_->server_ip_ath_[0] && tun_->controller_ip_eth_[0] && bs_id_ && tun_->client_ip_tbl_.size());
+  for (map<int, string>::iterator it = tun_->client_ip_tbl_.begin(); it != tun_->client_ip_tbl_.end(); ++it) {
     assert(strlen(it->second.c_str()));
   }
   assert(coherence_time_ > 0);
+  for (map<int, ClientContext*>::iterator it = client_context_tbl_.begin(); it != client_context_tbl_.end(); ++it) {
+    it->second->rtt_estimator()->Reset(rtt_ * 1000);
+    it->second->data_pkt_buf()->set_rto_us(it->second->rtt_estimator()->rto_us());
+    it->second->feedback_aggregator()->set_max_samples(feedback_samples_);
+    it->second->feedback_aggregator()->set_max_delay_ms(feedback_delay_ms_);
+  }
+  if (airtime_quantum_ > 0)
+    airtime_scheduler_ = new AirtimeScheduler(client_ids_, airtime_quantum_);
+  if (report_interval_ms_ > 0)
+    bs_reporter_ = new BSReporter(bs_id_, client_ids_, report_interval_ms_);
+  tun_->AddShardKey(DATA_ACK, AckHeader::client_id_offset());
+  tun_->AddShardKey(RAW_ACK, AckHeader::client_id_offset());
+  tun_->AddShardKey(DATA_ACK_RANGE, AckHeader::client_id_offset());
+  tun_->AddShardKey(RAW_ACK_RANGE, AckHeader::client_id_offset());
+  tun_->AddShardKey(GPS, GPSHeader::client_id_offset());
+  tun_->AddShardKey(CONTROLLER_TO_CLIENT, ControllerToClientHeader::client_id_offset());
 #ifdef RAND_DROP
   srand(time(NULL));
 #endif
@@ -258,13 +348,16 @@ WspaceAP::~WspaceAP() {
   for (vector<int>::iterator it = client_ids_.begin(); it != client_ids_.end(); ++it) {
     delete client_context_tbl_[*it];
   }
+  delete airtime_scheduler_;
+  delete bs_reporter_;
+  delete tun_;
 #ifdef RAND_DROP
   delete packet_drop_manager_;
 #endif
 }
 
 void WspaceAP::Init() {
-  tun_.Init();
+  tun_->Init();
 }
 
 void WspaceAP::ParseIP(const vector<int> &ids, map<int, string> &ip_table) {
@@ -288,10 +381,11 @@ void WspaceAP::SendLossRate(int client_id) {
   double throughput = 0;
   double loss_rate = 0;
   double th = 0;
-  LossMap *loss_map = client_context_tbl_[client_id]->scout_rate_maker()->GetLossMap(ScoutRateAdaptation::kBack);
+  LossMap::Table loss_table;
+  client_context_tbl_[client_id]->scout_rate_maker()->GetLossMap(ScoutRateAdaptation::kBack)->GetSnapshot(&loss_table);
   //printf("Update loss rate\n");
   for (int i = 0; i < mac80211abg_num_rates; i++) {
-    loss_rate = loss_map->GetLossRate(mac80211abg_rate[i]);
+    loss_rate = loss_table[mac80211abg_rate[i]].loss;
     if(loss_rate == INVALID_LOSS_RATE)
       continue;
     th = mac80211abg_rate[i] * (1 - loss_rate) / 10.0;
@@ -299,14 +393,54 @@ void WspaceAP::SendLossRate(int client_id) {
     if(th > throughput)
       throughput = th;
   }
+  if (bs_reporter_) {  /** Goes out with the next BS_REPORT. */
+    BSClientReport report;
+    report.client_id_ = client_id;
+    report.throughput_ = throughput;
+    for (int i = 0; i < kNumRateInds; i++)
+      report.loss_[i] = loss_table.at_ind(i).loss;
+    bs_reporter_->Update(report);
+    return;
+  }
   BSStatsPkt pkt;
   pkt.Init(++client_context_tbl_[client_id]->bsstats_seq_, bs_id_, client_id, throughput);
   //pkt.Print();
-  tun_.Write(Tun::kControl, (char *)&pkt, sizeof(pkt));
+  tun_->Write(Tun::kControl, (char *)&pkt, sizeof(pkt));
 }
 
 
+/**
+ * Read packets from one tun queue, tag each with a ControllerToClientHeader 
+ * for the client owning its destination address and enqueue it directly, 
+ * the same way as packets relayed by the controller.
+ */
 void* WspaceAP::TxReadTun(void* arg) {
+  int queue = *(int*)arg;
+  static const uint16 kHdrLen = sizeof(ControllerToClientHeader);
+  char *bufs[kTunReadBatch], *ip_bufs[kTunReadBatch];
+  uint16 lens[kTunReadBatch];
+  for (int i = 0; i < kTunReadBatch; i++) {
+    bufs[i] = new char[PKT_SIZE];
+    ip_bufs[i] = bufs[i] + kHdrLen;
+  }
+  ControllerToClientHeader hdr;
+  hdr.set_o_seq(0);  /** Not relayed by the controller. */
+
+  while (1) {
+    int cnt = tun_->ReadTunBatch(queue, ip_bufs, lens, kTunReadBatch, kTunMTU - kHdrLen);
+    for (int i = 0; i < cnt; i++) {
+      int client_id = tun_->LookUpClient(ip_bufs[i], lens[i]);
+      map<int, ClientContext*>::iterator it = client_context_tbl_.find(client_id);
+      if (it == client_context_tbl_.end())
+        continue;
+      hdr.set_client_id(client_id);
+      memcpy(bufs[i], &hdr, kHdrLen);
+      it->second->data_pkt_buf()->EnqueuePkt(kHdrLen + lens[i], (uint8*)bufs[i]);
+    }
+  }
+
+  for (int i = 0; i < kTunReadBatch; i++)
+    delete[] bufs[i];
   return (void*)NULL;
 }
 
@@ -317,13 +451,29 @@ void WspaceAP::SendCodedBatch(uint32 extra_wait_time, bool is_duplicate, const v
   uint8 *encoded_payload=NULL;
   uint32 batch_duration=0;
   vector<uint32> seq_arr;
-  vector<RawPktSendStatus> status_vec;
 
   uint8 *pkt = new uint8[PKT_SIZE];
   AthCodeHeader *hdr = (AthCodeHeader*)pkt;
 
   assert(rate_arr.size() == client_context_tbl_[client_id]->encoder()->n());
 
+  if (airtime_scheduler_) {
+    uint16 pkt_size = ATH_CODE_HEADER_SIZE + MAX_BATCH_SIZE * sizeof(uint16) + client_context_tbl_[client_id]->encoder()->sz();
+    uint32 airtime = 0;
+    for (size_t j = 0; j < rate_arr.size(); j++)
+      airtime += AirtimeScheduler::PktDuration(pkt_size, rate_arr[j], extra_wait_time);
+    airtime_scheduler_->Acquire(client_id, airtime);
+  }
+
+  /** 
+   * Backpressure: hold the batch until whitespace can take all of it, but never 
+   * wait for the cellular duplicates - skip them if the controller link is backlogged.
+   */
+  tun_->WaitWritable(Tun::kWspace, client_context_tbl_[client_id]->encoder()->n());
+  if (is_duplicate && !tun_->IsWritable(Tun::kControl, client_context_tbl_[client_id]->encoder()->k())) {
+    is_duplicate = false;
+  }
+
   for (int j = 0; j < client_context_tbl_[client_id]->encoder()->n(); j++) {
     uint16 send_len=0;
     uint16 rate = rate_arr[j];
@@ -342,46 +492,96 @@ void WspaceAP::SendCodedBatch(uint32 extra_wait_time, bool is_duplicate, const v
     }
 #endif
 
-    /** Store raw packet info into the raw packet buffer. */
-    RawPktSendStatus status(hdr->raw_seq(), hdr->GetRate(), send_len, RawPktSendStatus::kUnknown);
-    client_context_tbl_[client_id]->feedback_handler()->raw_pkt_buf_.PushPktStatus(status_vec, status);
-    InsertFeedback(status_vec, client_id);
+    // only duplicate data packets + 1 redundant packet.
+    SendCodedPkt(hdr, send_len, rate, pkt_duration, is_duplicate && j < client_context_tbl_[client_id]->encoder()->k(), client_id);
+  }
 
+  if (airtime_scheduler_)
+    airtime_scheduler_->Release(client_id);
+  client_context_tbl_[client_id]->batch_id_++;
+  delete[] pkt;
+}
 
-    if (is_duplicate && j < client_context_tbl_[client_id]->encoder()->k()) { // only duplicate data packets + 1 redundant packet.
-#ifdef RAND_DROP
-      hdr->set_is_good(true);
-#endif
-      tun_.Write(Tun::kControl, (char*)hdr, send_len, client_id);/*
-      printf("Duplicate: client_id %d pkt_type:%d raw_seq_: %u batch_id_: %u seq_num: %u start_seq: %u coding_index: %d length: %u\n", 
-      client_id, (char*)hdr->GetPayloadStart()[0], hdr->raw_seq(), hdr->batch_id(), hdr->start_seq_ + hdr->ind_, hdr->start_seq_, hdr->ind_, send_len);*/
+void WspaceAP::SendRepairs(uint32 extra_wait_time, int client_id) {
+  HarqCache *harq_cache = client_context_tbl_[client_id]->harq_cache();
+  HarqRepair repair;
+  vector<uint16> rate_arr;
+  bool is_duplicate = false;
+  uint32 batch_id = 0;
+  uint16 sz = 0;
+  int cnt = 0;
+  uint8 *pkt = NULL;
+
+  while ((cnt = harq_cache->NextRepair(&batch_id, &sz)) > 0) {
+    /** k is how many symbols the client misses, n adds the redundancy on top. */
+    int k_local = cnt, n_local = 0;
+    uint16 pkt_size = ATH_CODE_HEADER_SIZE + MAX_BATCH_SIZE * sizeof(uint16) + sz;
+    client_context_tbl_[client_id]->scout_rate_maker()->MakeDecision(ScoutRateAdaptation::kRetrans, coherence_time_, pkt_size, 
+            extra_wait_time, k_local, n_local, rate_arr, is_duplicate);
+    if (!harq_cache->EncodeRepair(batch_id, n_local, &repair))
+      continue;
+    if (pkt == NULL)
+      pkt = new uint8[PKT_SIZE];
+    AthCodeHeader *hdr = (AthCodeHeader*)pkt;
+    if (airtime_scheduler_) {
+      uint32 airtime = 0;
+      for (int j = 0; j < repair.cnt; j++)
+        airtime += AirtimeScheduler::PktDuration(pkt_size, rate_arr[j], extra_wait_time);
+      airtime_scheduler_->Acquire(client_id, airtime);
     }
+    tun_->WaitWritable(Tun::kWspace, repair.cnt);
+    if (is_duplicate && !tun_->IsWritable(Tun::kControl, k_local)) {
+      is_duplicate = false;
+    }
+    for (int j = 0; j < repair.cnt; j++) {
+      /** n of the header covers the new indices, the client widens the batch with it. */
+      hdr->SetHeader(client_context_tbl_[client_id]->raw_seq_++, repair.batch_id, repair.start_seq, ATH_CODE, repair.first_ind + j, 
+                     repair.k, repair.first_ind + repair.cnt, repair.lens, bs_id_, client_id);
+      hdr->SetRate(rate_arr[j]);
+      memcpy(hdr->GetPayloadStart(), repair.symbols[j], repair.sz);
+      uint16 send_len = repair.sz + hdr->GetFullHdrLen();
+      SendCodedPkt(hdr, send_len, rate_arr[j], AirtimeScheduler::PktDuration(send_len, rate_arr[j], extra_wait_time), 
+                   is_duplicate && j < k_local, client_id);
+    }
+    if (airtime_scheduler_)
+      airtime_scheduler_->Release(client_id);
+  }
+  delete[] pkt;
+}
 
+void WspaceAP::SendCodedPkt(AthCodeHeader *hdr, uint16 send_len, uint16 rate, uint32 airtime, bool is_duplicate, int client_id) {
+  vector<RawPktSendStatus> status_vec;
+  /** Store raw packet info into the raw packet buffer. */
+  RawPktSendStatus status(hdr->raw_seq(), hdr->GetRate(), send_len, RawPktSendStatus::kUnknown);
+  client_context_tbl_[client_id]->feedback_handler()->raw_pkt_buf_.PushPktStatus(status_vec, status);
+  InsertFeedback(status_vec, client_id);
 
+  if (is_duplicate) {
 #ifdef RAND_DROP
-    if (IsDrop(client_id, rate) /*|| ((hdr->raw_seq() > 20000 && hdr->raw_seq() < 20040) || (hdr->raw_seq() > 20050 && hdr->raw_seq() < 25000))*/) { 
-    //if (IsDrop(drop_cnt, drop_inds, j)) {
-      hdr->set_is_good(false); /*
-      printf("Bad pkt: client_id: %d pkt_type:%d raw_seq_: %u batch_id: %u seq_num: %u start_seq: %u coding_index: %d length: %u rate: %u\n", client_id,  (char*)hdr->GetPayloadStart()[0], hdr->raw_seq(), hdr->batch_id(), hdr->start_seq_ + hdr->ind_, hdr->start_seq_, hdr->ind_, send_len, hdr->GetRate());*/
-    }
-    else { 
-      hdr->set_is_good(true); /*
-      printf("Good pkt: client_id: %d pkt_type:%d raw_seq_: %u batch_id: %u seq_num: %u start_seq: %u coding_index: %d length: %u rate: %u\n", client_id,  (char*)hdr->GetPayloadStart()[0], hdr->raw_seq(), hdr->batch_id(), hdr->start_seq_ + hdr->ind_, hdr->start_seq_, hdr->ind_, send_len, hdr->GetRate());*/
-    }
-#else /*
-    printf("Send: client_context_tbl_[%d]->raw_seq_: %u client_context_tbl_[%d]->batch_id_: %u seq_num: %u start_seq: %u coding_index: %d length: %u rate: %u\n", client_id, hdr->raw_seq(), client_id, hdr->batch_id(), hdr->start_seq_ + hdr->ind_, hdr->start_seq_, hdr->ind_, send_len, hdr->GetRate());*/
+    hdr->set_is_good(true);
 #endif
-    //printf("send_len: %d\n", send_len);
-    tun_.Write(Tun::kWspace, (char*)hdr, send_len);
-    //not_drop = false;
-
-    /** Flow control.*/
-    //usleep(pkt_duration);
-    //printf("pkt_duration: %u\n", pkt_duration);
+    tun_->Write(Tun::kControl, (char*)hdr, send_len, client_id);/*
+    printf("Duplicate: client_id %d pkt_type:%d raw_seq_: %u batch_id_: %u seq_num: %u start_seq: %u coding_index: %d length: %u\n", 
+    client_id, (char*)hdr->GetPayloadStart()[0], hdr->raw_seq(), hdr->batch_id(), hdr->start_seq_ + hdr->ind_, hdr->start_seq_, hdr->ind_, send_len);*/
   }
 
-  client_context_tbl_[client_id]->batch_id_++;
-  delete[] pkt;
+
+#ifdef RAND_DROP
+  if (IsDrop(client_id, rate) /*|| ((hdr->raw_seq() > 20000 && hdr->raw_seq() < 20040) || (hdr->raw_seq() > 20050 && hdr->raw_seq() < 25000))*/) { 
+  //if (IsDrop(drop_cnt, drop_inds, j)) {
+    hdr->set_is_good(false); /*
+    printf("Bad pkt: client_id: %d pkt_type:%d raw_seq_: %u batch_id: %u seq_num: %u start_seq: %u coding_index: %d length: %u rate: %u\n", client_id,  (char*)hdr->GetPayloadStart()[0], hdr->raw_seq(), hdr->batch_id(), hdr->start_seq_ + hdr->ind_, hdr->start_seq_, hdr->ind_, send_len, hdr->GetRate());*/
+  }
+  else { 
+    hdr->set_is_good(true); /*
+    printf("Good pkt: client_id: %d pkt_type:%d raw_seq_: %u batch_id: %u seq_num: %u start_seq: %u coding_index: %d length: %u rate: %u\n", client_id,  (char*)hdr->GetPayloadStart()[0], hdr->raw_seq(), hdr->batch_id(), hdr->start_seq_ + hdr->ind_, hdr->start_seq_, hdr->ind_, send_len, hdr->GetRate());*/
+  }
+#else /*
+  printf("Send: client_context_tbl_[%d]->raw_seq_: %u client_context_tbl_[%d]->batch_id_: %u seq_num: %u start_seq: %u coding_index: %d length: %u rate: %u\n", client_id, hdr->raw_seq(), client_id, hdr->batch_id(), hdr->start_seq_ + hdr->ind_, hdr->start_seq_, hdr->ind_, send_len, hdr->GetRate());*/
+#endif
+  //printf("send_len: %d\n", send_len);
+  tun_->Write(Tun::kWspace, (char*)hdr, send_len, 0, airtime);  /** Paced by Tun if enabled. */
+  //not_drop = false;
 }
 
 void* WspaceAP::TxSendAth(void* arg) {
@@ -412,6 +612,8 @@ void* WspaceAP::TxSendAth(void* arg) {
     //printf("TxSendAth:: state[%d]\n", int(state));
     switch (state) {
       case kHandleNewPkt:
+        if (client_context_tbl_[*client_id]->harq_cache())
+          SendRepairs(kExtraWaitTime, *client_id);
         is_timeout = client_context_tbl_[*client_id]->data_pkt_buf()->DequeuePkt(batch_time_out_, &seq_num, &len, &pkt_status, &num_retrans, &index, &buf_addr);
         if (is_timeout) { 
           state = kHandlePartialBatch;
@@ -458,25 +660,43 @@ void* WspaceAP::TxSendAth(void* arg) {
         }
         break;
 
-      case kHandleRetransmission:  /** Retransmit one packet at a time. */
-        /** Include the retransmited packet as the only packet in this batch. */
+      case kHandleRetransmission: {  
+        /** 
+         * Code the retransmitted packet together with the retransmissions that follow 
+         * it in sequence, the batch header only describes consecutive packets.
+         */
         handle_retransmission = false;
-        k_local = 1;
-        pkt_size = ATH_CODE_HEADER_SIZE + MAX_BATCH_SIZE * sizeof(uint16) + len;
+        uint16 max_len = 0;
+        k_local = 1 + client_context_tbl_[*client_id]->data_pkt_buf()->CountRetransRun(seq_num + 1, MAX_BATCH_SIZE - 1, &max_len);
+        if (len > max_len)
+          max_len = len;
+        pkt_size = ATH_CODE_HEADER_SIZE + MAX_BATCH_SIZE * sizeof(uint16) + max_len;
         client_context_tbl_[*client_id]->scout_rate_maker()->MakeDecision(ScoutRateAdaptation::kRetrans, coherence_time_, pkt_size, 
                 kExtraWaitTime, k_local, n_local, rate_arr, is_duplicate_cell);
-        client_context_tbl_[*client_id]->encoder()->SetCodeInfo(k_local, n_local, seq_num);  /** Sequence number of the retransmitted packet.*/
+        client_context_tbl_[*client_id]->encoder()->SetCodeInfo(k_local, n_local, seq_num);  /** Sequence number of the first retransmitted packet.*/
         //if (is_duplicate_cell) client_context_tbl_[*client_id]->data_pkt_buf()->DisableRetransmission(index);
         assert(client_context_tbl_[*client_id]->encoder()->PushPkt(len, buf_addr));  
         coding_pkt_cnt++;
+        while (coding_pkt_cnt < k_local && client_context_tbl_[*client_id]->data_pkt_buf()->DequeueRetransPkt(
+                 seq_num + coding_pkt_cnt, &len, &num_retrans, &index, &buf_addr)) {
+          assert(client_context_tbl_[*client_id]->encoder()->PushPkt(len, buf_addr));  
+          coding_pkt_cnt++;
+        }
+        if (coding_pkt_cnt < k_local) {  /** Some were acked since they were counted. */
+          k_local = coding_pkt_cnt;
+          client_context_tbl_[*client_id]->encoder()->SetCodeInfo(k_local, n_local);
+        }
         /** Duplicate packets over the cellular if this is the last retransmission.*/
         //if (pkt_status == kOccupiedRetrans && num_retrans == 0) not_drop = true;
         state = kHandleEncoding;
         break;
+      }
 
       case kHandleEncoding:
         assert(coding_pkt_cnt > 0);
         client_context_tbl_[*client_id]->encoder()->EncodeBatch();
+        if (client_context_tbl_[*client_id]->harq_cache())
+          client_context_tbl_[*client_id]->harq_cache()->Store(client_context_tbl_[*client_id]->batch_id_, client_context_tbl_[*client_id]->encoder());
 #ifdef RAND_DROP
 /*
         int drop_cnt, *drop_inds;
@@ -521,18 +741,36 @@ void* WspaceAP::TxSendProbe(void* arg) {
   }
 }
 
-bool WspaceAP::HandleDataAck(char type, uint32 ack_seq, uint16 num_nacks, uint32 end_seq, uint32* nack_arr, int client_id) {
+void* WspaceAP::TxSendReport(void* arg) {
+  BSReportPkt pkt;
+  printf("TxSendReport start, interval:%ums\n", bs_reporter_->interval_ms());
+  while (1) {
+    bs_reporter_->WaitReport(&pkt);
+    if (pkt.num_clients_ == 0)
+      continue;
+    //pkt.Print();
+    tun_->Write(Tun::kControl, (char *)&pkt, pkt.GetLen());
+  }
+  return (void*)NULL;
+}
+
+bool WspaceAP::HandleDataAck(char type, uint32 ack_seq, uint16 num_nacks, uint32 end_seq, const NackRun *nack_runs, uint16 num_runs, int client_id) {
   uint32 index=0, head_pt=0, curr_pt=0, tail_pt=0, head_pt_final=0, curr_pt_final=0;
   uint32 seq_num=0;
-  uint16 nack_cnt=0, len=0; 
+  uint16 len=0;
   uint8 num_retrans=0;
   Status stat;
   TIME start, end;
-
-
-  if (ack_seq < client_context_tbl_[client_id]->expect_data_ack_seq_)  /** Out of order acks.*/
-    return false;
-  else
+  NackCursor nacks(nack_runs, num_runs);
+
+  /** 
+   * The buffer is the merged set of packets the client has reported: acked 
+   * slots are freed, so an ACK overtaken by a newer one on the cellular link 
+   * is still merged in. Its NACKs are out of date, only the newer ACK's drive
+   * retransmissions.
+   */
+  bool is_stale = ack_seq < client_context_tbl_[client_id]->expect_data_ack_seq_;
+  if (!is_stale)
     client_context_tbl_[client_id]->expect_data_ack_seq_ = ack_seq+1;
 
   if (end_seq == 0)  /** Pocking for the first batch.*/
@@ -560,11 +798,13 @@ bool WspaceAP::HandleDataAck(char type, uint32 ack_seq, uint16 num_nacks, uint32
   }
 #endif
 
-  //PrintNackInfo(type, ack_seq, num_nacks, end_seq, nack_arr);
+  //PrintNackInfo(type, ack_seq, num_nacks, end_seq, nack_runs, num_runs);
 
-  if (end_seq-1 < head_pt) {  // dup ack
+  if (end_seq-1 < head_pt) {  // no new information
     //printf("DUP ACK end_seq[%u] head_pt[%u]\n", end_seq, head_pt);
     client_context_tbl_[client_id]->data_pkt_buf()->UnLockQueue();
+    if (is_stale || head_pt >= curr_pt)  /** Reordered, or nothing outstanding to be acked. */
+      return false;
     client_context_tbl_[client_id]->dup_data_ack_cnt_++;
     if (client_context_tbl_[client_id]->dup_data_ack_cnt_ >= kMaxDupAckCnt) { 
       client_context_tbl_[client_id]->dup_data_ack_cnt_ = 0;
@@ -578,19 +818,47 @@ bool WspaceAP::HandleDataAck(char type, uint32 ack_seq, uint16 num_nacks, uint32
   client_context_tbl_[client_id]->dup_data_ack_cnt_ = 0;
   client_context_tbl_[client_id]->contiguous_time_out_ = 0;
 
+  /** 
+   * Sample the RTT on the oldest packet this ACK newly acknowledges, so that the
+   * sample includes the time the client holds it until its next ACK. Only 
+   * packets sent once are sampled (Karn).
+   */
+  if (!is_stale && head_pt < tail_pt && (num_nacks == 0 || nack_runs[0].seq > head_pt+1)) {
+    uint32 index_mod = head_pt % BUF_SIZE;
+    client_context_tbl_[client_id]->data_pkt_buf()->LockElement(index_mod);
+    client_context_tbl_[client_id]->data_pkt_buf()->GetBookKeeping(index_mod, &seq_num, &stat, &len, &num_retrans, &start);
+    client_context_tbl_[client_id]->data_pkt_buf()->UnLockElement(index_mod);
+    if (stat == kOccupiedOutbound && seq_num == head_pt+1 && num_retrans == client_context_tbl_[client_id]->data_pkt_buf()->num_retrans()) {
+      end.GetCurrTime();
+      client_context_tbl_[client_id]->rtt_estimator()->AddSample(end - start);
+      client_context_tbl_[client_id]->data_pkt_buf()->set_rto_us(client_context_tbl_[client_id]->rtt_estimator()->rto_us());
+    }
+  }
+  double rto = client_context_tbl_[client_id]->rtt_estimator()->rto_us() / 1000.;  // in ms
+
+  /** 
+   * Fast path for a loss-free ACK of packets all sent: once the last dequeue
+   * is done, slots below curr_pt are only modified under the queue lock, so 
+   * release them in one go.
+   */
+  if (num_nacks == 0 && end_seq <= curr_pt) {
+    client_context_tbl_[client_id]->data_pkt_buf()->WaitDequeue(head_pt, end_seq);
+    client_context_tbl_[client_id]->data_pkt_buf()->ClearBookKeeping(head_pt, end_seq);
+    client_context_tbl_[client_id]->data_pkt_buf()->set_head_pt(end_seq);
+    client_context_tbl_[client_id]->data_pkt_buf()->SignalEmpty();
+    client_context_tbl_[client_id]->data_pkt_buf()->UnLockQueue();
+    return false;
+  }
+
   if (num_nacks == 0) {
     head_pt_final = end_seq; // point to the first unacked/acked pkt
     // No need to change curr without retrans
   }
   else if (num_nacks > 0) {  // Need to retransmit
-    while (nack_arr[nack_cnt]-1 < head_pt_final) {
-      nack_cnt++;
-      if (nack_cnt == num_nacks)
-        break;
-    }
-    if (nack_cnt < num_nacks) {
-      if (nack_arr[nack_cnt]-1 > head_pt_final) {
-        head_pt_final = nack_arr[nack_cnt]-1;
+    nacks.SkipTo(head_pt_final+1);
+    if (!nacks.IsDone()) {
+      if (nacks.seq()-1 > head_pt_final) {
+        head_pt_final = nacks.seq()-1;
       }
     }
   }
@@ -603,6 +871,7 @@ bool WspaceAP::HandleDataAck(char type, uint32 ack_seq, uint16 num_nacks, uint32
   }
 
   bool IsFirstUpdate = true;
+  bool is_repair = false;
   //printf("HandleDataAck head_pt[%u] cur_pt[%u] tail_pt[%u]\n", head_pt, curr_pt, tail_pt);
   if (num_nacks > 0) {    //handle nacked packets if any 
     end.GetCurrTime();
@@ -611,27 +880,37 @@ bool WspaceAP::HandleDataAck(char type, uint32 ack_seq, uint16 num_nacks, uint32
       client_context_tbl_[client_id]->data_pkt_buf()->LockElement(index_mod);
       client_context_tbl_[client_id]->data_pkt_buf()->GetBookKeeping(index_mod, &seq_num, &stat, &len, &num_retrans, &start);
       if (stat == kOccupiedOutbound) { 
-        if (nack_cnt < num_nacks) {
-          if (index+1 == nack_arr[nack_cnt]) {  // NACK (packet is lost)
+        if (!nacks.IsDone()) {
+          if (index+1 == nacks.seq() && is_stale) {  // Outdated NACK
+            nacks.Next();
+          }
+          else if (index+1 == nacks.seq()) {  // NACK (packet is lost)
             double interval = (end - start) / 1000.;  // in ms
             if (num_retrans == 0) {
-              /*printf("HandleDataAck: Giveup pkt[%u] interval[%gms] rtt[%dms]\n", 
-                nack_arr[nack_cnt], interval, rtt_);*/
+              /*printf("HandleDataAck: Giveup pkt[%u] interval[%gms] rto[%gms]\n", 
+                nacks.seq(), interval, rto);*/
               if (head_pt_final == index) {
                 head_pt_final++; //  reclaim buffer
               }
               client_context_tbl_[client_id]->data_pkt_buf()->UpdateBookKeeping(index_mod, 0, kEmpty, 0, 0, false);
             }
-            else if (interval > rtt_ || num_retrans == num_retrans_) {  // Timeout or first retrans
-              client_context_tbl_[client_id]->data_pkt_buf()->GetElementStatus(index_mod) = kOccupiedRetrans;
-              /*printf("HandleDataAck: Retransmit pkt[%u] num_retrans[%u] interval[%gms] rtt[%dms]\n", 
-                nack_arr[nack_cnt], num_retrans, interval, rtt_);*/
-              if (IsFirstUpdate) {
-                IsFirstUpdate = false;
-                curr_pt_final = index;  // start retrans from here
-              } 
+            else if (interval > rto || num_retrans == num_retrans_) {  // Timeout or first retrans
+              HarqCache *harq_cache = client_context_tbl_[client_id]->harq_cache();
+              if (harq_cache && harq_cache->RequestRepair(index+1)) {  // Repaired by a fresh symbol of its batch
+                client_context_tbl_[client_id]->data_pkt_buf()->ConsumeRetrans(index_mod);
+                is_repair = true;
+              }
+              else {
+                client_context_tbl_[client_id]->data_pkt_buf()->GetElementStatus(index_mod) = kOccupiedRetrans;
+                /*printf("HandleDataAck: Retransmit pkt[%u] num_retrans[%u] interval[%gms] rto[%gms]\n", 
+                  nacks.seq(), num_retrans, interval, rto);*/
+                if (IsFirstUpdate) {
+                  IsFirstUpdate = false;
+                  curr_pt_final = index;  // start retrans from here
+                } 
+              }
             }
-            nack_cnt++;
+            nacks.Next();
           }
           else {  // The packet is received (holes) 
             //printf("Receive[%u]\n", index+1);
@@ -650,9 +929,9 @@ bool WspaceAP::HandleDataAck(char type, uint32 ack_seq, uint16 num_nacks, uint32
         }
       }
       else if (stat == kEmpty) {  
-        if (nack_cnt < num_nacks) {
-          if ((nack_arr[nack_cnt]-1) % BUF_SIZE == index_mod) {  // Pkts already dropped
-            nack_cnt++;
+        if (!nacks.IsDone()) {
+          if ((nacks.seq()-1) % BUF_SIZE == index_mod) {  // Pkts already dropped
+            nacks.Next();
           } 
         }
         if (head_pt_final == index) {
@@ -660,13 +939,13 @@ bool WspaceAP::HandleDataAck(char type, uint32 ack_seq, uint16 num_nacks, uint32
         }
       }
       else {  // kOccupiedNew kOccupiedRetrans
-        if (nack_cnt < num_nacks) {
-          if (nack_arr[nack_cnt] == seq_num) {
-            if (IsFirstUpdate) {
+        if (!nacks.IsDone()) {
+          if (nacks.seq() == seq_num) {
+            if (IsFirstUpdate && !is_stale) {
               IsFirstUpdate = false;
               curr_pt_final = index;  // start retrans from here
             } 
-            nack_cnt++;
+            nacks.Next();
           }
           else { 
             client_context_tbl_[client_id]->data_pkt_buf()->UpdateBookKeeping(index_mod, 0, kEmpty, 0, 0, false);
@@ -684,11 +963,11 @@ bool WspaceAP::HandleDataAck(char type, uint32 ack_seq, uint16 num_nacks, uint32
       }
       client_context_tbl_[client_id]->data_pkt_buf()->UnLockElement(index_mod);
     }
-    if (nack_cnt != num_nacks) {
-      //PrintNackInfo(type, ack_seq, num_nacks, end_seq, nack_arr);
-      printf("WARNING: HandleDataAck client_id[%d] nack_cnt[%d] != num_nacks[%d]\n", client_id, nack_cnt, num_nacks);
+    if (nacks.cnt() != num_nacks) {
+      //PrintNackInfo(type, ack_seq, num_nacks, end_seq, nack_runs, num_runs);
+      printf("WARNING: HandleDataAck client_id[%d] nack_cnt[%d] != num_nacks[%d]\n", client_id, nacks.cnt(), num_nacks);
     }
-    //assert(nack_cnt == num_nacks);
+    //assert(nacks.cnt() == num_nacks);
   }
 
   /** Check for packet timeout after end_seq.*/
@@ -724,88 +1003,85 @@ bool WspaceAP::HandleDataAck(char type, uint32 ack_seq, uint16 num_nacks, uint32
     client_context_tbl_[client_id]->data_pkt_buf()->SignalFill();
   }
   client_context_tbl_[client_id]->data_pkt_buf()->UnLockQueue();
+  if (is_repair)  /** TxSendAth may be waiting for new packets. */
+    client_context_tbl_[client_id]->data_pkt_buf()->WakeUp();
   return false;
 }
 
-void WspaceAP::HandleTimeOut(int client_id) {
-  uint32 index=0, head_pt=0, curr_pt=0, tail_pt=0, head_pt_final=0, curr_pt_final=0;
-  TIME start, end; 
+bool WspaceAP::ExpireRetransTimers(int client_id) {
+  TxDataBuf *data_pkt_buf = client_context_tbl_[client_id]->data_pkt_buf();
+  uint32 head_pt=0, curr_pt=0, tail_pt=0, head_pt_final=0, curr_pt_final=0;
   uint32 seq_num=0;
   uint16 len=0;
   uint8 num_retrans=0;
   Status stat;
-  vector<RawPktSendStatus> status_vec;
-
-  client_context_tbl_[client_id]->data_pkt_buf()->LockQueue();
-  head_pt = client_context_tbl_[client_id]->data_pkt_buf()->head_pt();
-  curr_pt = client_context_tbl_[client_id]->data_pkt_buf()->curr_pt();
-  tail_pt = client_context_tbl_[client_id]->data_pkt_buf()->tail_pt();
-
-  bool IsFirstUpdate=true;
+  vector<uint32> expired;
+  bool is_retrans = false;
+
+  data_pkt_buf->LockQueue();
+  data_pkt_buf->ExpireRetransTimers(&expired);
+  head_pt = data_pkt_buf->head_pt();
+  curr_pt = data_pkt_buf->curr_pt();
+  tail_pt = data_pkt_buf->tail_pt();
   head_pt_final = head_pt;
   curr_pt_final = curr_pt;
-  end.GetCurrTime();
-  //printf("timeout head_pt[%u] curr_pt[%u] tail_pt[%u]\n", head_pt, curr_pt, tail_pt);
-  bool increment_time_out = false;
 
-  for (index = head_pt; index < tail_pt; index++) {
-    uint32 index_mod = index % BUF_SIZE;    
-    client_context_tbl_[client_id]->data_pkt_buf()->LockElement(index_mod);
-    client_context_tbl_[client_id]->data_pkt_buf()->GetBookKeeping(index_mod, &seq_num, &stat, &len, &num_retrans, &start);
-    if (stat == kOccupiedRetrans) {  /** Haven't finished this round of retransmission. */
-      if (IsFirstUpdate) {
-        assert(seq_num>=1);
-        curr_pt_final = seq_num - 1;  // Retransmission starts from the first timeout pkt
-        IsFirstUpdate = false;
-      }
-    }
-    else if (stat == kOccupiedOutbound) {
-      double interval = (end - start)/1000.;
+  for (vector<uint32>::iterator it = expired.begin(); it != expired.end(); ++it) {
+    data_pkt_buf->LockElement(*it);
+    data_pkt_buf->GetBookKeeping(*it, &seq_num, &stat, &len, &num_retrans, NULL);
+    if (stat == kOccupiedOutbound) {  /** Otherwise acked or nacked since it was sent. */
       if (num_retrans == 0) {  //  Have to drop this packet
-        if (head_pt_final == seq_num-1) {
-          head_pt_final++; //  reclaim buffer
-        }
-        client_context_tbl_[client_id]->data_pkt_buf()->UpdateBookKeeping(index_mod, 0, kEmpty, 0, 0, false);
-        /*printf("HandleTimeOut: Drop pkt[%u] interval[%gms] rtt[%dms]\n", 
-            seq_num, interval, rtt_);*/
+        data_pkt_buf->UpdateBookKeeping(*it, 0, kEmpty, 0, 0, false);
+        //printf("ExpireRetransTimers: Drop pkt[%u]\n", seq_num);
       }
-      else if (interval > rtt_ * 1.2) {  // set up retransmission
-        increment_time_out = true;  /** Ack timeout and there is timeouted packet. */
-        if (IsFirstUpdate) {
-          assert(seq_num>=1);
+      else {  // set up retransmission
+        is_retrans = true;
+        assert(seq_num>=1);
+        if (seq_num - 1 < curr_pt_final)
           curr_pt_final = seq_num - 1;  // Retransmission starts from the first timeout pkt
-          IsFirstUpdate = false;
-        }
-        client_context_tbl_[client_id]->data_pkt_buf()->GetElementStatus(index_mod) = kOccupiedRetrans;
-        /*printf("HandleTimeOut: Retransmit pkt[%u] num_retrans[%u] interval[%gms] rtt[%dms]\n", 
-            seq_num, num_retrans, interval, rtt_);*/
-      }
-    }
-    else if (stat == kEmpty) {
-      // See whether we can reclaim more storage
-      if (head_pt_final == index) {
-        head_pt_final++; 
+        data_pkt_buf->GetElementStatus(*it) = kOccupiedRetrans;
+        //printf("ExpireRetransTimers: Retransmit pkt[%u] num_retrans[%u]\n", seq_num, num_retrans);
       }
     }
-    client_context_tbl_[client_id]->data_pkt_buf()->UnLockElement(index_mod);
-    if (stat == kOccupiedNew) break;
+    data_pkt_buf->UnLockElement(*it);
+  }
+
+  /** See whether we can reclaim more storage. */
+  while (head_pt_final < tail_pt) {
+    uint32 index_mod = head_pt_final % BUF_SIZE;
+    data_pkt_buf->LockElement(index_mod);
+    bool is_empty = (data_pkt_buf->GetElementStatus(index_mod) == kEmpty);
+    data_pkt_buf->UnLockElement(index_mod);
+    if (!is_empty)
+      break;
+    head_pt_final++;
   }
   if (curr_pt_final < head_pt_final) {
     curr_pt_final = head_pt_final;
   }
   if (head_pt_final > head_pt) {
-    client_context_tbl_[client_id]->data_pkt_buf()->set_head_pt(head_pt_final);
-    client_context_tbl_[client_id]->data_pkt_buf()->SignalEmpty();
+    data_pkt_buf->set_head_pt(head_pt_final);
+    data_pkt_buf->SignalEmpty();
   }
   if (curr_pt_final != curr_pt) {
-    client_context_tbl_[client_id]->data_pkt_buf()->set_curr_pt(curr_pt_final);
-    client_context_tbl_[client_id]->data_pkt_buf()->SignalFill();
+    data_pkt_buf->set_curr_pt(curr_pt_final);
+    data_pkt_buf->SignalFill();
   }
-  client_context_tbl_[client_id]->data_pkt_buf()->UnLockQueue();
+  data_pkt_buf->UnLockQueue();
+  return is_retrans;
+}
+
+void WspaceAP::HandleTimeOut(int client_id, bool is_retrans) {
+  vector<RawPktSendStatus> status_vec;
+  /** Ack timeout and there is timeouted packet in this round. */
+  bool increment_time_out = ExpireRetransTimers(client_id) || is_retrans;
 
   /** No need the lock to guard between HandleDataAck and HandleTimeOut because they are serialized. */
-  if (increment_time_out)
+  if (increment_time_out) {
     client_context_tbl_[client_id]->contiguous_time_out_++;
+    client_context_tbl_[client_id]->rtt_estimator()->Backoff();
+    client_context_tbl_[client_id]->data_pkt_buf()->set_rto_us(client_context_tbl_[client_id]->rtt_estimator()->rto_us());
+  }
   else if (client_context_tbl_[client_id]->contiguous_time_out_ < max_contiguous_time_out_)
     client_context_tbl_[client_id]->contiguous_time_out_ = 0;  
 
@@ -816,41 +1092,107 @@ void WspaceAP::HandleTimeOut(int client_id) {
 
     client_context_tbl_[client_id]->scout_rate_maker()->SetHighLoss();
     client_context_tbl_[client_id]->feedback_handler()->raw_pkt_buf_.ClearPktStatus(status_vec, true);
-    InsertFeedback(status_vec, client_id);
+    InsertFeedback(status_vec, client_id, true);
   }
 }
   
-void* WspaceAP::TxHandleDataAck(void *arg) {
+void* WspaceAP::TxHandleFeedback(void *arg) {
   int *client_id = (int*)arg;
-  printf("TxHandleDataAck start, client_id:%d\n", *client_id);
-  uint16 num_nacks=0;
+  printf("TxHandleFeedback start, client_id:%d\n", *client_id);
+  ClientContext *context = client_context_tbl_[*client_id];
+  char *pkts = new char[AckContext::kNumSlots * PKT_SIZE];
+  uint16 lens[AckContext::kNumSlots];
+  NackRun *nack_runs = new NackRun[AckRangePkt::kMaxParsedRuns];
+  vector<RawPktSendStatus> status_vec;
+  uint16 num_nacks=0, num_pkts=0, num_runs=0;
   uint32 ack_seq=0, end_seq=0;
-  uint32 *nack_seq_arr = new uint32[ACK_WINDOW];
   char type;
-  bool is_ack_available=false; 
-  bool dup_ack_timeout = false;
-  int bs_id = 0;
+  int client = 0, bs_id = 0;
+  TIME round_start, now;      /** Start of the current ACK timeout round. */
+  bool is_retrans = false;    /** Packets timed out earlier in this round. */
+  round_start.GetCurrTime();
   while (1) {
-    is_ack_available = TxHandleAck(*(client_context_tbl_[*client_id]->data_ack_context()), &type, &ack_seq, &num_nacks, &end_seq, *client_id, &bs_id, nack_seq_arr);
-    if (is_ack_available) {
-      dup_ack_timeout = HandleDataAck(type, ack_seq, num_nacks, end_seq, nack_seq_arr, *client_id);
-      if (dup_ack_timeout) { 
-        //printf("Dup ack timeout! client_context_tbl_[%d]->contiguous_time_out_[%d]\n", *client_id, client_context_tbl_[*client_id]->contiguous_time_out_); 
-        HandleTimeOut(*client_id);
+    /** Wake up for the next retransmission timer if it is due before the ACK timeout. */
+    now.GetCurrTime();
+    int wait_ms = ack_time_out_ - int((now - round_start) / 1000.);
+    int timer_ms = context->data_pkt_buf()->NextRetransTimeOut();
+    if (timer_ms >= 0 && timer_ms < wait_ms)
+      wait_ms = timer_ms;
+    int due_ms = context->feedback_aggregator()->TimeToDueMs();
+    if (due_ms >= 0 && due_ms < wait_ms)
+      wait_ms = due_ms;
+    int num_acks = wait_ms > 0 ? TxHandleAck(*context->ack_context(), pkts, lens, wait_ms) : 0;
+    if (num_acks == 0) {
+      /** Woken up by a retransmission timer, stale statuses, or no DATA_ACK for a whole ack_time_out_. */
+      if (context->feedback_aggregator()->TimeToDueMs() == 0)
+        UpdateFeedback(*client_id);
+      now.GetCurrTime();
+      if ((now - round_start) / 1000. >= ack_time_out_) {
+        HandleTimeOut(*client_id, is_retrans);
+        round_start = now;
+        is_retrans = false;
+      }
+      else if (ExpireRetransTimers(*client_id)) {
+        is_retrans = true;
       }
+      continue;
     }
-    else {
-      HandleTimeOut(*client_id);
+
+    /** In arrival order, the raw packet status is collected for one InsertFeedback. */
+    bool is_data_ack = false, dup_ack_timeout = false;
+    status_vec.clear();
+    for (int i = 0; i < num_acks; i++) {
+      if (!AckContext::ParseNack(pkts + i * PKT_SIZE, lens[i], &type, &ack_seq, &num_nacks, &end_seq, &client, &bs_id, 
+                                 nack_runs, &num_runs, &num_pkts)) {
+        printf("TxHandleFeedback: Warning drop truncated ack type[%d] len[%u]\n", pkts[i * PKT_SIZE], lens[i]);
+        continue;
+      }
+      assert(client == *client_id && bs_id == bs_id_);
+      //PrintNackInfo(type, ack_seq, num_nacks, end_seq, nack_runs, num_runs, num_pkts);
+      if (type == DATA_ACK) {
+        is_data_ack = true;
+        if (HandleDataAck(type, ack_seq, num_nacks, end_seq, nack_runs, num_runs, *client_id)) {
+          //printf("Dup ack timeout! client_context_tbl_[%d]->contiguous_time_out_[%d]\n", *client_id, context->contiguous_time_out_); 
+          InsertFeedback(status_vec, *client_id);  /** Keep the feedback in order of the raw packets. */
+          status_vec.clear();
+          HandleTimeOut(*client_id);
+          dup_ack_timeout = true;
+        }
+      }
+      else {
+        HandleRawAck(ack_seq, num_nacks, end_seq, num_pkts, nack_runs, num_runs, *client_id, status_vec);
+      }
+    }
+    InsertFeedback(status_vec, *client_id);  /** For scout. */
+    if (is_data_ack) {
+      if (!dup_ack_timeout)
+        ExpireRetransTimers(*client_id);  /** Don't let a steady ACK stream hold back the timers. */
+      round_start.GetCurrTime();
+      is_retrans = false;
     }
   }
-  delete[] nack_seq_arr;
+  delete[] nack_runs;
+  delete[] pkts;
+}
+
+void WspaceAP::HandleRawAck(uint32 ack_seq, uint16 num_nacks, uint32 end_seq, uint16 num_pkts, const NackRun *nack_runs, 
+                            uint16 num_runs, int client_id, vector<RawPktSendStatus> &status_vec) {
+  if (ack_seq >= client_context_tbl_[client_id]->expect_raw_ack_seq_) {
+    client_context_tbl_[client_id]->expect_raw_ack_seq_ = ack_seq + 1;
+    client_context_tbl_[client_id]->feedback_handler()->raw_pkt_buf_.PopPktStatus(end_seq, num_pkts, nack_runs, num_runs, status_vec);
+  }/*
+  else
+    printf("Warning: out of order raw ack seq[%u] expect_seq[%u]\n", ack_seq, client_context_tbl_[client_id]->expect_raw_ack_seq_);*/
 }
 
-void WspaceAP::InsertFeedback(const vector<RawPktSendStatus> &status_vec, int client_id) {
+void WspaceAP::InsertFeedback(const vector<RawPktSendStatus> &status_vec, int client_id, bool is_flush) {
   vector<RawPktSendStatus>::const_iterator it;
 
-  if (status_vec.empty())
+  if (status_vec.empty()) {
+    if (is_flush)
+      UpdateFeedback(client_id);
     return;
+  }
 
   for (it = status_vec.begin(); it < status_vec.end(); it++) {/*
     printf("InsertRecord raw_seq[%u] status[%d] rate[%u] len[%u] time[%.3fms]\n", 
@@ -861,96 +1203,74 @@ void WspaceAP::InsertFeedback(const vector<RawPktSendStatus> &status_vec, int cl
   /** Ensure close range lookup [start, end] for delayed packets.*/
   MonotonicTimer start = status_vec.front().send_time_ - MonotonicTimer(0, 1);
   MonotonicTimer end = status_vec.back().send_time_ + MonotonicTimer(0, 1);
-  client_context_tbl_[client_id]->scout_rate_maker()->CalcLossRates(ScoutRateAdaptation::kBack, start, end);  /** Calculate loss for delayed feedback. */
-
-  SendLossRate(client_id);
-
+  bool is_due = client_context_tbl_[client_id]->feedback_aggregator()->Add(start, end, status_vec.size());
+  if (is_due || is_flush)
+    UpdateFeedback(client_id);
 }
 
-void* WspaceAP::TxHandleRawAck(void* arg) {
-  int *client_id = (int*)arg;
-  printf("TxHandleRawAck start, client_id:%d\n", *client_id);
-  char type;
-  uint16 num_nacks=0, num_pkts=0;
-  uint32 ack_seq=0, end_seq=0;
-  uint32 *nack_seq_arr = new uint32[ACK_WINDOW];
-  vector<RawPktSendStatus> status_vec;
-  int bs_id = 0;
-
-  while (1) {
-    bool is_ack_available = TxHandleAck(client_context_tbl_[*client_id]->feedback_handler()->raw_ack_context_, &type, &ack_seq, 
-              &num_nacks, &end_seq, *client_id, &bs_id, nack_seq_arr, &num_pkts);
-    assert(is_ack_available);  /** No timeout when handling raw ACKs. */
-    //PrintNackInfo(type, ack_seq, num_nacks, end_seq, nack_seq_arr, num_pkts);
-    if (ack_seq >= client_context_tbl_[*client_id]->expect_raw_ack_seq_) {
-      client_context_tbl_[*client_id]->expect_raw_ack_seq_ = ack_seq + 1;
-      client_context_tbl_[*client_id]->feedback_handler()->raw_pkt_buf_.PopPktStatus(end_seq, num_nacks, num_pkts, nack_seq_arr, status_vec);
-      InsertFeedback(status_vec, *client_id);  /** For scout. */
-    }/*
-    else
-      printf("Warning: out of order raw ack seq[%u] expect_seq[%u]\n", ack_seq, client_context_tbl_[*client_id]->expect_raw_ack_seq_);*/
-  }
-  delete[] nack_seq_arr;
+void WspaceAP::UpdateFeedback(int client_id) {
+  MonotonicTimer start, end;
+  if (!client_context_tbl_[client_id]->feedback_aggregator()->Take(&start, &end))
+    return;
+  client_context_tbl_[client_id]->scout_rate_maker()->CalcLossRates(ScoutRateAdaptation::kBack, start, end);  /** Calculate loss for delayed feedback. */
+  SendLossRate(client_id);
 }
 
-bool WspaceAP::TxHandleAck(AckContext &ack_context, char *type, uint32 *ack_seq, uint16 *num_nacks,
-        uint32 *end_seq, int client_id, int* bs_id, uint32 *nack_seq_arr, uint16 *num_pkts) {
-  int client = 0;
-  char pkt_type;
+int WspaceAP::TxHandleAck(AckContext &ack_context, char *pkts, uint16 *lens, int wait_ms) {
   ack_context.Lock();
-  while (!ack_context.ack_available()) {
-    if (ack_context.type() == DATA_ACK) {
-      int err = ack_context.WaitFill(ack_time_out_);
-      if (err == ETIMEDOUT)
-        break;
-    }
-    else if (ack_context.type() == RAW_ACK) {
-      ack_context.WaitFill();  /** No need to timeout to track raw packets. */
-    }
-    else {
-      Perror("TxHandleAck invalid ACK type: %d\n", ack_context.type());
-    }
+  while (ack_context.IsEmpty()) {
+    if (ack_context.WaitFill(wait_ms) == ETIMEDOUT)
+      break;
   }
-  bool ack_available = ack_context.ack_available();
-  if (ack_context.ack_available()) {
-    ack_context.set_ack_available(false);
-    (ack_context.pkt())->ParseNack(&pkt_type, ack_seq, num_nacks, end_seq, &client, bs_id, nack_seq_arr, num_pkts);
-    assert(client == client_id && *bs_id == bs_id_);
-    //printf("TxHandleAck: pkt_type:%d, client_id:%d, bs_id:%d\n", (int)pkt_type, client_id, *bs_id);
-    assert(pkt_type == ack_context.type());
-    *type = pkt_type;
+  int num_acks = ack_context.size();
+  for (int i = 0; i < num_acks; i++) {
+    const char *ack = ack_context.Front(&lens[i]);
+    memcpy(pkts + i * PKT_SIZE, ack, lens[i]);  /** Only the ack, not the whole slot. */
+    ack_context.Pop();
   }
-  ack_context.SignalEmpty();
+  if (num_acks > 0)
+    ack_context.SignalEmpty();
   ack_context.UnLock();
-  return ack_available;
+  return num_acks;
 }
 
 void* WspaceAP::TxRcvCell(void* arg) {
-  uint16 nread=0;
+  int shard = *(int*)arg;
+  printf("TxRcvCell start, shard:%d\n", shard);
+  int nread=0;
   char *buf = new char[PKT_SIZE];
   while (1) {
-    nread = tun_.Read(Tun::kCellular, buf, PKT_SIZE);
+    /** Peek the header first so that downlink data can be received in place. */
+    int len = tun_->Peek(Tun::kCellular, buf, sizeof(ControllerToClientHeader), shard);
+    if (len < 0) {
+      usleep(kRcvErrorBackoffUs);
+      continue;
+    }
+    if (*buf == CONTROLLER_TO_CLIENT) {
+      RcvControllerData((ControllerToClientHeader*)buf, len, shard);
+      continue;
+    }
+    nread = tun_->Read(Tun::kCellular, buf, PKT_SIZE, shard);
+    if (nread < 0) {
+      usleep(kRcvErrorBackoffUs);
+      continue;
+    }
     char type = *buf;
     if (type == CELL_DATA) {
-      tun_.Write(Tun::kControl, buf, nread);
-    }
-    else if (type == DATA_ACK) {
-      AckHeader *hdr = (AckHeader*)buf;
-      RcvAck(*(client_context_tbl_[hdr->client_id()]->data_ack_context()), buf, nread);
+      tun_->Write(Tun::kControl, buf, nread);
     }
-    else if (type == RAW_ACK) {
+    else if (type == DATA_ACK || type == DATA_ACK_RANGE || type == RAW_ACK || type == RAW_ACK_RANGE) {
+      if (nread < (int)sizeof(AckHeader)) {
+        printf("TxRcvCell: Warning drop truncated ack len[%d]\n", nread);
+        continue;
+      }
       AckHeader *hdr = (AckHeader*)buf;
-      RcvAck(client_context_tbl_[hdr->client_id()]->feedback_handler()->raw_ack_context_, buf, nread);
+      RcvAck(*(client_context_tbl_[hdr->client_id()]->ack_context()), buf, nread);
     }
     else if (type == GPS) {
       GPSHeader *hdr = (GPSHeader*)buf;
       RcvGPS(buf, nread, hdr->client_id());
     }
-    else if (type == CONTROLLER_TO_CLIENT) {
-      ControllerToClientHeader* hdr = (ControllerToClientHeader*)buf;
-      //printf("CONTROLLER_TO_CLIENT pkt client_id: %d seq_num: %u len: %u\n", hdr->client_id(), hdr->o_seq(), nread);
-      client_context_tbl_[hdr->client_id()]->data_pkt_buf()->EnqueuePkt(nread, (uint8*)buf);
-    }
     else {
       Perror("TxRcvCell: Invalid pkt type[%d]\n", type);
     }
@@ -958,16 +1278,39 @@ void* WspaceAP::TxRcvCell(void* arg) {
   delete[] buf;
 }
 
+void WspaceAP::RcvControllerData(const ControllerToClientHeader *hdr, int len, int shard) {
+  //printf("CONTROLLER_TO_CLIENT pkt client_id: %d seq_num: %u len: %d\n", hdr->client_id(), hdr->o_seq(), len);
+  map<int, ClientContext*>::iterator it = client_context_tbl_.find(hdr->client_id());
+  if (it == client_context_tbl_.end() || len > PKT_SIZE) {
+    printf("RcvControllerData: Warning drop pkt client_id[%d] len[%d]\n", hdr->client_id(), len);
+    tun_->Discard(Tun::kCellular, shard);
+    return;
+  }
+  uint32 index=0, seq_num=0;
+  uint8 *slot=NULL;
+  TxDataBuf *data_pkt_buf = it->second->data_pkt_buf();
+  if (!data_pkt_buf->ReserveSlot(&index, &seq_num, &slot)) {
+    tun_->Discard(Tun::kCellular, shard);  /** Buffer is full. */
+    return;
+  }
+  int nread = tun_->Read(Tun::kCellular, (char*)slot, PKT_SIZE, shard);
+  if (nread < 0) {
+    printf("RcvControllerData: Warning drop pkt client_id[%d], read failed\n", hdr->client_id());
+    data_pkt_buf->ReleaseSlot(index, seq_num);
+    return;
+  }
+  data_pkt_buf->CommitSlot(index, seq_num, nread);
+}
+
 void WspaceAP::RcvAck(AckContext &ack_context, const char* buf, uint16 len) {
   ack_context.Lock();
-  while (ack_context.ack_available()) {
-    /** Last ack has not been processed yet. */
-    //printf("TxRcvCell ACK overlaps!\n");
+  while (ack_context.IsFull()) {
+    /** The feedback stage is behind, hold back the receive shard. */
+    //printf("TxRcvCell ACK queue full!\n");
     ack_context.SignalFill();
     ack_context.WaitEmpty();
   }
-  ack_context.set_ack_available(true);
-  memcpy(ack_context.pkt(), buf, len);
+  ack_context.Push(buf, len);
   ack_context.SignalFill();
   ack_context.UnLock();
 }
@@ -1054,26 +1397,26 @@ void* LaunchTxSendProbe(void* arg) {
   wspace_ap->TxSendProbe(arg);
 }
 
-void* LaunchTxHandleDataAck(void* arg) {
-  wspace_ap->TxHandleDataAck(arg);
+void* LaunchTxSendReport(void* arg) {
+  wspace_ap->TxSendReport(arg);
 }
 
-void* LaunchTxHandleRawAck(void* arg) {
-  wspace_ap->TxHandleRawAck(arg);
+void* LaunchTxHandleFeedback(void* arg) {
+  wspace_ap->TxHandleFeedback(arg);
 }
 
 void* LaunchTxRcvCell(void* arg) {
   wspace_ap->TxRcvCell(arg);
 }
 
-void PrintNackInfo(char type, uint32 ack_seq, uint16 num_nacks, uint32 end_seq, uint32 *nack_arr, uint16 num_pkts) {
+void PrintNackInfo(char type, uint32 ack_seq, uint16 num_nacks, uint32 end_seq, const NackRun *nack_runs, uint16 num_runs, uint16 num_pkts) {
   if (type == DATA_ACK)
     printf("data_");
   else if (type == RAW_ACK)
     printf("raw_");
   printf("ack[%u] end_seq[%u] num_nacks[%u] num_pkts[%u] {", ack_seq, end_seq, num_nacks, num_pkts);
-  for (int i = 0; i < num_nacks; i++) {
-    printf("%d ", nack_arr[i]);
+  for (int i = 0; i < num_runs; i++) {
+    printf("%u+%u ", nack_runs[i].seq, nack_runs[i].len);
   }
   printf("}\n");
 }
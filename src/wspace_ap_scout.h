@@ -8,6 +8,11 @@
 #include "fec.h"
 #include "rate_adaptation.h"
 #include "scout_rate.h"
+#include "rtt_estimator.h"
+#include "harq_cache.h"
+#include "airtime_scheduler.h"
+#include "feedback_aggregator.h"
+#include "bs_reporter.h"
 
 #ifdef RAND_DROP
 #include "packet_drop_manager.h"
@@ -18,26 +23,30 @@ static const int kMaxDupAckCnt = 10;
 
 class ClientContext {
  public:
-  ClientContext(): encoder_(CodeInfo::kEncoder, MAX_BATCH_SIZE, PKT_SIZE), 
-                   data_ack_context_(DATA_ACK), 
-                   scout_rate_maker_(mac80211abg_rate, mac80211abg_num_rates, 
-                                              GF_SIZE, MAX_BATCH_SIZE), 
-                   feedback_handler_(RAW_ACK), batch_id_(1), raw_seq_(1),
+  ClientContext(): batch_id_(1), raw_seq_(1),
                    expect_data_ack_seq_(1), dup_data_ack_cnt_(0),
                    expect_raw_ack_seq_(1), data_ack_loss_cnt_(0),
-                   prev_gps_seq_(0), contiguous_time_out_(0), bsstats_seq_(0) {}
+                   prev_gps_seq_(0), contiguous_time_out_(0), bsstats_seq_(0), 
+                   encoder_(CodeInfo::kEncoder, MAX_BATCH_SIZE, PKT_SIZE), 
+                   scout_rate_maker_(mac80211abg_rate, mac80211abg_num_rates, 
+                                              GF_SIZE, MAX_BATCH_SIZE), 
+                   harq_cache_(NULL) {}
 
-  ~ClientContext() {}
+  ~ClientContext() { delete harq_cache_; }
 
   TxDataBuf* data_pkt_buf() { return &data_pkt_buf_; }
   CodeInfo* encoder() { return &encoder_; }
   ScoutRateAdaptation* scout_rate_maker() { return &scout_rate_maker_; }
-  AckContext* data_ack_context() { return &data_ack_context_; }
+  AckContext* ack_context() { return &ack_context_; }
   FeedbackHandler* feedback_handler() { return &feedback_handler_; }
+  FeedbackAggregator* feedback_aggregator() { return &feedback_aggregator_; }
   GPSLogger* gps_logger() { return &gps_logger_; }
+  RttEstimator* rtt_estimator() { return &rtt_estimator_; }
+  /** NULL unless lost packets are repaired with incremental redundancy (-a). */
+  HarqCache* harq_cache() { return harq_cache_; }
+  void EnableHarq() { if (!harq_cache_) harq_cache_ = new HarqCache(PKT_SIZE); }
   pthread_t* p_tx_send_ath() { return &p_tx_send_ath_; }
-  pthread_t* p_tx_handle_data_ack() { return &p_tx_handle_data_ack_; }
-  pthread_t* p_tx_handle_raw_ack() { return &p_tx_handle_raw_ack_; }
+  pthread_t* p_tx_handle_feedback() { return &p_tx_handle_feedback_; }
 
   //Former static variables needed by every client
   uint32 batch_id_; //= 1,
@@ -54,49 +63,85 @@ class ClientContext {
   TxDataBuf data_pkt_buf_;
   CodeInfo encoder_;
   ScoutRateAdaptation scout_rate_maker_;
-  AckContext data_ack_context_;
+  AckContext ack_context_;     /** DATA_ACK and RAW_ACK in arrival order. */
   FeedbackHandler feedback_handler_;
+  FeedbackAggregator feedback_aggregator_;  /** Raw packet statuses since the last loss rate update. */
   GPSLogger gps_logger_;
-  pthread_t p_tx_send_ath_, p_tx_handle_data_ack_, p_tx_handle_raw_ack_;
+  RttEstimator rtt_estimator_;  /** Of the DATA_ACK path, only used by TxHandleFeedback. */
+  HarqCache *harq_cache_;
+  pthread_t p_tx_send_ath_, p_tx_handle_feedback_;
 
 };
 
+/** Command line options of WspaceAP. */
+extern const char *const kWspaceAPOpts;
+
 class WspaceAP {
  public:
-  WspaceAP(int argc, char *argv[], const char *optstring);
+  /**
+   * @param tun: the transport to use, taking ownership. A Tun over the real 
+   * tun device and UDP sockets is created if NULL.
+   */
+  WspaceAP(int argc, char *argv[], const char *optstring, Tun *tun = NULL);
   ~WspaceAP();
   
   void Init();
 
+  /** Create all the worker threads, the global wspace_ap must point to this. */
+  void StartThreads();
+
+  void JoinThreads();
+
+  /** @param arg: pointer to the index of the tun queue to read. */
   void* TxReadTun(void* arg);
 
   void* TxSendAth(void* arg);
  
   void* TxSendProbe(void* arg);
 
-  /** 
-   * Parse the ACK of data sequence number, used for freeing buffer space and 
-   * retransmission.
-   */
-  void* TxHandleDataAck(void* arg);
+  /** Send the BS_REPORTs of bs_reporter_ to the controller. */
+  void* TxSendReport(void* arg);
 
   /** 
-   * Parse the ACK of raw sequence number and calculate the loss rates for rate 
-   * adaptation and FEC. 
+   * The feedback stage of a client. Takes the ACKs of data sequence number, 
+   * for freeing buffer space and retransmission, and the ACKs of raw sequence 
+   * number, for the loss rates of rate adaptation and FEC, in arrival order 
+   * off one queue. The effects of the ACKs drained together are applied in 
+   * one go, and the ACK and retransmission timeouts run off the same wait.
    */
-  void* TxHandleRawAck(void* arg);  
+  void* TxHandleFeedback(void* arg);
 
+  /** @param arg: pointer to the index of the receive shard to serve. */
   void* TxRcvCell(void* arg);
 
-  bool HandleDataAck(char type, uint32 ack_seq, uint16 num_nacks, uint32 end_seq, uint32* nack_arr, int client_id);
+  bool HandleDataAck(char type, uint32 ack_seq, uint16 num_nacks, uint32 end_seq, const NackRun *nack_runs, uint16 num_runs, int client_id);
 
-  void HandleTimeOut(int client_id);
+  /** 
+   * Called when no DATA_ACK arrives in time or on a burst of duplicate ACKs.
+   * Sets the client to high loss after max_contiguous_time_out_ such rounds that time out packets.
+   * @param is_retrans: whether packets timed out earlier in this round.
+   */
+  void HandleTimeOut(int client_id, bool is_retrans = false);
+
+  /**
+   * Set up the retransmission of the packets whose timer expired and drop those 
+   * out of retransmissions.
+   * @return true if any packet is to be retransmitted.
+   */
+  bool ExpireRetransTimers(int client_id);
 
   uint8 num_retrans() const { return num_retrans_; }
 
   void set_num_retrans(uint8 num_retrans) { num_retrans_ = num_retrans; } 
 
-  void InsertFeedback(const vector<RawPktSendStatus> &status_vec_front, int client_id);
+  /** 
+   * Ingest raw packet statuses, the loss rates are updated once the 
+   * aggregator says so, or right away if is_flush. 
+   */
+  void InsertFeedback(const vector<RawPktSendStatus> &status_vec_front, int client_id, bool is_flush = false);
+
+  /** Recompute the back loss rates from the pending statuses and report them. */
+  void UpdateFeedback(int client_id);
 
 #ifdef LOG_LOSS
   void LogLossRate(uint16 rate, double loss, double redundancy, int k, int n);
@@ -128,15 +173,24 @@ class WspaceAP {
   uint8 num_retrans_;
   int ack_time_out_;  // in ms 
   int batch_time_out_;
-  int rtt_;   // in ms
+  int rtt_;   // in ms, initial RTT of every client
   //TxDataBuf data_pkt_buf_;  /** Store the data sequence number and data packets for retransmission.*/
-  pthread_t p_tx_read_tun_, p_tx_rcv_cell_, p_tx_send_probe_;
+  pthread_t p_tx_read_tun_[MAX_TUN_QUEUES], p_tx_rcv_cell_[MAX_RCV_SHARDS], p_tx_send_probe_;
+  int tun_queue_ids_[MAX_TUN_QUEUES];  /** Argument of each TxReadTun thread. */
+  int rcv_shard_ids_[MAX_RCV_SHARDS];  /** Argument of each TxRcvCell thread. */
+  uint32 airtime_quantum_;  // in us, 0 if the clients send independently.
+  AirtimeScheduler *airtime_scheduler_;  /** Shares the whitespace channel among the clients, NULL if disabled. */
+  uint32 feedback_samples_;   /** Raw packet statuses that trigger a loss rate update. */
+  uint32 feedback_delay_ms_;  /** Longest a status waits for the loss rate update. */
+  uint32 report_interval_ms_;  /** Of the BS_REPORTs, 0 to send a BS_STATS per update instead. */
+  BSReporter *bs_reporter_;    /** NULL if disabled. */
+  pthread_t p_tx_send_report_;
 #ifdef RAND_DROP 
   bool use_loss_trace_;
   pthread_t p_tx_update_loss_rates_;
   PacketDropManager* packet_drop_manager_;
 #endif
-  Tun tun_;    // tun interface
+  Tun *tun_;    // tun interface
   uint32 coherence_time_;  // in microseconds.
   //int contiguous_time_out_;
   int max_contiguous_time_out_;
@@ -155,36 +209,65 @@ class WspaceAP {
 
  private:
   /**
-   * Overload function used for processing both DATA_ACK and RAW_ACK.
-   * @return true - ACK is available, false - timeout for DATA_ACK.
+   * Take all the ACKs queued, waiting for one up to wait_ms.
+   * @param [out] pkts: room for AckContext::kNumSlots packets of PKT_SIZE.
+   * @param [out] lens: room for AckContext::kNumSlots lengths.
+   * @return the number of ACKs taken, 0 on timeout.
    */
-  bool TxHandleAck(AckContext &ack_context, char *type, uint32 *ack_seq, 
-    uint16 *num_nacks, uint32 *end_seq, int client_id, int* bs_id, uint32 *nack_seq_arr, uint16 *num_pkts = NULL); 
+  int TxHandleAck(AckContext &ack_context, char *pkts, uint16 *lens, int wait_ms);
+
+  /**
+   * Handle one RAW_ACK, appending the status of the packets it covers.
+   */
+  void HandleRawAck(uint32 ack_seq, uint16 num_nacks, uint32 end_seq, uint16 num_pkts, const NackRun *nack_runs, 
+                    uint16 num_runs, int client_id, vector<RawPktSendStatus> &status_vec);
   
   /**
-   * Store the received packet into the ack_context.
+   * Queue the received packet into the ack_context, waiting if it is full.
    * Used in TxRcvCell.
    */
   void RcvAck(AckContext &ack_context, const char* buf, uint16 len);  
 
   void RcvGPS(const char* buf, uint16 len, int client_id);
 
+  /**
+   * Receive a CONTROLLER_TO_CLIENT datagram straight into the next free slot 
+   * of the client's data buffer. Used in TxRcvCell.
+   * @param hdr: the peeked header.
+   * @param len: the full length of the pending datagram.
+   * @param shard: the receive shard the datagram is pending on.
+   */
+  void RcvControllerData(const ControllerToClientHeader *hdr, int len, int shard);
+
   /**
    * @param is_duplicate: whether to duplicate packets over the cellular link.
    */
   void SendCodedBatch(uint32 extra_wait_time, bool is_duplicate, const vector<uint16> &rate_arr, int client_id,
         int drop_cnt=-1, int *drop_inds=NULL);
 
+  /** Send the repair symbols the client's HarqCache was asked for. Used in TxSendAth. */
+  void SendRepairs(uint32 extra_wait_time, int client_id);
+
+  /** 
+   * Record, duplicate if asked and send one coded packet over whitespace.
+   * @param rate: the data rate the packet is sent at.
+   * @param airtime: in us at that rate, for the whitespace pacer.
+   */
+  void SendCodedPkt(AthCodeHeader *hdr, uint16 send_len, uint16 rate, uint32 airtime, bool is_duplicate, int client_id);
+
   void SendLossRate(int client_id);
 
 };
 
+/** The AP instance run by the thread wrappers below. */
+extern WspaceAP *wspace_ap;
+
 /** Wrapper function for pthread_create. */
 void* LaunchTxReadTun(void* arg);
 void* LaunchTxSendAth(void* arg);
 void* LaunchTxSendProbe(void* arg);
-void* LaunchTxHandleDataAck(void* arg);
-void* LaunchTxHandleRawAck(void* arg);
+void* LaunchTxSendReport(void* arg);
+void* LaunchTxHandleFeedback(void* arg);
 void* LaunchTxRcvCell(void* arg);
 #ifdef RAND_DROP
 void* LaunchUpdateLossRates(void* arg);
@@ -192,6 +275,6 @@ void* LaunchUpdateLossRates(void* arg);
 /**
  * Print out the information about nack array.
  */
-void PrintNackInfo(char type, uint32 ack_seq, uint16 num_nacks, uint32 end_seq, uint32 *nack_arr, uint16 num_pkts=0);
+void PrintNackInfo(char type, uint32 ack_seq, uint16 num_nacks, uint32 end_seq, const NackRun *nack_runs, uint16 num_runs, uint16 num_pkts=0);
 
 #endif
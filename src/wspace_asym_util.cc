@@ -24,13 +24,15 @@ void BasicBuf::AcquireHeadLock(uint32 *index) {
 /*
 Purpose: Enqueue an element in the tail
 */
-bool BasicBuf::AcquireTailLock(uint32 *index) {
+bool BasicBuf::AcquireTailLock(uint32 *index, uint32 *seq_num) {
   LockQueue();
   if (IsFull()) {
     //printf("Drop pkt due to queue is full!\n");
     UnLockQueue();
     return false;
   }
+  if (seq_num)
+    *seq_num = tail_pt()+1;
   *index = tail_pt_mod(); //current element
   LockElement(*index);
   IncrementTailPt();
@@ -43,25 +45,25 @@ void BasicBuf::UpdateBookKeeping(uint32 index, uint32 seq_num, Status status, ui
   if (index < 0 || index > BUF_SIZE-1) {
     Perror("UpdateBookKeeping invalid index: %d\n", index);
   }
-  book_keep_arr_[index].seq_num = seq_num;
-  book_keep_arr_[index].status = status;
-  book_keep_arr_[index].len = len;
+  seq_num_arr_[index] = seq_num;
+  status_arr_[index] = status;
+  len_arr_[index] = len;
 }
 
 void BasicBuf::GetBookKeeping(uint32 index, uint32 *seq_num, Status *status, uint16 *len) const {
   if (index < 0 || index > BUF_SIZE-1) {
     Perror("GetBookKeeping invalid index: %d\n", index);
   }
-  *seq_num = book_keep_arr_[index].seq_num; 
-  *status = book_keep_arr_[index].status;
-  *len = book_keep_arr_[index].len; 
+  *seq_num = seq_num_arr_[index]; 
+  *status = status_arr_[index];
+  *len = len_arr_[index]; 
 }
 
 uint8 BasicBuf::GetNumDups(uint32 index) const {
   if (index < 0 || index > BUF_SIZE-1) {
     Perror("GetNumDups invalid index: %u\n", index);
   }
-  return book_keep_arr_[index].num_dups;
+  return num_dups_arr_[index];
 }
 
 //////////add by Lei
@@ -69,15 +71,15 @@ void BasicBuf::UpdateRateInBookKeeping(uint32 index, uint16 rate) {
   if (index < 0 || index > BUF_SIZE-1) {
     Perror("UpdateBookKeeping invalid index: %d\n", index);
   }
-  book_keep_arr_[index].rate = rate;
+  rate_arr_[index] = rate;
 }
 
 void BasicBuf::GetRateFromBookKeeping(uint32 index, uint16* rate, uint16* len) {
   if (index < 0 || index > BUF_SIZE-1) {
     Perror("GetBookKeeping invalid index: %d\n", index);
   }
-  *rate = book_keep_arr_[index].seq_num; 
-  *len = book_keep_arr_[index].len; 
+  *rate = seq_num_arr_[index]; 
+  *len = len_arr_[index]; 
 }
 
 ///////////////////////
@@ -88,12 +90,12 @@ void BasicBuf::UpdateBookKeeping(uint32 index, uint32 seq_num, Status status, ui
   if (index < 0 || index > BUF_SIZE-1) {
     Perror("UpdateBookKeeping invalid index: %d\n", index);
   }
-  book_keep_arr_[index].seq_num = seq_num;
-  book_keep_arr_[index].status = status;
-  book_keep_arr_[index].len = len;
-  book_keep_arr_[index].num_retrans = num_retrans;
+  seq_num_arr_[index] = seq_num;
+  status_arr_[index] = status;
+  len_arr_[index] = len;
+  num_retrans_arr_[index] = num_retrans;
   if (update_timestamp) {
-    book_keep_arr_[index].timestamp.GetCurrTime();
+    timestamp_arr_[index].GetCurrTime();
   }
 }
 
@@ -102,12 +104,25 @@ void BasicBuf::GetBookKeeping(uint32 index, uint32 *seq_num, Status *status, uin
   if (index < 0 || index > BUF_SIZE-1) {
     Perror("GetBookKeeping invalid index: %d\n", index);
   }
-  *seq_num = book_keep_arr_[index].seq_num; 
-  *status = book_keep_arr_[index].status;
-  *len = book_keep_arr_[index].len; 
-  *num_retrans = book_keep_arr_[index].num_retrans; 
+  *seq_num = seq_num_arr_[index]; 
+  *status = status_arr_[index];
+  *len = len_arr_[index]; 
+  *num_retrans = num_retrans_arr_[index]; 
   if (timestamp) {
-    *timestamp = book_keep_arr_[index].timestamp; 
+    *timestamp = timestamp_arr_[index]; 
+  }
+}
+
+void BasicBuf::ClearBookKeeping(uint32 begin, uint32 end) {
+  assert(begin <= end && end - begin <= kSize);
+  while (begin < end) {  /** At most two contiguous pieces. */
+    uint32 index = begin % kSize;
+    uint32 cnt = std::min(end - begin, kSize - index);
+    memset(&seq_num_arr_[index], 0, cnt * sizeof(seq_num_arr_[0]));
+    memset(&len_arr_[index], 0, cnt * sizeof(len_arr_[0]));
+    memset(&num_retrans_arr_[index], 0, cnt * sizeof(num_retrans_arr_[0]));
+    std::fill(&status_arr_[index], &status_arr_[index] + cnt, kEmpty);
+    begin += cnt;
   }
 }
 
@@ -122,6 +137,7 @@ void TxDataBuf::AcquireCurrLock(uint32 *index) {
   }    
   *index = curr_pt_mod(); //current element
   LockElement(*index);
+  dequeue_pt_ = curr_pt_;
   IncrementCurrPt();
   UnLockQueue();
 }
@@ -132,15 +148,19 @@ void TxDataBuf::AcquireCurrLock(uint32 *index) {
 bool TxDataBuf::AcquireCurrLock(int wait_ms, uint32 *index) {
   bool is_timeout=false;
   LockQueue();
-  while (IsEmpty() && !is_timeout) {
+  while (IsEmpty() && !is_timeout && !is_woken_) {
 #ifdef TEST
     printf("Empty! head_pt[%u] curr_pt[%u] tail_pt[%u]\n", head_pt_, curr_pt_, tail_pt_);
 #endif
     is_timeout = WaitFill(wait_ms);
   }    
+  if (IsEmpty())
+    is_timeout = true;  /** Woken up. */
+  is_woken_ = false;
   if (!is_timeout) {
     *index = curr_pt_mod(); //current element
     LockElement(*index);
+    dequeue_pt_ = curr_pt_;
     IncrementCurrPt();
   }
   UnLockQueue();
@@ -150,18 +170,40 @@ bool TxDataBuf::AcquireCurrLock(int wait_ms, uint32 *index) {
 void TxDataBuf::EnqueuePkt(uint16 len, uint8 *pkt) {
   uint32 index=0, seq_num=0;
   uint8 *buf_addr=NULL;
-  seq_num = tail_pt()+1;
-  if(AcquireTailLock(&index)) {
-    /** Get the address of the current slot to store the packet. */
-    GetPktBufAddr(index, &buf_addr);
+  if(ReserveSlot(&index, &seq_num, &buf_addr)) {
     memcpy(buf_addr, pkt, len);
-    assert(GetElementStatus(index) == kEmpty);
-    // Update bookkeeping
-    UpdateBookKeeping(index, seq_num, kOccupiedNew, len, num_retrans(), false/**don't update timestamp for now*/);
-    UnLockElement(index);
+    CommitSlot(index, seq_num, len);
   }
 }
 
+bool TxDataBuf::ReserveSlot(uint32 *index, uint32 *seq_num, uint8 **buf) {
+  if (!AcquireTailLock(index, seq_num)) {
+    num_full_drops_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  /** Get the address of the current slot to store the packet. */
+  GetPktBufAddr(*index, buf);
+  assert(GetElementStatus(*index) == kEmpty);
+  return true;
+}
+
+void TxDataBuf::CommitSlot(uint32 index, uint32 seq_num, uint16 len) {
+  assert(len > 0 && len <= PKT_SIZE);
+  // Update bookkeeping
+  UpdateBookKeeping(index, seq_num, kOccupiedNew, len, num_retrans(), false/**don't update timestamp for now*/);
+  UnLockElement(index);
+}
+
+void TxDataBuf::ReleaseSlot(uint32 index, uint32 seq_num) {
+  UpdateBookKeeping(index, 0, kEmpty, 0, 0, false);
+  UnLockElement(index);  /** Before the queue lock, AcquireCurrLock takes them the other way. */
+  LockQueue();
+  /** Last reservation and not yet stepped over by the dequeuer: hand the sequence number back. */
+  if (tail_pt_ == seq_num && curr_pt_ < tail_pt_)
+    tail_pt_--;
+  UnLockQueue();
+}
+
 bool TxDataBuf::DequeuePkt(int time_out, uint32 *seq_num, uint16 *len, Status *status, 
         uint8 *num_retrans, uint32 *index, uint8 **buf) {
   bool is_timeout;
@@ -170,19 +212,7 @@ bool TxDataBuf::DequeuePkt(int time_out, uint32 *seq_num, uint16 *len, Status *s
     GetBookKeeping(*index, seq_num, status, len, num_retrans, NULL);
     if (*status == kOccupiedNew || *status == kOccupiedRetrans) {
       assert(*len > 0 && *len <= PKT_SIZE && *seq_num > 0);
-      /** Get the packet for encoding. */
-      GetPktBufAddr(*index, buf);
-      /** Update the book keeping info. */
-      if (*status == kOccupiedRetrans) {   
-        //printf("Retransmit pkt[%u] num_retrans[%u]\n", *seq_num, *num_retrans);
-        assert(*num_retrans > 0);
-        (*num_retrans)--;
-        GetElementNumRetrans(*index) = *num_retrans;
-      }
-      GetElementStatus(*index) = kOccupiedOutbound;
-      GetElementTimeStamp(*index).GetCurrTime();  
-      //GetElementBatchDuration(*index) = 2000e3;  /** 2000ms. Let the encoding finish before checking the pkt timeout. */
-      GetElementBatchDuration(*index) = 0;  /** 2000ms. Let the encoding finish before checking the pkt timeout. */
+      MarkOutbound(*index, *status, num_retrans, buf);
       //printf("DequeuePkt: pkt[%u] len[%u] batch_duration[%gms]\n", *seq_num, *len, GetElementBatchDuration(*index)/1000.);
     } 
     UnLockElement(*index);
@@ -190,6 +220,75 @@ bool TxDataBuf::DequeuePkt(int time_out, uint32 *seq_num, uint16 *len, Status *s
   return is_timeout;
 }
 
+int TxDataBuf::CountRetransRun(uint32 seq_num, int max_cnt, uint16 *max_len) {
+  int cnt = 0;
+  *max_len = 0;
+  LockQueue();
+  for (uint32 pt = curr_pt_; pt < tail_pt_ && cnt < max_cnt; pt++, cnt++) {
+    uint32 index = pt % kSize;
+    LockElement(index);
+    bool is_retrans = (GetElementStatus(index) == kOccupiedRetrans && GetElementSeqNum(index) == seq_num + cnt);
+    if (is_retrans && GetElementLen(index) > *max_len)
+      *max_len = GetElementLen(index);
+    UnLockElement(index);
+    if (!is_retrans)
+      break;
+  }
+  UnLockQueue();
+  return cnt;
+}
+
+bool TxDataBuf::DequeueRetransPkt(uint32 seq_num, uint16 *len, uint8 *num_retrans, uint32 *index, uint8 **buf) {
+  uint32 seq=0;
+  Status status;
+  LockQueue();
+  bool is_retrans = false;
+  if (!IsEmpty()) {
+    *index = curr_pt_mod();
+    LockElement(*index);
+    GetBookKeeping(*index, &seq, &status, len, num_retrans, NULL);
+    is_retrans = (status == kOccupiedRetrans && seq == seq_num);
+    if (is_retrans) {
+      IncrementCurrPt();
+      MarkOutbound(*index, status, num_retrans, buf);
+    }
+    UnLockElement(*index);
+  }
+  UnLockQueue();
+  return is_retrans;
+}
+
+void TxDataBuf::WakeUp() {
+  LockQueue();
+  is_woken_ = true;
+  SignalFill();
+  UnLockQueue();
+}
+
+void TxDataBuf::ConsumeRetrans(uint32 index) {
+  assert(GetElementStatus(index) == kOccupiedOutbound && GetElementNumRetrans(index) > 0);
+  GetElementNumRetrans(index)--;
+  GetElementTimeStamp(index).GetCurrTime();
+  ArmRetransTimer(index);
+}
+
+void TxDataBuf::MarkOutbound(uint32 index, Status status, uint8 *num_retrans, uint8 **buf) {
+  /** Get the packet for encoding. */
+  GetPktBufAddr(index, buf);
+  /** Update the book keeping info. */
+  if (status == kOccupiedRetrans) {   
+    //printf("Retransmit pkt[%u] num_retrans[%u]\n", GetElementSeqNum(index), *num_retrans);
+    assert(*num_retrans > 0);
+    (*num_retrans)--;
+    GetElementNumRetrans(index) = *num_retrans;
+  }
+  GetElementStatus(index) = kOccupiedOutbound;
+  GetElementTimeStamp(index).GetCurrTime();  
+  ArmRetransTimer(index);
+  //GetElementBatchDuration(index) = 2000e3;  /** 2000ms. Let the encoding finish before checking the pkt timeout. */
+  GetElementBatchDuration(index) = 0;  /** 2000ms. Let the encoding finish before checking the pkt timeout. */
+}
+
 void TxDataBuf::DisableRetransmission(uint32 index) {
   LockElement(index);
   GetElementNumRetrans(index) = 0;
@@ -204,12 +303,35 @@ void TxDataBuf::UpdateBatchSendTime(uint32 batch_duration, const vector<uint32>
     assert(GetElementStatus(index) == kOccupiedOutbound);
     GetElementTimeStamp(index).GetCurrTime();
     GetElementBatchDuration(index) = batch_duration;
+    ArmRetransTimer(index, batch_duration);
     printf("UpdateBatchSendTime: seq[%u] batch_duration[%ums]\n", GetElementSeqNum(index), batch_duration/1000);
     UnLockElement(index);
   }
   UnLockQueue();
 }
 
+void TxDataBuf::ArmRetransTimer(uint32 index, int extra_us) {
+  Pthread_mutex_lock(&timer_lock_);
+  retrans_timer_.Schedule(index, TimerWheel::NowUs() + extra_us + rto_us_);
+  Pthread_mutex_unlock(&timer_lock_);
+}
+
+void TxDataBuf::ExpireRetransTimers(vector<uint32> *indices) {
+  Pthread_mutex_lock(&timer_lock_);
+  retrans_timer_.Expire(TimerWheel::NowUs(), indices);
+  Pthread_mutex_unlock(&timer_lock_);
+}
+
+int TxDataBuf::NextRetransTimeOut() {
+  Pthread_mutex_lock(&timer_lock_);
+  int64_t next_us = retrans_timer_.NextExpiry();
+  Pthread_mutex_unlock(&timer_lock_);
+  if (next_us < 0)
+    return -1;
+  int64_t wait_us = next_us - TimerWheel::NowUs();
+  return wait_us > 0 ? (wait_us + 999) / 1000 : 0;
+}
+
 void RxRcvBuf::AcquireHeadLock(uint32 *index, uint32 *head) {
   LockQueue();
   while (IsEmpty()) {
@@ -233,78 +355,18 @@ void Perror(char *msg, ...) {
 }
 
 void AthHeader::SetRate(uint16 rate) {
-  switch(rate) {
-     case 10:
-      rate_ = ATH5K_RATE_CODE_1M;
-      break;
-    case 20:
-      rate_ = ATH5K_RATE_CODE_2M;
-      break;
-    case 55:
-      rate_ = ATH5K_RATE_CODE_5_5M;
-      break;
-    case 110:
-      rate_ = ATH5K_RATE_CODE_11M;
-      break;
-    case 60:
-      rate_ = ATH5K_RATE_CODE_6M;
-      break;
-    case 90:
-      rate_ = ATH5K_RATE_CODE_9M;
-      break;
-    case 120:
-      rate_ = ATH5K_RATE_CODE_12M;
-      break;
-    case 180:
-      rate_ = ATH5K_RATE_CODE_18M;
-      break;
-    case 240:
-      rate_ = ATH5K_RATE_CODE_24M;
-      break;
-    case 360:
-      rate_ = ATH5K_RATE_CODE_36M;
-      break;
-    case 480:
-      rate_ = ATH5K_RATE_CODE_48M;
-      break;
-    case 540:
-      rate_ = ATH5K_RATE_CODE_54M;
-      break;
-    default:
-      Perror("Error: SetRate() invalid rate[%d]\n", rate);
-  }
+  int ind = RateIndex(rate);
+  if (ind < 0)
+    Perror("Error: SetRate() invalid rate[%d]\n", rate);
+  rate_ = kRateTable[ind].code;
 }
 
 // Return rate * 10
 uint16 AthHeader::GetRate() {
-  switch(rate_) {
-     case ATH5K_RATE_CODE_1M:
-      return 10;
-    case ATH5K_RATE_CODE_2M:
-      return 20;
-    case ATH5K_RATE_CODE_5_5M:
-      return 55;
-    case ATH5K_RATE_CODE_11M:
-      return 110;
-    case ATH5K_RATE_CODE_6M:
-      return 60;
-    case ATH5K_RATE_CODE_9M:
-      return 90;
-    case ATH5K_RATE_CODE_12M:
-      return 120;
-    case ATH5K_RATE_CODE_18M:
-      return 180;
-    case ATH5K_RATE_CODE_24M:
-      return 240;
-    case ATH5K_RATE_CODE_36M:
-      return 360;
-    case ATH5K_RATE_CODE_48M:
-      return 480;
-    case ATH5K_RATE_CODE_54M:
-      return 540;
-    default:
-      Perror("Error: GetRate() invalid rate[%d]\n", rate_);
-  }
+  int ind = RateCodeIndex(rate_);
+  if (ind < 0)
+    Perror("Error: GetRate() invalid rate[%d]\n", rate_);
+  return kRateTable[ind].rate;
 }
 
 // For four headers
@@ -427,6 +489,148 @@ void AckPkt::ParseNack(char *type, uint32 *ack_seq, uint16 *num_nacks, uint32 *e
   }
 }
 
+void AckPkt::ParseNack(char *type, uint32 *ack_seq, uint16 *num_nacks, uint32 *end_seq, int* client_id, int* bs_id, 
+                       NackRun *runs, uint16 *num_runs, uint16 *num_pkts) const {
+  *type = ack_hdr_.type_;
+  *ack_seq = ack_hdr_.ack_seq_;
+  *num_nacks = ack_hdr_.num_nacks_;
+  *end_seq = ack_hdr_.end_seq_;
+  *client_id = ack_hdr_.client_id_;
+  *bs_id = ack_hdr_.bs_id_;
+  if (num_pkts)
+    *num_pkts = ack_hdr_.num_pkts_;
+  *num_runs = 0;
+  for (int i = 0; i < ack_hdr_.num_nacks_ && i < ACK_WINDOW; i++) {
+    uint32 seq = (uint32)(rel_seq_arr_[i] + ack_hdr_.start_nack_seq_);
+    if (*num_runs > 0 && runs[*num_runs-1].seq + runs[*num_runs-1].len == seq) {
+      runs[*num_runs-1].len++;
+    }
+    else {
+      runs[*num_runs].seq = seq;
+      runs[*num_runs].len = 1;
+      (*num_runs)++;
+    }
+  }
+}
+
+void AckRangePkt::Init(char type) {
+  assert(type == DATA_ACK_RANGE || type == RAW_ACK_RANGE);
+  uint32 bitmap_len = BitmapLen();
+  bzero(bitmap_, bitmap_len < kMaxPayload ? bitmap_len : kMaxPayload);
+  ack_hdr_.Init(type);
+  format_ = kRuns;
+  payload_len_ = 0;
+  last_seq_ = 0;
+  num_runs_ = 0;
+  is_runs_full_ = false;
+}
+
+bool AckRangePkt::CanPush(uint32 seq) const {
+  if (ack_hdr_.num_nacks_ == 0)
+    return true;
+  if (seq <= last_seq_ || ack_hdr_.num_nacks_ == UINT16_MAX)
+    return false;
+  if (seq - ack_hdr_.start_nack_seq_ < kMaxBitmapSeqs)
+    return true;
+  if (is_runs_full_)
+    return false;
+  if (seq == last_seq_ + 1 && runs_[num_runs_*2-1] < UINT16_MAX)  /** Extends the last run. */
+    return true;
+  return num_runs_ < kMaxRuns && seq - last_seq_ - 1 <= UINT16_MAX;
+}
+
+void AckRangePkt::PushNack(uint32 seq) {
+  assert(CanPush(seq));
+  if (ack_hdr_.num_nacks_ == 0)
+    ack_hdr_.start_nack_seq_ = seq;
+
+  uint32 rel_seq = seq - ack_hdr_.start_nack_seq_;
+  if (rel_seq < kMaxBitmapSeqs)
+    bitmap_[rel_seq / 8] |= (1 << (rel_seq % 8));
+
+  if (!is_runs_full_) {
+    if (num_runs_ > 0 && seq == last_seq_ + 1 && runs_[num_runs_*2-1] < UINT16_MAX) {
+      runs_[num_runs_*2-1]++;
+    }
+    else if (num_runs_ < kMaxRuns && (num_runs_ == 0 || seq - last_seq_ - 1 <= UINT16_MAX)) {
+      runs_[num_runs_*2] = num_runs_ ? seq - last_seq_ - 1 : 0;
+      runs_[num_runs_*2+1] = 1;
+      num_runs_++;
+    }
+    else {
+      is_runs_full_ = true;
+    }
+  }
+  last_seq_ = seq;
+  ack_hdr_.num_nacks_++;
+}
+
+uint16 AckRangePkt::Pack() {
+  uint32 bitmap_len = BitmapLen();
+  uint16 runs_len = num_runs_ * 2 * sizeof(uint16);
+  if (!is_runs_full_ && (runs_len <= bitmap_len || bitmap_len > kMaxPayload)) {
+    format_ = kRuns;
+    payload_len_ = runs_len;
+    memcpy(payload_, runs_, runs_len);
+  }
+  else {
+    assert(bitmap_len <= kMaxPayload);
+    format_ = kBitmap;
+    payload_len_ = bitmap_len;
+    memcpy(payload_, bitmap_, bitmap_len);
+  }
+  uint16 len = offsetof(AckRangePkt, payload_) + payload_len_;
+  assert(len <= PKT_SIZE);
+  return len;
+}
+
+void AckRangePkt::ParseNack(char *type, uint32 *ack_seq, uint16 *num_nacks, uint32 *end_seq, int* client_id, int* bs_id, 
+                            NackRun *runs, uint16 *num_runs, uint16 *num_pkts) const {
+  *type = (ack_hdr_.type_ == DATA_ACK_RANGE) ? DATA_ACK : RAW_ACK;
+  *ack_seq = ack_hdr_.ack_seq_;
+  *num_nacks = ack_hdr_.num_nacks_;
+  *end_seq = ack_hdr_.end_seq_;
+  *client_id = ack_hdr_.client_id_;
+  *bs_id = ack_hdr_.bs_id_;
+  if (num_pkts)
+    *num_pkts = ack_hdr_.num_pkts_;
+  *num_runs = 0;
+  uint16 payload_len = payload_len_ < kMaxPayload ? payload_len_ : kMaxPayload;
+  if (format_ == kRuns) {
+    const uint16 *pairs = (const uint16*)payload_;
+    uint32 seq = ack_hdr_.start_nack_seq_;
+    for (int i = 0; i < payload_len / (2 * sizeof(uint16)); i++) {
+      seq += pairs[i*2];
+      if (pairs[i*2+1] > 0) {
+        runs[*num_runs].seq = seq;
+        runs[*num_runs].len = pairs[i*2+1];
+        (*num_runs)++;
+      }
+      seq += pairs[i*2+1];
+    }
+  }
+  else {
+    /** Skip the bytes without any loss, then follow the run bit by bit. */
+    uint32 num_bits = payload_len * 8, i = 0;
+    while (i < num_bits) {
+      if (i % 8 == 0 && payload_[i/8] == 0) {
+        i += 8;
+      }
+      else if (payload_[i/8] & (1 << (i % 8))) {
+        uint32 start = i;
+        while (i < num_bits && (payload_[i/8] & (1 << (i % 8))))
+          i++;
+        runs[*num_runs].seq = ack_hdr_.start_nack_seq_ + start;
+        runs[*num_runs].len = i - start;
+        (*num_runs)++;
+      }
+      else {
+        i++;
+      }
+    }
+  }
+}
+
 /**
  * Print the nack packet info.
  */ /*
@@ -455,24 +659,26 @@ void TxRawBuf::PushPktStatus(vector<RawPktSendStatus> &status_vec, const RawPktS
   UnLock();
 }
 
-void TxRawBuf::PopPktStatus(uint32 end_seq, uint16 num_nacks, uint16 num_pkts, 
-        const uint32 *nack_seq_arr, std::vector<RawPktSendStatus> &status_vec) {
+void TxRawBuf::PopPktStatus(uint32 end_seq, uint16 num_pkts, 
+        const NackRun *nack_runs, uint16 num_runs, std::vector<RawPktSendStatus> &status_vec) {
   Lock();
-  PushPkts(end_seq, num_nacks, num_pkts, nack_seq_arr);
+  PushPkts(end_seq, num_pkts, nack_runs, num_runs);
   PopPktStatus(status_vec);
   UnLock();
 }
 
-void TxRawBuf::PushPkts(uint32 end_seq, uint16 num_nacks, uint16 num_pkts, const uint32 *nack_seq_arr) {
-  /** First store all the nacks. */
-  for (int i = 0; i < num_nacks; i++) {
-    int ind = GetInd(nack_seq_arr[i]);
-    if (ind < 0) {
-      printf("Warning: PushPkts: ind[%d] < 0 nack_seq[%u]\n", ind, nack_seq_arr[i]);
+void TxRawBuf::PushPkts(uint32 end_seq, uint16 num_pkts, const NackRun *nack_runs, uint16 num_runs) {
+  /** First store all the nacks, a run at a time. */
+  for (int i = 0; i < num_runs; i++) {
+    int ind = GetInd(nack_runs[i].seq);
+    if (ind < 0 || GetInd(nack_runs[i].seq + nack_runs[i].len - 1) < 0) {
+      printf("Warning: PushPkts: ind[%d] < 0 nack_seq[%u] len[%u]\n", ind, nack_runs[i].seq, nack_runs[i].len);
       return;
     }
-    assert(info_deq_[ind].status_ == RawPktSendStatus::kUnknown);
-    info_deq_[ind].status_ = RawPktSendStatus::kBad;
+    for (int j = ind; j < ind + nack_runs[i].len; j++) {
+      assert(info_deq_[j].status_ == RawPktSendStatus::kUnknown);
+      info_deq_[j].status_ = RawPktSendStatus::kBad;
+    }
   }
 
   /** Put the good packets. */
@@ -497,7 +703,6 @@ void TxRawBuf::PushPkts(uint32 end_seq, uint16 num_nacks, uint16 num_pkts, const
 }
 
 void TxRawBuf::PopPktStatus(vector<RawPktSendStatus> &pkt_status_vec) {
-  pkt_status_vec.clear();
   deque<RawPktSendStatus>::iterator it;
   for (it = info_deq_.begin(); it != info_deq_.end(); it++) {
     if (it->status_ != RawPktSendStatus::kUnknown) {
@@ -534,6 +739,32 @@ void TxRawBuf::Print(bool is_lock) {
     UnLock();
 }
 
+void AckContext::Push(const char *buf, uint16 len) {
+  assert(size_ < kNumSlots);
+  int tail = (head_ + size_) % kNumSlots;
+  lens_[tail] = len < PKT_SIZE ? len : PKT_SIZE;
+  memcpy(pkts_ + tail * PKT_SIZE, buf, lens_[tail]);
+  size_++;
+}
+
+bool AckContext::ParseNack(const char *pkt, uint16 len, char *type, uint32 *ack_seq, uint16 *num_nacks, uint32 *end_seq, 
+                           int* client_id, int* bs_id, NackRun *runs, uint16 *num_runs, uint16 *num_pkts) {
+  /** The slots are reused, bytes past len are left from an older ack. */
+  if (*pkt == DATA_ACK_RANGE || *pkt == RAW_ACK_RANGE) {
+    const AckRangePkt *ack = (const AckRangePkt*)pkt;
+    if (len < AckRangePkt::HeaderLen() || ack->ParsedLen() > len)
+      return false;
+    ack->ParseNack(type, ack_seq, num_nacks, end_seq, client_id, bs_id, runs, num_runs, num_pkts);
+  }
+  else {
+    const AckPkt *ack = (const AckPkt*)pkt;
+    if (len < sizeof(AckHeader) || ack->ParsedLen() > len)
+      return false;
+    ack->ParseNack(type, ack_seq, num_nacks, end_seq, client_id, bs_id, runs, num_runs, num_pkts);
+  }
+  return true;
+}
+
 int AckContext::WaitFill(int wait_ms) {
   struct timespec time_to_wait = {0, 0};
   struct timeval now;
@@ -569,3 +800,32 @@ void BSStatsPkt::Print() const {
   printf("BSStatsPkt: type: %d seq: %u bs: %d client: %d throughput: %.3f\n", 
          type_, seq_, bs_id_, client_id_, throughput_);
 }
+
+void BSReportPkt::Init(uint32 seq, int bs_id) {
+  assert(offsetof(BSReportPkt, clients_) == kHdrLen);
+  type_ = BS_REPORT;
+  version_ = kVersion;
+  num_clients_ = 0;
+  seq_ = seq;
+  bs_id_ = bs_id;
+}
+
+bool BSReportPkt::AddClient(const BSClientReport &report) {
+  if (num_clients_ >= kMaxClients)
+    return false;
+  clients_[num_clients_++] = report;
+  return true;
+}
+
+void BSReportPkt::Print() const {
+  printf("BSReportPkt: type: %d version: %u seq: %u bs: %d clients: %u\n", 
+         type_, version_, seq_, bs_id_, num_clients_);
+  for (int i = 0; i < num_clients_; i++) {
+    printf("  client: %d throughput: %.3f loss:", clients_[i].client_id_, clients_[i].throughput_);
+    for (int j = 0; j < kNumRateInds; j++) {
+      if (clients_[i].loss_[j] != INVALID_LOSS_RATE)
+        printf(" %u:%.3f", kRateTable[j].rate, clients_[i].loss_[j]);
+    }
+    printf("\n");
+  }
+}
@@ -3,12 +3,15 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
 #include <deque>
 #include <map>
 #include <vector>
@@ -17,6 +20,8 @@
 #include "time_util.h"
 #include "monotonic_timer.h"
 #include "feedback_records.h"
+#include "timer_wheel.h"
+#include "rate_table.h"
 
 /* Parameter to be tuned */
 #define BUF_SIZE 500
@@ -36,6 +41,9 @@ static const int kMaxRawBufSize = 4000;
 #define BS_STATS 8
 #define CONTROLLER_TO_CLIENT 9
 #define CLIENT_TO_CONTROLLER 10
+#define DATA_ACK_RANGE 11
+#define RAW_ACK_RANGE 12
+#define BS_REPORT 13
 
 #define INVALID_SEQ_NUM 0
 #define INVALID_LOSS_RATE (-1)
@@ -50,20 +58,6 @@ static const int kMaxRawBufSize = 4000;
 //#define DEBUG_BASIC_BUF
 //#define TEST
 
-#define ATH5K_RATE_CODE_1M  0x1B
-#define ATH5K_RATE_CODE_2M  0x1A
-#define ATH5K_RATE_CODE_5_5M  0x19
-#define ATH5K_RATE_CODE_11M  0x18
-/* A and G */
-#define ATH5K_RATE_CODE_6M  0x0B
-#define ATH5K_RATE_CODE_9M  0x0F
-#define ATH5K_RATE_CODE_12M  0x0A
-#define ATH5K_RATE_CODE_18M  0x0E
-#define ATH5K_RATE_CODE_24M  0x09
-#define ATH5K_RATE_CODE_36M  0x0D
-#define ATH5K_RATE_CODE_48M  0x08
-#define ATH5K_RATE_CODE_54M  0x0C
-
 #define RAND_DROP
 
 typedef unsigned char uint8;
@@ -76,17 +70,7 @@ enum Status {
   kOccupiedRetrans = 3,      /** stores a packet should be retransmited. */
   kOccupiedOutbound = 4,     /** a packet transmitted but does not got ack. */
 };
-  
-typedef struct {
-  uint32  seq_num;
-  Status  status;
-  uint16  len;    /** Length of shim layer header + data */
-  uint8  num_retrans;
-  TIME   timestamp;
-  uint16  rate;
-  uint8  num_dups;  /** number of duplications. */
-  double  batch_duration;  /** Time to finish sending the entire batch. */
-} BookKeeping;
+
 
 void Perror(char *msg, ...);
 
@@ -95,12 +79,12 @@ class BasicBuf {
   BasicBuf(): kSize(BUF_SIZE), head_pt_(0), tail_pt_(0) {
     // Clear bookkeeping
     for (int i = 0; i < kSize; i++) {
-      book_keep_arr_[i].seq_num = 0;
-      book_keep_arr_[i].status = kEmpty;
-      book_keep_arr_[i].len = 0;
-      book_keep_arr_[i].num_retrans = 0;
-      book_keep_arr_[i].timestamp.GetCurrTime();
-      book_keep_arr_[i].num_dups = 0;
+      seq_num_arr_[i] = 0;
+      status_arr_[i] = kEmpty;
+      len_arr_[i] = 0;
+      num_retrans_arr_[i] = 0;
+      timestamp_arr_[i].GetCurrTime();
+      num_dups_arr_[i] = 0;
     }
     // clear packet buffer
     bzero(pkt_buf_, sizeof(pkt_buf_));
@@ -236,7 +220,12 @@ class BasicBuf {
     
   void AcquireHeadLock(uint32 *index);    // Function acquires and releases qlock_ inside
 
-  bool AcquireTailLock(uint32 *index);    // Function acquires and releases qlock_ inside
+  /**
+   * Function acquires and releases qlock_ inside.
+   * @param [out] seq_num: if not NULL, the sequence number assigned to the slot,
+   * taken under qlock_ so concurrent producers never share one.
+   */
+  bool AcquireTailLock(uint32 *index, uint32 *seq_num = NULL);
 
   void UpdateBookKeeping(uint32 index, uint32 seq_num, Status status, uint16 len);
 
@@ -249,6 +238,13 @@ class BasicBuf {
 
   uint8 GetNumDups(uint32 index) const;
 
+  /** 
+   * Empty the slots of the packets [begin, end), given as absolute positions
+   * like head_pt_, with a few memsets. Takes no element lock: the caller holds
+   * qlock_ and nobody else may touch those slots.
+   */
+  void ClearBookKeeping(uint32 begin, uint32 end);
+
   /*
   add by Lei
 
@@ -260,49 +256,57 @@ class BasicBuf {
     if (index < 0 || index > BUF_SIZE-1) {
       Perror("GetElementStatus invalid index: %d\n", index);
     }
-    return book_keep_arr_[index].status;
+    return status_arr_[index];
   }
 
   uint32& GetElementSeqNum(uint32 index) {
     if (index < 0 || index > BUF_SIZE-1) {
       Perror("GetElementSeqNm invalid index: %d\n", index);
     }
-    return book_keep_arr_[index].seq_num;
+    return seq_num_arr_[index];
   }
 
   uint16& GetElementLen(uint32 index) {
     if (index < 0 || index > BUF_SIZE-1) {
       Perror("GetElementLen invalid index: %d\n", index);
     }
-    return book_keep_arr_[index].len;
+    return len_arr_[index];
   }
 
   uint8& GetElementNumRetrans(uint32 index) {
     if (index < 0 || index > BUF_SIZE-1) {
       Perror("GetElementRetrans invalid index: %d\n", index);
     }
-    return book_keep_arr_[index].num_retrans;
+    return num_retrans_arr_[index];
   }
 
   TIME& GetElementTimeStamp(uint32 index) {
     if (index < 0 || index > BUF_SIZE-1) {
       Perror("GetElementTimeStamp invalid index: %d\n", index);
     }
-    return book_keep_arr_[index].timestamp;
+    return timestamp_arr_[index];
   }
 
   double& GetElementBatchDuration(uint32 index) {
     if (index < 0 || index > BUF_SIZE-1) {
       Perror("GetElementBatchSendTime invalid index: %u\n", index);
     }
-    return book_keep_arr_[index].batch_duration;
+    return batch_duration_arr_[index];
   }
 
 // Data member
   const uint32 kSize;
   uint32 head_pt_;
   uint32 tail_pt_;  
-  BookKeeping book_keep_arr_[BUF_SIZE];
+  /** Bookkeeping of every slot, one array per field. */
+  uint32 seq_num_arr_[BUF_SIZE];
+  Status status_arr_[BUF_SIZE];
+  uint16 len_arr_[BUF_SIZE];          /** Length of shim layer header + data */
+  uint8 num_retrans_arr_[BUF_SIZE];
+  TIME timestamp_arr_[BUF_SIZE];
+  uint16 rate_arr_[BUF_SIZE];
+  uint8 num_dups_arr_[BUF_SIZE];      /** number of duplications. */
+  double batch_duration_arr_[BUF_SIZE];  /** Time to finish sending the entire batch. */
   char pkt_buf_[BUF_SIZE][PKT_SIZE];
   pthread_mutex_t qlock_;
   pthread_mutex_t lock_arr_[BUF_SIZE];
@@ -311,10 +315,17 @@ class BasicBuf {
 
 class TxDataBuf: public BasicBuf {
  public:
-  TxDataBuf(): curr_pt_(0), num_retrans_(0) {}  
+  /** Resolution of the retransmission timers. */
+  static const int kRetransTimerTickUs = 1000;
+
+  TxDataBuf(): curr_pt_(0), num_retrans_(0), is_woken_(false), dequeue_pt_(0), retrans_timer_(BUF_SIZE, kRetransTimerTickUs), rto_us_(0), 
+               num_full_drops_(0) {
+    Pthread_mutex_init(&timer_lock_, NULL);
+  }  
 
   ~TxDataBuf() {
     curr_pt_ = 0;
+    Pthread_mutex_destroy(&timer_lock_);
   }
 
   void AcquireCurrLock(uint32 *index);
@@ -342,6 +353,26 @@ class TxDataBuf: public BasicBuf {
    */
   void EnqueuePkt(uint16 len, uint8 *pkt);
 
+  /**
+   * Reserve the next free slot so that a packet can be received into it in place.
+   * The slot stays locked until CommitSlot is called.
+   * @param [out] index: the index of the reserved slot.
+   * @param [out] seq_num: the sequence number assigned to the slot.
+   * @param [out] buf: the address of the slot, PKT_SIZE bytes.
+   * @return false if the buffer is full.
+   */
+  bool ReserveSlot(uint32 *index, uint32 *seq_num, uint8 **buf);
+
+  /** Publish a slot from ReserveSlot holding a packet of len bytes. */
+  void CommitSlot(uint32 index, uint32 seq_num, uint16 len);
+
+  /**
+   * Give up a slot from ReserveSlot without a packet. It goes back to the tail
+   * if it is still the last reservation, otherwise it is left empty and its 
+   * sequence number is skipped like that of a dropped packet.
+   */
+  void ReleaseSlot(uint32 index, uint32 seq_num);
+
   /**
    * Dequeue the current packet pointed by the current pointer.
    * Only return the packet if it's in the new status or retransmission
@@ -358,6 +389,21 @@ class TxDataBuf: public BasicBuf {
    */
   bool DequeuePkt(int time_out, uint32 *seq_num, uint16 *len, Status *status, uint8 *num_retrans, uint32 *index, uint8 **buf);
 
+  /**
+   * Count the retransmissions waiting at the current pointer in sequence, 
+   * starting from seq_num, without dequeuing them.
+   * @param [in] max_cnt: stop counting at max_cnt packets.
+   * @param [out] max_len: the length of the longest one.
+   */
+  int CountRetransRun(uint32 seq_num, int max_cnt, uint16 *max_len);
+
+  /**
+   * Dequeue the packet at the current pointer without waiting, only if it is
+   * the retransmission of seq_num. Same outputs as DequeuePkt.
+   * @return true if the packet is dequeued.
+   */
+  bool DequeueRetransPkt(uint32 seq_num, uint16 *len, uint8 *num_retrans, uint32 *index, uint8 **buf);
+
   /**
    * Update the sending time and batch_duration.
    * @param [in] batch_duration: time to finish sending the entire batch.
@@ -371,9 +417,67 @@ class TxDataBuf: public BasicBuf {
 
   void DisableRetransmission(uint32 index);
 
+  /**
+   * With qlock_ held, wait until the DequeuePkt that may still be updating 
+   * one of the slots [begin, end) after releasing qlock_ is done with it.
+   * Then nobody else touches the slots below curr_pt_, see ClearBookKeeping.
+   */
+  void WaitDequeue(uint32 begin, uint32 end) {
+    if (dequeue_pt_ >= begin && dequeue_pt_ < end) {
+      LockElement(dequeue_pt_ % kSize);
+      UnLockElement(dequeue_pt_ % kSize);
+    }
+  }
+
+  /** Make a DequeuePkt waiting on the empty buffer return now as if it timed out. */
+  void WakeUp();
+
+  /**
+   * Account one retransmission of a locked kOccupiedOutbound slot that is 
+   * repaired by other means, restarting its retransmission timer.
+   */
+  void ConsumeRetrans(uint32 index);
+
+  /** Retransmission timeout of the packets sent from now on, in us. */
+  void set_rto_us(int rto_us) {
+    Pthread_mutex_lock(&timer_lock_);
+    rto_us_ = rto_us;
+    Pthread_mutex_unlock(&timer_lock_);
+  }
+
+  int rto_us() const { return rto_us_; }
+
+  /**
+   * Collect the slots whose retransmission timer expired. DequeuePkt arms the 
+   * timer of a slot when it sends the packet out. Acked slots are not disarmed,
+   * so the caller checks that a slot is still kOccupiedOutbound.
+   * @param [out] indices: the expired slots are appended to it.
+   */
+  void ExpireRetransTimers(std::vector<uint32> *indices);
+
+  /** @return ms until the next retransmission timer may expire, -1 if none is armed. */
+  int NextRetransTimeOut();
+
+  /** Packets dropped because ReserveSlot found the buffer full. */
+  uint64_t num_full_drops() const { return num_full_drops_.load(std::memory_order_relaxed); }
+
 // Data member
   uint32 curr_pt_;
   uint8 num_retrans_;
+  bool is_woken_;
+  uint32 dequeue_pt_;   /** Position of the slot handed out last by AcquireCurrLock. */
+
+ private:
+  /** Hand out the packet of a locked slot for sending and mark it kOccupiedOutbound. */
+  void MarkOutbound(uint32 index, Status status, uint8 *num_retrans, uint8 **buf);
+
+  /** Arm the retransmission timer of the slot to fire in extra_us + rto_us_. */
+  void ArmRetransTimer(uint32 index, int extra_us = 0);
+
+  TimerWheel retrans_timer_;    // Indexed by slot.
+  int rto_us_;
+  std::atomic<uint64_t> num_full_drops_;  // Any thread that enqueues counts.
+  pthread_mutex_t timer_lock_;  // Innermost, taken under the queue or element locks.
 };
 
 class RxRcvBuf: public BasicBuf {
@@ -519,6 +623,9 @@ class ControllerToClientHeader {
   void set_type (char type) { type_ = type; }
   char type() const { return type_; }
 
+  /** Used to steer the packet to its client's receive shard. */
+  static uint16 client_id_offset() { return offsetof(ControllerToClientHeader, client_id_); }
+
  private:
   char type_;
   int client_id_;
@@ -550,6 +657,7 @@ class AckHeader {
   void set_ids(int client_id, int bs_id) { client_id_ = client_id; bs_id_ = bs_id; }
   int client_id() const { return client_id_; }
   int bs_id() const { return bs_id_; }
+  static uint16 client_id_offset() { return offsetof(AckHeader, client_id_); }
 // Data
   char type_;
   uint16 num_nacks_;        // number of nacks in the packet 
@@ -570,6 +678,7 @@ class GPSHeader {
 
   uint32 seq() const { assert(seq_ > 0); return seq_; }
   int client_id() const { return client_id_; }
+  static uint16 client_id_offset() { return offsetof(GPSHeader, client_id_); }
   double speed() const { assert(speed_ >= 0); return speed_; }
 
  private: 
@@ -600,6 +709,59 @@ class GPSLogger {
   FILE *fp_;
 };
 
+/** A run of lost sequence numbers [seq, seq + len). */
+struct NackRun {
+  uint32 seq;
+  uint16 len;
+};
+
+/**
+ * Walks the lost sequence numbers of an array of NackRuns in order, 
+ * one at a time, the way the nack array used to be indexed.
+ */
+class NackCursor {
+ public:
+  NackCursor(const NackRun *runs, uint16 num_runs) 
+    : runs_(runs), num_runs_(num_runs), run_ind_(0), offset_(0), cnt_(0) {}
+  ~NackCursor() {}
+
+  bool IsDone() const { return run_ind_ >= num_runs_; }
+
+  /** Current lost sequence number. Valid if !IsDone(). */
+  uint32 seq() const { return runs_[run_ind_].seq + offset_; }
+
+  /** Number of sequence numbers passed so far. */
+  uint16 cnt() const { return cnt_; }
+
+  void Next() {
+    cnt_++;
+    if (++offset_ >= runs_[run_ind_].len) {
+      run_ind_++;
+      offset_ = 0;
+    }
+  }
+
+  /** Skip the lost sequence numbers below seq, whole runs at a time. */
+  void SkipTo(uint32 seq) {
+    while (!IsDone() && runs_[run_ind_].seq + runs_[run_ind_].len <= seq) {
+      cnt_ += runs_[run_ind_].len - offset_;
+      run_ind_++;
+      offset_ = 0;
+    }
+    if (!IsDone() && this->seq() < seq) {
+      cnt_ += seq - this->seq();
+      offset_ = seq - runs_[run_ind_].seq;
+    }
+  }
+
+ private:
+  const NackRun *runs_;
+  uint16 num_runs_;
+  uint16 run_ind_;
+  uint16 offset_;
+  uint16 cnt_;
+};
+
 class AckPkt {
  public:
   AckPkt() { bzero(rel_seq_arr_, sizeof(rel_seq_arr_)); }
@@ -609,12 +771,24 @@ class AckPkt {
 
   void ParseNack(char *type, uint32 *ack_seq, uint16 *num_nacks, uint32 *end_seq, int* client_id, int* bs_id, uint32 *seq_arr, uint16 *num_pkts=NULL);
 
+  /**
+   * Same as above, but merge consecutive nacks into runs.
+   * @param [out] runs: At most ACK_WINDOW runs.
+   */
+  void ParseNack(char *type, uint32 *ack_seq, uint16 *num_nacks, uint32 *end_seq, int* client_id, int* bs_id, 
+                 NackRun *runs, uint16 *num_runs, uint16 *num_pkts=NULL) const;
+
   uint16 GetLen() {
     uint16 len = sizeof(ack_hdr_) + sizeof(rel_seq_arr_[0]) * ack_hdr_.num_nacks_;
     assert(len <= PKT_SIZE && len > 0);
     return len;
   }
 
+  /** Bytes ParseNack reads, by the header: the nacks past ACK_WINDOW are ignored. */
+  uint16 ParsedLen() const {
+    return sizeof(ack_hdr_) + sizeof(rel_seq_arr_[0]) * std::min<int>(ack_hdr_.num_nacks_, ACK_WINDOW);
+  }
+
   //void Print();
 
   bool IsFull() { return ack_hdr_.num_nacks() >= ACK_WINDOW; }
@@ -645,6 +819,91 @@ inline void AckPkt::PushNack(uint32 seq) {
   ack_hdr_.num_nacks_++;
 }
 
+/**
+ * Compact form of AckPkt sent as DATA_ACK_RANGE or RAW_ACK_RANGE. The nacks
+ * are encoded either as runs of losses, i.e., pairs of uint16 {gap from the 
+ * end of the previous run, length}, or as a bitmap from start_nack_seq_, 
+ * whichever is shorter: runs for bursty losses, the bitmap for scattered ones. 
+ * The receiver gets the runs back without expanding every sequence number.
+ */
+class AckRangePkt {
+ public:
+  enum Format {
+    kRuns = 0,
+    kBitmap = 1,
+  };
+
+  static const int kMaxPayload = ACK_WINDOW * sizeof(uint16);
+  static const int kMaxRuns = kMaxPayload / (2 * sizeof(uint16));
+  static const uint32 kMaxBitmapSeqs = kMaxPayload * 8;
+  /** Most runs ParseNack can return - a bitmap of alternating losses. */
+  static const int kMaxParsedRuns = kMaxBitmapSeqs / 2;
+
+  AckRangePkt() : format_(kRuns), payload_len_(0), last_seq_(0), num_runs_(0), is_runs_full_(false) {
+    bzero(bitmap_, sizeof(bitmap_));
+  }
+  ~AckRangePkt() {}
+
+  /** @param type: DATA_ACK_RANGE or RAW_ACK_RANGE. */
+  void Init(char type);
+
+  /** 
+   * @return true if seq can still be nacked by this packet. 
+   * The seqs must be pushed in increasing order.
+   */
+  bool CanPush(uint32 seq) const;
+
+  void PushNack(uint32 seq);
+
+  /** 
+   * Encode the nacks pushed so far in the shorter format.
+   * @return the number of bytes to send.
+   */
+  uint16 Pack();
+
+  /**
+   * Parse the packet, see AckPkt::ParseNack.
+   * @param [out] type: DATA_ACK or RAW_ACK, the kind of feedback.
+   * @param [out] runs: At most kMaxParsedRuns runs.
+   */
+  void ParseNack(char *type, uint32 *ack_seq, uint16 *num_nacks, uint32 *end_seq, int* client_id, int* bs_id, 
+                 NackRun *runs, uint16 *num_runs, uint16 *num_pkts=NULL) const;
+
+  /** Length of everything before the payload. */
+  static uint16 HeaderLen() { return offsetof(AckRangePkt, payload_); }
+
+  /** Bytes ParseNack reads, by the header, valid once HeaderLen bytes arrived. */
+  uint16 ParsedLen() const { 
+    return HeaderLen() + (payload_len_ < kMaxPayload ? payload_len_ : kMaxPayload); 
+  }
+
+  uint16 num_nacks() const { return ack_hdr_.num_nacks(); }
+
+  void set_end_seq(uint32 end_seq) { ack_hdr_.set_end_seq(end_seq); }
+
+  void set_num_pkts(uint16 num_pkts) { ack_hdr_.set_num_pkts(num_pkts); }
+
+  void set_ids(int client_id, int bs_id) { ack_hdr_.set_ids(client_id, bs_id); }
+
+ private:
+  uint32 BitmapLen() const { 
+    return ack_hdr_.num_nacks_ ? (last_seq_ - ack_hdr_.start_nack_seq_) / 8 + 1 : 0; 
+  }
+
+  /** Sent over the air. */
+  AckHeader ack_hdr_;
+  uint8 format_;
+  uint16 payload_len_;
+  uint8 payload_[kMaxPayload];
+
+  /** Both encodings are built while pushing, not sent. */
+  uint32 last_seq_;
+  uint16 num_runs_;
+  bool is_runs_full_;   /** The runs no longer fit in the payload. */
+  uint16 runs_[kMaxRuns * 2];
+  uint8 bitmap_[kMaxPayload];
+};
+
 class BSStatsPkt {
  public:
   BSStatsPkt() {
@@ -663,6 +922,47 @@ class BSStatsPkt {
   double throughput_;
 };
 
+/** Latest throughput and back loss rates of one client, in a BSReportPkt. */
+struct BSClientReport {
+  int client_id_;
+  double throughput_;         /** In Mbps, as in BSStatsPkt. */
+  float loss_[kNumRateInds];  /** By rate index of kRateTable, INVALID_LOSS_RATE if unknown. */
+};
+
+/**
+ * The stats of all the clients of a base station to the controller in one 
+ * datagram, in place of a BSStatsPkt per client and update. Only the first 
+ * num_clients_ entries are sent, @see GetLen().
+ */
+class BSReportPkt {
+ public:
+  static const uint8 kVersion = 1;    /** Of the format, bumped on any layout change. */
+  static const int kHdrLen = 16;      /** Up to clients_, aligned for their doubles. */
+  static const int kMaxClients = (PKT_SIZE - kHdrLen) / sizeof(BSClientReport);
+
+  BSReportPkt() {
+    bzero(&type_, sizeof(BSReportPkt));
+  }
+  ~BSReportPkt() {}
+
+  void Init(uint32 seq, int bs_id);
+
+  /** @return false if the report is full. */
+  bool AddClient(const BSClientReport &report);
+
+  uint16 GetLen() const { return kHdrLen + num_clients_ * sizeof(BSClientReport); }
+
+  void Print() const;
+
+  char type_;
+  uint8 version_;
+  uint16 num_clients_;
+  uint32 seq_;
+  int bs_id_;
+  uint32 reserved_;
+  BSClientReport clients_[kMaxClients];
+};
+
 inline uint32 Seq2Ind(uint32 seq) {
   return ((seq-1) % BUF_SIZE);
 }
@@ -721,11 +1021,11 @@ class TxRawBuf {
 
   /**
    * Push both acks and nacks into the status buf and pop out the information
-   * about each fresh raw packet. 
+   * about each fresh raw packet, appended to status_vec. 
    * Note: Locking is included.
    */
-  void PopPktStatus(uint32 end_seq, uint16 num_nacks, uint16 num_pkts, 
-        const uint32 *nack_seq_arr, std::vector<RawPktSendStatus> &status_vec);
+  void PopPktStatus(uint32 end_seq, uint16 num_pkts, 
+        const NackRun *nack_runs, uint16 num_runs, std::vector<RawPktSendStatus> &status_vec);
 
   /**
    * Delete the records. Used for HandleTimeOut.
@@ -758,7 +1058,7 @@ class TxRawBuf {
   void Lock() { Pthread_mutex_lock(&lock_); }
   void UnLock() { Pthread_mutex_unlock(&lock_); }
 
-  void PushPkts(uint32 end_seq, uint16 num_nacks, uint16 num_pkts, const uint32 *nack_seq_arr);
+  void PushPkts(uint32 end_seq, uint16 num_pkts, const NackRun *nack_runs, uint16 num_runs);
 
   void PopPktStatus(std::vector<RawPktSendStatus> &pkt_status_vec);
 
@@ -769,19 +1069,23 @@ class TxRawBuf {
 };
 
 /**
- * Class to handle two types of ACKs - DATA_ACK and RAW_ACK.  
+ * The feedback queue of a client: both DATA_ACK and RAW_ACK, in either 
+ * encoding, in the order TxRcvCell receives them. Drained by the client's 
+ * single TxHandleFeedback stage.
  */
 class AckContext {
  public:
-  AckContext(char type) : type_(type), ack_available_(false) {
-    pkt_ = new AckPkt;
+  static const int kNumSlots = 64;
+
+  AckContext() : head_(0), size_(0) {
+    pkts_ = new char[kNumSlots * PKT_SIZE];
     Pthread_mutex_init(&lock_, NULL);
     Pthread_cond_init(&fill_cond_, NULL);
     Pthread_cond_init(&empty_cond_, NULL);
   }
 
   ~AckContext() {
-    delete pkt_;
+    delete[] pkts_;
     Pthread_mutex_destroy(&lock_);
     Pthread_cond_destroy(&fill_cond_);
     Pthread_cond_destroy(&empty_cond_);
@@ -796,62 +1100,79 @@ class AckContext {
   }
 
   /**
-   * Wait for the ack available from TxRcvCell or time out.
+   * Wait for an ack from TxRcvCell or time out.
    * @param wait_ms Time duration for timeout in ms.
    */
   int WaitFill(int wait_ms);
 
   /**
-   * Wait but no timeout is supported.
-   */
-  void WaitFill() {
-    Pthread_cond_wait(&fill_cond_, &lock_);
-  }
-
-  /**
-   * Signal when pkt is filled by TxRcvCell.
+   * Signal when an ack is pushed by TxRcvCell.
    */
   void SignalFill() {
     Pthread_cond_signal(&fill_cond_);
   }
 
   /**
-   * Wait for TxHandle to process the NACK packet.
+   * Wait for TxHandleFeedback to free a slot.
    */
   void WaitEmpty() {
     Pthread_cond_wait(&empty_cond_, &lock_);
   }
 
   /**
-   * Signal by TxHandle when it has finished processing the NACK packet.
+   * Signal by TxHandleFeedback when it has taken acks out.
    */
   void SignalEmpty() {
     Pthread_cond_signal(&empty_cond_);
   }
 
-  AckPkt* pkt() { return pkt_; }
+  bool IsEmpty() const { return size_ == 0; }
+
+  bool IsFull() const { return size_ == kNumSlots; }
 
-  bool ack_available() { return ack_available_; }
+  int size() const { return size_; }
 
-  void set_ack_available(bool ack_available) { ack_available_ = ack_available; }
+  /** Copy an ack in at the tail, the caller holds the lock and checked IsFull. */
+  void Push(const char *buf, uint16 len);
 
-  char type() { return type_; }
+  /** 
+   * The oldest ack.
+   * @param [out] len: the bytes Push copied in.
+   */
+  const char* Front(uint16 *len) const {
+    *len = lens_[head_];
+    return pkts_ + head_ * PKT_SIZE;
+  }
+
+  void Pop() {
+    assert(size_ > 0);
+    head_ = (head_ + 1) % kNumSlots;
+    size_--;
+  }
+
+  /** 
+   * Parse an ack, in either encoding. 
+   * @param [in] len: the bytes received, an ack whose header claims more is dropped.
+   * @param [out] type: DATA_ACK or RAW_ACK.
+   * @return false if the ack is truncated.
+   */
+  static bool ParseNack(const char *pkt, uint16 len, char *type, uint32 *ack_seq, uint16 *num_nacks, uint32 *end_seq, 
+                        int* client_id, int* bs_id, NackRun *runs, uint16 *num_runs, uint16 *num_pkts=NULL);
 
  private:
-  char type_;     /** Type of the packet - either DATA_ACK or RAW_ACK. */
-  AckPkt *pkt_;
-  bool ack_available_;
+  char *pkts_;    /** kNumSlots slots of AckPkt or AckRangePkt. */
+  uint16 lens_[kNumSlots];
+  int head_, size_;
   pthread_mutex_t lock_;
   pthread_cond_t  fill_cond_, empty_cond_;
 };
 
 class FeedbackHandler {
  public:
-  FeedbackHandler(char pkt_type) : raw_ack_context_(pkt_type) {}
+  FeedbackHandler() {}
   ~FeedbackHandler() {}
 
 // data member
-  AckContext raw_ack_context_;  /** Store the feedback packets with lock.*/
   TxRawBuf raw_pkt_buf_;        /** Store the raw sequence number for channel estimation. */
 };
 